@@ -1,6 +1,44 @@
 #include <lib.h>
 #include <fs/fs.h>
 
+// The block cache holds at most BC_NBLOCKS disk blocks.  Once it is
+// full, every miss evicts a block chosen by a CLOCK sweep over DISKMAP:
+// a block whose PTE_A is set gets a second chance (PTE_A is cleared by
+// remapping it), the first one not touched since the hand last passed
+// is the victim.  Dirty victims are written back before being unmapped.
+#define BC_NBLOCKS	4096
+
+// Clean blocks are mapped read-only.  The first write to one faults,
+// maps it writable and adds it to the dirty set, so PTE_W marks a dirty
+// block and a block is added once however often it is written.  The
+// dirty set is written back by fs_sync, in the order given by bc_rank,
+// and only between requests, so a commit never catches one half done.
+// Until then its metadata blocks stay cached.
+static uint32_t bc_dirty[BC_NBLOCKS];
+static uint32_t bc_ndirty;
+static uint32_t bc_nmeta;		// metadata blocks in the dirty set
+static uint32_t bc_commit[BC_NBLOCKS];	// metadata blocks of a write-back
+
+// Indirect and directory blocks, which point to other blocks
+static uint32_t bc_metamap[DISKSIZE / BLKSIZE / 32];
+
+// Blocks read ahead and not looked up since
+static uint32_t bc_ramap[DISKSIZE / BLKSIZE / 32];
+
+static uint32_t bc_nblocks;	// blocks mapped in DISKMAP
+static uint32_t bc_hand;	// next block the CLOCK hand looks at
+static struct {
+	uint32_t hit;		// file blocks found in the cache
+	uint32_t miss;		// blocks read in from disk
+	uint32_t evict;		// blocks evicted to bound the cache
+	uint32_t writeback;	// dirty victims written back
+	uint32_t sync;		// write-backs of the dirty set
+	uint32_t ra_read;	// read-ahead commands
+	uint32_t ra_blocks;	// blocks read ahead
+	uint32_t ra_hit;	// of them looked up later
+	uint32_t ra_waste;	// of them dropped before any lookup
+} bc_stat;
+
 // Return the virtual address of this disk block.
 void *
 diskaddr(uint32_t blockno)
@@ -22,7 +60,195 @@ va_is_mapped(void *va)
 bool
 va_is_dirty(void *va)
 {
-	return (uvpt[PGNUM(va)] & PTE_D) != 0;
+	return (uvpt[PGNUM(va)] & (PTE_D | PTE_W)) != 0;
+}
+
+// Is this virtual address accessed since the CLOCK hand last passed?
+static bool
+va_is_accessed(void *va)
+{
+	return (uvpt[PGNUM(va)] & PTE_A) != 0;
+}
+
+// First block after the superblock, the bitmap and the journal
+static uint32_t
+bc_reserved(void)
+{
+	if (super->s_njournal)
+		return super->s_journal + super->s_njournal;
+
+	return 2 + (super->s_nblocks + BLKBITSIZE - 1) / BLKBITSIZE;
+}
+
+// Record whether 'blockno' holds block pointers or directory entries.
+void
+bc_set_meta(uint32_t blockno, bool meta)
+{
+	uint32_t bit = 1 << (blockno % 32);
+
+	if (!meta) {
+		bc_metamap[blockno / 32] &= ~bit;
+		return;
+	}
+
+	// a block dirtied as data before it held pointers
+	if (!(bc_metamap[blockno / 32] & bit) && va_is_mapped(diskaddr(blockno)) &&
+	    va_is_dirty(diskaddr(blockno)))
+		bc_nmeta++;
+	bc_metamap[blockno / 32] |= bit;
+}
+
+// Does 'blockno' hold block pointers or directory entries?
+bool
+bc_is_meta(uint32_t blockno)
+{
+	return (bc_metamap[blockno / 32] & (1 << (blockno % 32))) != 0;
+}
+
+// Clear the read-ahead mark of 'blockno' and return whether it was set.
+static bool
+bc_test_ra(uint32_t blockno)
+{
+	uint32_t bit = 1 << (blockno % 32);
+
+	if (!(bc_ramap[blockno / 32] & bit))
+		return false;
+
+	bc_ramap[blockno / 32] &= ~bit;
+	return true;
+}
+
+// Write-back order of a block.  Data goes out before the bitmap that
+// allocates it, and both before the inodes and indirect blocks that
+// point to it, so a crash never leaves a pointer to unwritten data or
+// to a block the bitmap still considers free.
+static int
+bc_rank(uint32_t blockno)
+{
+	if (blockno == 1)
+		return 2;	// the superblock holds the root inode
+	if (blockno < bc_reserved())
+		return 1;
+	if (bc_is_meta(blockno))
+		return 2;
+	return 0;
+}
+
+// Make room in a full dirty set in the middle of a request: write the
+// data blocks back in place, which is safe at any time, and keep the
+// metadata blocks for the next commit.
+static void
+bc_flush_data(void)
+{
+	uint32_t i, n = 0;
+	void *va;
+
+	for (i = 0; i < bc_ndirty; i++) {
+		va = diskaddr(bc_dirty[i]);
+		if (!va_is_mapped(va) || !va_is_dirty(va))
+			continue;
+
+		if (bc_rank(bc_dirty[i]) == 0)
+			flush_block(va);
+		else
+			bc_dirty[n++] = bc_dirty[i];
+	}
+
+	if (n == BC_NBLOCKS)
+		panic("%s: %u dirty metadata blocks", __func__, n);
+	bc_ndirty = n;
+}
+
+// Add the block at va to the dirty set and let it be written.
+static void
+bc_mark_dirty(void *va)
+{
+	uint32_t blockno = ((uint32_t)va - DISKMAP) / BLKSIZE;
+	int ret;
+
+	if (bc_ndirty == BC_NBLOCKS)
+		bc_flush_data();
+
+	ret = sys_page_map(0, va, 0, va, (uvpt[PGNUM(va)] & PTE_SYSCALL) | PTE_W);
+	if (ret < 0)
+		panic("%s: sys_page_map %e", __func__, ret);
+
+	bc_dirty[bc_ndirty++] = blockno;
+	if (bc_rank(blockno) > 0)
+		bc_nmeta++;
+}
+
+// Can 'n' more metadata blocks be dirtied before the next commit?
+bool
+bc_meta_room(uint32_t n)
+{
+	return bc_nmeta + n <= journal_capacity();
+}
+
+// Should the dirty set be committed before the next request?  Half of
+// the journal is kept for the metadata of one request.
+bool
+bc_commit_due(void)
+{
+	return bc_nmeta >= journal_capacity() / 2;
+}
+
+// Give the cached block at va a second chance by clearing its PTE_A.
+// The remap keeps PTE_W, so a dirty block stays dirty.
+static void
+bc_age(void *va)
+{
+	int ret;
+
+	ret = sys_page_map(0, va, 0, va, uvpt[PGNUM(va)] & PTE_SYSCALL);
+	if (ret < 0)
+		panic("%s: sys_page_map %e", __func__, ret);
+}
+
+// Make room for one more block by evicting the first block the CLOCK
+// hand finds untouched.  The superblock, the bitmap and the journal are
+// never evicted, nor are dirty metadata blocks before their commit.
+static void
+bc_evict(void)
+{
+	uint32_t first, n;
+	void *va;
+
+	first = bc_reserved();
+
+	// the first lap may only clear PTE_A, the second one must succeed
+	for (n = 0; n < 2 * super->s_nblocks; n++) {
+		if (bc_hand < first || bc_hand >= super->s_nblocks)
+			bc_hand = first;
+
+		va = diskaddr(bc_hand);
+		if (!(uvpd[PDX(va)] & PTE_P)) {
+			// skip a whole unmapped page table at once
+			n += NPTENTRIES - 1 - PTX(va);
+			bc_hand += NPTENTRIES - PTX(va);
+			continue;
+		}
+		bc_hand++;
+
+		if (!(uvpt[PGNUM(va)] & PTE_P))
+			continue;
+
+		if (va_is_accessed(va)) {
+			bc_age(va);
+			continue;
+		}
+
+		if (va_is_dirty(va) && bc_rank(((uint32_t)va - DISKMAP) / BLKSIZE) > 0)
+			continue;
+
+		if (va_is_dirty(va))
+			bc_stat.writeback++;
+		evict_block(va);
+		bc_stat.evict++;
+		return;
+	}
+
+	panic("%s: no block to evict among %u cached", __func__, bc_nblocks);
 }
 
 // Fault any disk block that is read in to memory by
@@ -36,31 +262,61 @@ bc_pgfault(struct UTrapframe *utf)
 	void *block_addr = ROUNDDOWN(addr, PGSIZE);
 
 	// Check that the fault was within the block cache region
-	if (addr < (void *)DISKMAP || addr >= (void *)(DISKMAP + DISKSIZE))
+	if (addr < (void *)DISKMAP || addr >= (void *)(DISKMAP + DISKSIZE)) {
+		// copy-on-write pages left by forking the write-back timer
+		if ((utf->utf_err & FEC_WR) && (uvpd[PDX(addr)] & PTE_P) &&
+		    (uvpt[PGNUM(addr)] & PTE_COW)) {
+			pgfault(utf);
+			return;
+		}
+
 		panic("page fault in FS: eip %08x, va %p, err %04x",
 		      utf->utf_eip, addr, utf->utf_err);
+	}
 
 	// Sanity check the block number
 	if (super && blockno >= super->s_nblocks)
 		panic("reading non-existent block %08x\n", blockno);
 
+	// First write to a clean block
+	if (va_is_mapped(block_addr)) {
+		if (!(utf->utf_err & FEC_WR))
+			panic("page fault in FS: eip %08x, va %p, err %04x",
+			      utf->utf_eip, addr, utf->utf_err);
+
+		bc_mark_dirty(block_addr);
+		return;
+	}
+
+	if (bc_nblocks >= BC_NBLOCKS)
+		bc_evict();
+
 	// Allocate a page in the disk map region, read the contents
-	// of the block from the disk into that page.
-	ret = sys_page_alloc(0, block_addr, PTE_SYSCALL);
+	// of the block from the disk into that page, or from the journal
+	// if it holds a newer copy than the home location.
+	ret = sys_page_alloc(0, block_addr, PTE_W);
 	if (ret < 0)
 		panic("%s: sys_page_alloc %e", __func__, ret);
 
-	ret = ide_read(blockno * BLKSECTS, block_addr, BLKSECTS);
-	if (ret < 0)
-		panic("%s: ide_read %e", __func__, ret);
+	if (!super || !journal_read(blockno, block_addr)) {
+		ret = ide_read(blockno * BLKSECTS, block_addr, BLKSECTS);
+		if (ret < 0)
+			panic("%s: ide_read %e", __func__, ret);
+	}
 
 	// Clear the dirty bit for the disk block page since we just read the
-	// block from disk
+	// block from disk, and map it read-only until it is written
 	ret = sys_page_map(0, block_addr, 0, block_addr,
-				uvpt[PGNUM(block_addr)] & PTE_SYSCALL);
+				uvpt[PGNUM(block_addr)] & PTE_SYSCALL & ~PTE_W);
 	if (ret < 0)
 		panic("in %s, sys_page_map: %e", __func__, ret);
 
+	bc_nblocks++;
+	bc_stat.miss++;
+
+	if (utf->utf_err & FEC_WR)
+		bc_mark_dirty(block_addr);
+
 	// Check that the block we read was allocated.
 	// (exercise for the reader:
 	//    why do we do this *after* reading the block in?)
@@ -70,7 +326,7 @@ bc_pgfault(struct UTrapframe *utf)
 }
 
 // Flush the contents of the block containing VA out to disk if
-// necessary, then clear the PTE_D bit using sys_page_map.
+// necessary, then clear the PTE_D and PTE_W bits using sys_page_map.
 // If the block is not in the block cache or is not dirty, does
 // nothing.
 void
@@ -90,13 +346,244 @@ flush_block(void *addr)
 	if (ret < 0)
 		panic("%s: ide_write %e", __func__, ret);
 
-	/* clear dirty bit */
+	clean_block(block_addr);
+}
+
+// Mark the block containing VA clean once its contents are safe on
+// disk, by clearing PTE_D and PTE_W.  The next write adds it to the
+// dirty set again.
+void
+clean_block(void *addr)
+{
+	int ret;
+	void *block_addr = ROUNDDOWN(addr, PGSIZE);
+
 	ret = sys_page_map(0, block_addr, 0, block_addr,
-				uvpt[PGNUM(block_addr)] & PTE_SYSCALL);
+				uvpt[PGNUM(block_addr)] & PTE_SYSCALL & ~PTE_W);
 	if (ret < 0)
 		panic("%s: sys_page_map %e", __func__, ret);
 }
 
+// Write the block containing VA back if it is dirty and drop it from
+// the block cache.  The next access reads it in again.  A dirty
+// metadata block stays until the commit that logs it.
+void
+evict_block(void *addr)
+{
+	void *block_addr = ROUNDDOWN(addr, PGSIZE);
+
+	if (!va_is_mapped(block_addr))
+		return;
+
+	if (va_is_dirty(block_addr) &&
+	    bc_rank(((uint32_t)block_addr - DISKMAP) / BLKSIZE) > 0)
+		return;
+
+	flush_block(block_addr);
+	discard_block(block_addr);
+}
+
+// Drop the block containing VA from the block cache if it is clean.
+// A dirty block stays until it has been written back.
+void
+release_block(void *addr)
+{
+	if (va_is_mapped(addr) && !va_is_dirty(addr))
+		discard_block(addr);
+}
+
+// Drop the block containing VA from the block cache without writing
+// it back, for blocks that have just been freed.
+void
+discard_block(void *addr)
+{
+	int ret;
+	void *block_addr = ROUNDDOWN(addr, PGSIZE);
+
+	if (!va_is_mapped(block_addr))
+		return;
+
+	ret = sys_page_unmap(0, block_addr);
+	if (ret < 0)
+		panic("%s: sys_page_unmap %e", __func__, ret);
+
+	bc_nblocks--;
+	if (bc_test_ra(((uint32_t)block_addr - DISKMAP) / BLKSIZE))
+		bc_stat.ra_waste++;
+}
+
+// Map a zeroed page for the newly allocated block 'blockno' instead of
+// reading it from disk.  The page starts out in the dirty set, so the
+// zeroes reach the disk even if nobody writes to it.
+void *
+bc_alloc_block(uint32_t blockno)
+{
+	int ret;
+	void *addr = diskaddr(blockno);
+
+	if (va_is_mapped(addr)) {
+		memset(addr, 0, BLKSIZE);
+		return addr;
+	}
+
+	if (bc_nblocks >= BC_NBLOCKS)
+		bc_evict();
+
+	ret = sys_page_alloc(0, addr, 0);
+	if (ret < 0)
+		panic("%s: sys_page_alloc %e", __func__, ret);
+
+	bc_nblocks++;
+	bc_mark_dirty(addr);
+	return addr;
+}
+
+// Move the page at 'va' outside of DISKMAP into the cache as the newly
+// allocated block 'blockno', in the dirty set.
+void
+bc_insert_block(uint32_t blockno, void *va)
+{
+	int ret;
+	void *addr = diskaddr(blockno);
+
+	discard_block(addr);
+	if (bc_nblocks >= BC_NBLOCKS)
+		bc_evict();
+
+	ret = sys_page_map(0, va, 0, addr, PTE_W);
+	if (ret < 0)
+		panic("%s: sys_page_map %e", __func__, ret);
+
+	ret = sys_page_unmap(0, va);
+	if (ret < 0)
+		panic("%s: sys_page_unmap %e", __func__, ret);
+
+	bc_nblocks++;
+	bc_mark_dirty(addr);
+}
+
+// Return the address of block 'blockno' for an access through the file
+// layer, counting a hit if the block is already cached.  A miss is
+// counted by bc_pgfault once the access faults.
+void *
+bc_lookup(uint32_t blockno)
+{
+	void *addr = diskaddr(blockno);
+
+	if (va_is_mapped(addr)) {
+		bc_stat.hit++;
+		if (bc_test_ra(blockno))
+			bc_stat.ra_hit++;
+	}
+
+	return addr;
+}
+
+// Read the 'nblocks' blocks starting at 'blockno' into the cache ahead
+// of their use, with one IDE command per run of blocks not cached yet.
+// Blocks newer in the journal than on disk are left to bc_pgfault.
+void
+bc_readahead(uint32_t blockno, uint32_t nblocks)
+{
+	uint32_t end, n, i;
+	void *va;
+	int ret;
+
+	nblocks = MIN(nblocks, BC_NBLOCKS / 2);
+	for (end = blockno + nblocks; blockno < end; blockno += n) {
+		for (n = 0; blockno + n < end && n < 256 / BLKSECTS; n++) {
+			va = diskaddr(blockno + n);
+			if (va_is_mapped(va) || journal_pending(blockno + n))
+				break;
+		}
+
+		if (n == 0) {
+			n = 1;
+			continue;
+		}
+
+		// evict first, so the hand cannot pick a page of this run
+		while (bc_nblocks + n > BC_NBLOCKS)
+			bc_evict();
+
+		for (i = 0; i < n; i++) {
+			ret = sys_page_alloc(0, diskaddr(blockno + i), PTE_W);
+			if (ret < 0)
+				panic("%s: sys_page_alloc %e", __func__, ret);
+			bc_nblocks++;
+		}
+
+		ret = ide_read(blockno * BLKSECTS, diskaddr(blockno), n * BLKSECTS);
+		if (ret < 0)
+			panic("%s: ide_read %e", __func__, ret);
+
+		// clean and read-only until written, as in bc_pgfault
+		for (i = 0; i < n; i++) {
+			va = diskaddr(blockno + i);
+			ret = sys_page_map(0, va, 0, va,
+					   uvpt[PGNUM(va)] & PTE_SYSCALL & ~PTE_W);
+			if (ret < 0)
+				panic("%s: sys_page_map %e", __func__, ret);
+
+			bc_ramap[(blockno + i) / 32] |= 1 << ((blockno + i) % 32);
+		}
+
+		bc_stat.ra_read++;
+		bc_stat.ra_blocks += n;
+	}
+}
+
+// Write the dirty set back to disk and empty it: the data blocks in
+// place, then the metadata blocks, bitmap first, through the journal.
+// Blocks freed or written back since they were dirtied are no longer
+// writable and are skipped.
+void
+bc_sync(void)
+{
+	uint32_t i, n, nmeta = 0;
+	int rank;
+	void *va;
+
+	n = bc_ndirty;
+	for (i = 0; i < n; i++) {
+		va = diskaddr(bc_dirty[i]);
+		if (bc_rank(bc_dirty[i]) == 0 && va_is_mapped(va))
+			flush_block(va);
+	}
+
+	for (rank = 1; rank <= 2; rank++) {
+		for (i = 0; i < n; i++) {
+			if (bc_rank(bc_dirty[i]) == rank)
+				bc_commit[nmeta++] = bc_dirty[i];
+		}
+	}
+	journal_commit(bc_commit, nmeta);
+	bc_ndirty = 0;
+	bc_nmeta = 0;
+	bc_stat.sync++;
+
+	// dirties the bitmap for the next write-back
+	journal_release();
+}
+
+// Report the block cache occupancy and counters.
+void
+bc_info(struct Fsreq_info *info)
+{
+	info->bc_blocks = bc_nblocks;
+	info->bc_limit = BC_NBLOCKS;
+	info->bc_hit = bc_stat.hit;
+	info->bc_miss = bc_stat.miss;
+	info->bc_evict = bc_stat.evict;
+	info->bc_writeback = bc_stat.writeback;
+	info->bc_dirty = bc_ndirty;
+	info->bc_sync = bc_stat.sync;
+	info->ra_read = bc_stat.ra_read;
+	info->ra_blocks = bc_stat.ra_blocks;
+	info->ra_hit = bc_stat.ra_hit;
+	info->ra_waste = bc_stat.ra_waste;
+}
+
 // Test that the block cache works, by smashing the superblock and
 // reading it back.
 static void
@@ -115,7 +602,7 @@ check_bc(void)
 	assert(!va_is_dirty(diskaddr(1)));
 
 	// clear it out
-	sys_page_unmap(0, diskaddr(1));
+	discard_block(diskaddr(1));
 	assert(!va_is_mapped(diskaddr(1)));
 
 	// read it back in
@@ -143,7 +630,7 @@ check_bc(void)
 	//assert(!va_is_dirty(diskaddr(1)));
 
 	// clear it out
-	sys_page_unmap(0, diskaddr(1));
+	discard_block(diskaddr(1));
 	assert(!va_is_mapped(diskaddr(1)));
 
 	// read it back in
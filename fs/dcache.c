@@ -0,0 +1,111 @@
+/*
+ * Cache of directory lookups, after the dentry cache of Linux.
+ *
+ * Every lookup of a name in a directory by walk_path is remembered as
+ * (directory, name) -> struct File, or as a miss when the name is not
+ * there, so opening the same paths again reads no directory blocks.
+ * Entries are direct-mapped by a hash of the pair.  A File descriptor
+ * stays at its place in the directory for as long as it exists, so an
+ * entry only goes stale when a name is created, removed or renamed.
+ */
+
+#include <lib.h>
+#include <fs/fs.h>
+
+#define DC_NENTRY	128
+
+// Longer names are not cached
+#define DC_NAMELEN	32
+
+struct Dentry {
+	struct File *d_dir;		// NULL if the entry is free
+	struct File *d_file;		// NULL for a name known to be missing
+	char d_name[DC_NAMELEN];
+};
+
+static struct Dentry dcache[DC_NENTRY];
+
+static struct {
+	uint32_t hit;		// lookups answered with a file
+	uint32_t neg;		// lookups answered with a miss
+	uint32_t miss;		// lookups reading the directory
+} dstat;
+
+static struct Dentry *
+dc_slot(struct File *dir, const char *name)
+{
+	uint32_t h = (uint32_t)dir / sizeof(struct File);
+
+	while (*name)
+		h = h * 31 + (uint8_t)*name++;
+
+	return &dcache[h % DC_NENTRY];
+}
+
+// Look 'name' up in the cached entries of 'dir'.  Returns true if it is
+// cached, with *file set to the file or to NULL if there is none.
+bool
+dcache_lookup(struct File *dir, const char *name, struct File **file)
+{
+	struct Dentry *d = dc_slot(dir, name);
+
+	if (d->d_dir != dir || strcmp(d->d_name, name) != 0) {
+		dstat.miss++;
+		return false;
+	}
+
+	if (d->d_file)
+		dstat.hit++;
+	else
+		dstat.neg++;
+
+	*file = d->d_file;
+	return true;
+}
+
+// Remember that 'name' in 'dir' is 'file', or missing if 'file' is NULL.
+void
+dcache_enter(struct File *dir, const char *name, struct File *file)
+{
+	struct Dentry *d;
+
+	if (strlen(name) >= DC_NAMELEN)
+		return;
+
+	d = dc_slot(dir, name);
+	d->d_dir = dir;
+	d->d_file = file;
+	strcpy(d->d_name, name);
+}
+
+// Forget 'name' in 'dir', which is about to be created.
+void
+dcache_invalidate(struct File *dir, const char *name)
+{
+	struct Dentry *d = dc_slot(dir, name);
+
+	if (d->d_dir == dir && strcmp(d->d_name, name) == 0)
+		d->d_dir = NULL;
+}
+
+// Forget the name of 'f' and, for a directory, the names in it; its
+// descriptor is about to be cleared.
+void
+dcache_forget(struct File *f)
+{
+	uint32_t i;
+
+	for (i = 0; i < DC_NENTRY; i++) {
+		if (dcache[i].d_dir == f || dcache[i].d_file == f)
+			dcache[i].d_dir = NULL;
+	}
+}
+
+// Report the lookup counters.
+void
+dcache_info(struct Fsreq_info *info)
+{
+	info->dc_hit = dstat.hit;
+	info->dc_neg = dstat.neg;
+	info->dc_miss = dstat.miss;
+}
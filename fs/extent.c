@@ -0,0 +1,489 @@
+/*
+ * Extent trees map the blocks of files with FILE_EXTENTS set.
+ *
+ * The File descriptor holds the root: up to NEXTENT entries and the
+ * depth of the tree below it.  At depth 0 the entries are the extents
+ * themselves; otherwise each one points to an ExtentNode block one
+ * level down, holding the entries from its e_fileblk on.  The first
+ * entry of every node also takes the blocks before its e_fileblk, so
+ * an extent can grow downwards without touching its parents.  A lookup
+ * is one binary search per level, a contiguous file is a single extent
+ * in its File descriptor.
+ *
+ * Recently used extents are cached per file, so sequential access to a
+ * file skips the tree walk altogether.
+ */
+
+#include <lib.h>
+#include <fs/fs.h>
+
+// Files with cached extents, and extents cached per file
+#define EC_NFILES	32
+#define EC_NEXTENT	4
+
+struct ExtentCache {
+	struct File *ec_file;
+	uint32_t ec_n;			// extents cached
+	uint32_t ec_next;		// entry to replace next
+	struct Extent ec_extent[EC_NEXTENT];
+};
+
+static struct ExtentCache ecache[EC_NFILES];
+
+static struct {
+	uint32_t hit;		// lookups answered from the cache
+	uint32_t miss;		// lookups walking the tree
+} estat;
+
+// One level of the tree, in the File descriptor or in a node block
+struct enode {
+	struct File *root;	// the file, if this is the root
+	uint16_t *n;		// entries in use
+	struct Extent *e;
+	uint32_t max;		// room for entries
+	uint32_t depth;		// levels below
+};
+
+static struct ExtentCache *
+ec_lookup(struct File *f)
+{
+	return &ecache[((uint32_t)f / sizeof(struct File)) % EC_NFILES];
+}
+
+// Forget the cached extents of file 'f', after its tree changed.
+void
+extent_forget(struct File *f)
+{
+	struct ExtentCache *ec = ec_lookup(f);
+
+	if (ec->ec_file == f)
+		ec->ec_file = NULL;
+}
+
+static void
+ec_add(struct File *f, const struct Extent *e)
+{
+	struct ExtentCache *ec = ec_lookup(f);
+
+	if (ec->ec_file != f) {
+		ec->ec_file = f;
+		ec->ec_n = 0;
+		ec->ec_next = 0;
+	}
+
+	ec->ec_extent[ec->ec_next] = *e;
+	ec->ec_next = (ec->ec_next + 1) % EC_NEXTENT;
+	if (ec->ec_n < EC_NEXTENT)
+		ec->ec_n++;
+}
+
+static void
+node_root(struct File *f, struct enode *nd)
+{
+	nd->root = f;
+	nd->n = &f->f_nextent;
+	nd->e = f->f_extent;
+	nd->max = NEXTENT;
+	nd->depth = f->f_depth;
+}
+
+static void
+node_block(uint32_t blockno, uint32_t depth, struct enode *nd)
+{
+	struct ExtentNode *node = diskaddr(blockno);
+
+	if (node->en_magic != EXTENT_MAGIC || node->en_depth != depth ||
+	    node->en_nentries > NEXTENT_BLOCK)
+		panic("bad extent node %08x", blockno);
+
+	// written back after the blocks it points to
+	bc_set_meta(blockno, 1);
+
+	nd->root = NULL;
+	nd->n = &node->en_nentries;
+	nd->e = node->en_extent;
+	nd->max = NEXTENT_BLOCK;
+	nd->depth = depth;
+}
+
+// Allocate an empty node block at 'depth' and return its block number.
+static int
+node_alloc(uint32_t depth, struct enode *nd)
+{
+	struct ExtentNode *node;
+	int blockno;
+
+	blockno = alloc_block();
+	if (blockno < 0)
+		return blockno;
+
+	node = bc_alloc_block(blockno);
+	node->en_magic = EXTENT_MAGIC;
+	node->en_depth = depth;
+	node_block(blockno, depth, nd);
+	return blockno;
+}
+
+// Index of the entry covering 'filebno': the last one starting at or
+// before it, or the first one.
+static uint32_t
+node_search(struct enode *nd, uint32_t filebno)
+{
+	uint32_t lo = 0, hi = *nd->n, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (nd->e[mid].e_fileblk <= filebno)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo ? lo - 1 : 0;
+}
+
+static void
+node_put(struct enode *nd, uint32_t i, const struct Extent *e)
+{
+	memmove(&nd->e[i + 1], &nd->e[i], (*nd->n - i) * sizeof(*e));
+	nd->e[i] = *e;
+	(*nd->n)++;
+}
+
+static void
+node_del(struct enode *nd, uint32_t i)
+{
+	(*nd->n)--;
+	memmove(&nd->e[i], &nd->e[i + 1], (*nd->n - i) * sizeof(nd->e[i]));
+}
+
+// Insert entry 'e' at index 'i' of node 'nd'.  A full root moves its
+// entries down into a new node and grows the tree by one level; any
+// other full node is split in two and the new right half is returned
+// through '*split' and '*key' for the parent to insert.
+static int
+node_add(struct enode *nd, uint32_t i, const struct Extent *e,
+	 uint32_t *split, uint32_t *key)
+{
+	struct enode new;
+	struct Extent up;
+	uint32_t half;
+	int blockno;
+
+	*split = 0;
+	if (*nd->n < nd->max) {
+		node_put(nd, i, e);
+		return 0;
+	}
+
+	blockno = node_alloc(nd->depth, &new);
+	if (blockno < 0)
+		return blockno;
+
+	if (nd->root) {
+		memmove(new.e, nd->e, *nd->n * sizeof(*e));
+		*new.n = *nd->n;
+		node_put(&new, i, e);
+
+		up.e_fileblk = 0;
+		up.e_start = blockno;
+		up.e_len = 0;
+		nd->e[0] = up;
+		*nd->n = 1;
+		nd->root->f_depth++;
+		return 0;
+	}
+
+	half = nd->max / 2;
+	memmove(new.e, &nd->e[half], (*nd->n - half) * sizeof(*e));
+	*new.n = *nd->n - half;
+	*nd->n = half;
+
+	if (i <= half)
+		node_put(nd, i, e);
+	else
+		node_put(&new, i - half, e);
+
+	*split = blockno;
+	*key = new.e[0].e_fileblk;
+	return 0;
+}
+
+// Map 'filebno' to 'blockno' in the subtree at 'nd', extending the
+// neighbouring extent where the blocks are contiguous.
+static int
+node_insert(struct enode *nd, uint32_t filebno, uint32_t blockno,
+	    uint32_t *split, uint32_t *key)
+{
+	struct enode child;
+	struct Extent e, *prev, *next;
+	uint32_t i, csplit, ckey;
+	int ret;
+
+	*split = 0;
+	i = node_search(nd, filebno);
+
+	if (nd->depth > 0) {
+		node_block(nd->e[i].e_start, nd->depth - 1, &child);
+		ret = node_insert(&child, filebno, blockno, &csplit, &ckey);
+		if (ret < 0 || !csplit)
+			return ret;
+
+		e.e_fileblk = ckey;
+		e.e_start = csplit;
+		e.e_len = 0;
+		return node_add(nd, i + 1, &e, split, key);
+	}
+
+	if (*nd->n > 0 && nd->e[i].e_fileblk <= filebno) {
+		prev = &nd->e[i];
+		if (filebno < prev->e_fileblk + prev->e_len)
+			return -E_INVAL;
+
+		i++;
+		if (filebno == prev->e_fileblk + prev->e_len &&
+		    blockno == prev->e_start + prev->e_len) {
+			prev->e_len++;
+
+			// the hole between two extents is filled
+			next = &nd->e[i];
+			if (i < *nd->n && next->e_fileblk == filebno + 1 &&
+			    next->e_start == blockno + 1) {
+				prev->e_len += next->e_len;
+				node_del(nd, i);
+			}
+			return 0;
+		}
+	}
+
+	next = &nd->e[i];
+	if (i < *nd->n && next->e_fileblk == filebno + 1 &&
+	    next->e_start == blockno + 1) {
+		next->e_fileblk--;
+		next->e_start--;
+		next->e_len++;
+		return 0;
+	}
+
+	e.e_fileblk = filebno;
+	e.e_start = blockno;
+	e.e_len = 1;
+	return node_add(nd, i, &e, split, key);
+}
+
+// Set *blockno to the disk block of the filebno'th block of file 'f',
+// 0 if it has none.
+//
+// Returns 0 on success, -E_INVAL if filebno is out of range.
+int
+extent_lookup(struct File *f, uint32_t filebno, uint32_t *blockno)
+{
+	struct ExtentCache *ec = ec_lookup(f);
+	struct enode nd;
+	struct Extent *e;
+	uint32_t i;
+
+	if (filebno >= MAXFILESIZE / BLKSIZE)
+		return -E_INVAL;
+
+	if (ec->ec_file == f) {
+		for (i = 0; i < ec->ec_n; i++) {
+			e = &ec->ec_extent[i];
+			if (e->e_fileblk <= filebno &&
+			    filebno < e->e_fileblk + e->e_len) {
+				estat.hit++;
+				*blockno = e->e_start + filebno - e->e_fileblk;
+				return 0;
+			}
+		}
+	}
+	estat.miss++;
+
+	*blockno = 0;
+	node_root(f, &nd);
+	for (;;) {
+		if (*nd.n == 0)
+			return 0;
+
+		i = node_search(&nd, filebno);
+		if (nd.depth == 0)
+			break;
+
+		node_block(nd.e[i].e_start, nd.depth - 1, &nd);
+	}
+
+	e = &nd.e[i];
+	if (e->e_fileblk <= filebno && filebno < e->e_fileblk + e->e_len) {
+		ec_add(f, e);
+		*blockno = e->e_start + filebno - e->e_fileblk;
+	}
+
+	return 0;
+}
+
+// Where the filebno'th block of file 'f' should go on disk: right
+// behind the extent before it.  Returns 0 if there is none.
+uint32_t
+extent_goal(struct File *f, uint32_t filebno)
+{
+	struct enode nd;
+	struct Extent *e;
+	uint32_t i;
+
+	node_root(f, &nd);
+	for (;;) {
+		if (*nd.n == 0)
+			return 0;
+
+		i = node_search(&nd, filebno);
+		if (nd.depth == 0)
+			break;
+
+		node_block(nd.e[i].e_start, nd.depth - 1, &nd);
+	}
+
+	e = &nd.e[i];
+	if (e->e_fileblk > filebno)
+		return 0;
+
+	return e->e_start + MIN(filebno - e->e_fileblk, e->e_len);
+}
+
+// Map the filebno'th block of file 'f', which has none, to 'blockno'.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_NO_DISK if a tree node is needed but the disk is full.
+//	-E_INVAL if filebno is out of range or already mapped.
+int
+extent_insert(struct File *f, uint32_t filebno, uint32_t blockno)
+{
+	struct enode root;
+	uint32_t split, key;
+
+	if (filebno >= MAXFILESIZE / BLKSIZE)
+		return -E_INVAL;
+
+	// the root grows instead of splitting
+	extent_forget(f);
+	node_root(f, &root);
+	return node_insert(&root, filebno, blockno, &split, &key);
+}
+
+// Free data blocks [start, start + n).
+static void
+free_run(uint32_t start, uint32_t n)
+{
+	for (; n > 0; start++, n--) {
+		free_block(start);
+		discard_block(diskaddr(start));
+	}
+}
+
+// Free the blocks from file block 'nblocks' on in the subtree at 'nd',
+// and the nodes left empty.
+static void
+node_truncate(struct enode *nd, uint32_t nblocks)
+{
+	struct enode child;
+	struct Extent *e;
+	uint32_t i, keep;
+
+	while (*nd->n > 0) {
+		i = *nd->n - 1;
+		e = &nd->e[i];
+
+		if (nd->depth == 0) {
+			if (e->e_fileblk + e->e_len <= nblocks)
+				break;
+
+			keep = (e->e_fileblk < nblocks) ? nblocks - e->e_fileblk : 0;
+			free_run(e->e_start + keep, e->e_len - keep);
+			e->e_len = keep;
+			if (keep)
+				break;
+
+			node_del(nd, i);
+			continue;
+		}
+
+		// every block of a later child is at or after its e_fileblk
+		node_block(e->e_start, nd->depth - 1, &child);
+		node_truncate(&child, (i > 0 && e->e_fileblk >= nblocks) ? 0 : nblocks);
+		if (*child.n > 0)
+			break;
+
+		free_block(e->e_start);
+		discard_block(diskaddr(e->e_start));
+		node_del(nd, i);
+	}
+}
+
+// Free the blocks of file 'f' from file block 'nblocks' on.  A tree
+// whose top node fits back into the File descriptor loses a level.
+void
+extent_truncate(struct File *f, uint32_t nblocks)
+{
+	struct enode root, child;
+	uint32_t blockno;
+
+	extent_forget(f);
+	node_root(f, &root);
+	node_truncate(&root, nblocks);
+
+	while (f->f_depth > 0) {
+		if (f->f_nextent == 0) {
+			f->f_depth = 0;
+			break;
+		}
+
+		blockno = f->f_extent[0].e_start;
+		node_block(blockno, f->f_depth - 1, &child);
+		if (f->f_nextent > 1 || *child.n > NEXTENT)
+			break;
+
+		memmove(f->f_extent, child.e, *child.n * sizeof(struct Extent));
+		f->f_nextent = *child.n;
+		f->f_depth--;
+		free_block(blockno);
+		discard_block(diskaddr(blockno));
+	}
+}
+
+// Drop the clean blocks of the subtree at 'nd' from the block cache.
+static void
+node_release(struct enode *nd)
+{
+	struct enode child;
+	uint32_t i, j;
+
+	for (i = 0; i < *nd->n; i++) {
+		if (nd->depth == 0) {
+			for (j = 0; j < nd->e[i].e_len; j++)
+				release_block(diskaddr(nd->e[i].e_start + j));
+			continue;
+		}
+
+		node_block(nd->e[i].e_start, nd->depth - 1, &child);
+		node_release(&child);
+		release_block(diskaddr(nd->e[i].e_start));
+	}
+}
+
+// Release the cached blocks and extents of file 'f' once it is closed.
+void
+extent_release(struct File *f)
+{
+	struct enode root;
+
+	extent_forget(f);
+	node_root(f, &root);
+	node_release(&root);
+}
+
+// Report the extent cache counters.
+void
+extent_info(struct Fsreq_info *info)
+{
+	info->ex_hit = estat.hit;
+	info->ex_miss = estat.miss;
+}
@@ -3,6 +3,54 @@
 
 #define BLKNO2ADDR(x) ((void *)(DISKMAP + x * BLKSIZE))
 
+// Words in a bitmap block
+#define BITMAP_WORDS	(BLKSIZE / 4)
+
+// Free blocks tracked by each bitmap block
+static uint32_t bitmap_nfree[DISKSIZE / BLKSIZE / BLKBITSIZE];
+// Next-fit cursor: alloc_block starts searching at this block
+static uint32_t alloc_cursor;
+
+// A block written into a hole of a regular file gets no disk block at
+// first.  It lives in a page at DELAYMAP until the next write-back,
+// which assigns disk blocks to all such blocks of a file at once, in
+// file order and right behind the blocks the file already has.
+struct Delayed {
+	struct File *d_file;	// NULL if the slot is free
+	uint32_t d_filebno;
+	uint32_t d_next;	// next slot + 1 in the hash chain, 0 at the end
+};
+
+#define DELAY_HASH	256
+static struct Delayed delayed[DELAY_NBLOCKS];
+static uint32_t delay_hash[DELAY_HASH];	// first slot + 1 of each chain
+static uint32_t delay_free;		// where to look for a free slot
+// Delayed blocks; as many free blocks are kept for them, plus
+// DELAY_SLACK for the extent tree nodes they may need
+static uint32_t ndelayed;
+#define DELAY_SLACK	16
+
+// Each recently written file keeps a window of free blocks behind its
+// last block for its next blocks.  Windows are not marked in the
+// bitmap, other files just prefer blocks outside of them.
+#define PREALLOC_NWIN	16
+#define PREALLOC_BLOCKS	32
+
+struct Prealloc {
+	struct File *pa_file;	// NULL if the window is unused
+	uint32_t pa_start;	// next block the file should get
+	uint32_t pa_end;
+};
+
+static struct Prealloc windows[PREALLOC_NWIN];
+static uint32_t window_next;	// window to reuse when all are taken
+
+static struct {
+	uint32_t resolved;	// delayed blocks given a disk block
+	uint32_t contig;	// of them right behind the previous block
+	uint32_t falloc;	// blocks allocated by fallocate
+} astat;
+
 // --------------------------------------------------------------
 // Super block
 // --------------------------------------------------------------
@@ -24,6 +72,66 @@ check_super(void)
 // Free block bitmap
 // --------------------------------------------------------------
 
+// The window of file 'f', or NULL
+static struct Prealloc *
+prealloc_find(struct File *f)
+{
+	uint32_t i;
+
+	for (i = 0; i < PREALLOC_NWIN; i++) {
+		if (windows[i].pa_file == f)
+			return &windows[i];
+	}
+
+	return NULL;
+}
+
+// The window 'blockno' lies in, or NULL
+static struct Prealloc *
+prealloc_owner(uint32_t blockno)
+{
+	uint32_t i;
+
+	for (i = 0; i < PREALLOC_NWIN; i++) {
+		if (windows[i].pa_file && windows[i].pa_start <= blockno &&
+		    blockno < windows[i].pa_end)
+			return &windows[i];
+	}
+
+	return NULL;
+}
+
+// Keep the PREALLOC_BLOCKS blocks from 'start' on for file 'f'.
+static void
+prealloc_set(struct File *f, uint32_t start)
+{
+	struct Prealloc *pa;
+
+	if (start == 0 || start >= super->s_nblocks)
+		return;
+
+	pa = prealloc_find(f);
+	if (!pa) {
+		pa = &windows[window_next];
+		window_next = (window_next + 1) % PREALLOC_NWIN;
+	}
+
+	pa->pa_file = f;
+	pa->pa_start = start;
+	pa->pa_end = MIN(start + PREALLOC_BLOCKS, super->s_nblocks);
+}
+
+// Give up the window of file 'f', if it has one.
+static void
+prealloc_drop(struct File *f)
+{
+	struct Prealloc *pa;
+
+	pa = prealloc_find(f);
+	if (pa)
+		pa->pa_file = NULL;
+}
+
 // Check to see if the block bitmap indicates that block 'blockno' is free.
 // Return 1 if the block is free, 0 if not.
 bool
@@ -39,47 +147,188 @@ block_is_free(uint32_t blockno)
 }
 
 // Mark a block free in the bitmap
-static void
+void
 free_block(uint32_t blockno)
 {
 	// Blockno zero is the null pointer of block numbers.
 	if (blockno == 0)
 		panic("attempt to free zero block");
 
+	// the logged metadata may still point to it
+	if (bc_is_meta(blockno)) {
+		bc_set_meta(blockno, 0);
+		if (journal_free(blockno))
+			return;
+	}
+
+	block_set_free(blockno);
+}
+
+// Set the free bit of a block and count it in the free counts.
+void
+block_set_free(uint32_t blockno)
+{
+	if (block_is_free(blockno))
+		return;
+
 	bitmap[blockno / 32] |= 1 << (blockno % 32);
-	flush_block(&bitmap[blockno / 32]);
+	bitmap_nfree[blockno / BLKBITSIZE]++;
+	super->s_nfree++;
+}
+
+// Find the first free block at or after block 'start', wrapping around
+// at the end of the disk.  The caller makes sure one is free.
+static uint32_t
+bitmap_find(uint32_t start)
+{
+	uint32_t i, b, w, end, nwords, nbitmap;
+	uint32_t blockno;
+
+	// The bitmap consists of one or more blocks.  A single bitmap block
+	// contains the in-use bits for BLKBITSIZE blocks.  There are
+	// super->s_nblocks blocks in the disk altogether.  Look 32 blocks
+	// at a time from 'start' on, skipping bitmap blocks without free
+	// blocks; the first block is visited twice when 'start' is in its
+	// middle.  Free bits before 'start' in its word are masked off on
+	// the first visit only.
+	nwords = (super->s_nblocks + 31) / 32;
+	nbitmap = (super->s_nblocks + BLKBITSIZE - 1) / BLKBITSIZE;
+	if (start >= super->s_nblocks)
+		start = 0;
+	w = start / 32;
+
+	if (bitmap[w] & ~((1 << (start % 32)) - 1)) {
+		blockno = w * 32 + __builtin_ctz(bitmap[w] & ~((1 << (start % 32)) - 1));
+		goto found;
+	}
+	w++;
+
+	for (i = 0; i <= nbitmap; i++) {
+		if (w >= nwords)
+			w = 0;
+
+		b = w / BITMAP_WORDS;
+		if (bitmap_nfree[b]) {
+			end = MIN((b + 1) * BITMAP_WORDS, nwords);
+			for (; w < end; w++) {
+				if (bitmap[w]) {
+					blockno = w * 32 + __builtin_ctz(bitmap[w]);
+					goto found;
+				}
+			}
+		}
+
+		w = (b + 1) * BITMAP_WORDS;
+	}
+
+	panic("%s: %u free blocks but none in the bitmap",
+	      __func__, super->s_nfree);
+
+found:
+	if (blockno >= super->s_nblocks)
+		panic("%s: free bit for block %08x past the disk",
+		      __func__, blockno);
+
+	return blockno;
 }
 
-// Search the bitmap for a free block and allocate it.  When you
-// allocate a block, immediately flush the changed bitmap block
-// to disk.
+// Search the bitmap for a free block at or after 'goal' and allocate it
+// to file 'f'.  Free blocks in the preallocation window of another file
+// are passed over as long as there are others.  The changed bitmap
+// block joins the dirty set and is written back after the data that
+// goes into the new block.
 //
 // Return block number allocated on success,
 // -E_NO_DISK if we are out of blocks.
-int
-alloc_block(void)
+static int
+alloc_block_near(uint32_t goal, struct File *f)
 {
-	int blockno;
+	struct Prealloc *pa;
+	uint32_t i, blockno;
+	bool next_fit = false;
 
-	// The bitmap consists of one or more blocks.  A single bitmap block
-	// contains the in-use bits for BLKBITSIZE blocks.  There are
-	// super->s_nblocks blocks in the disk altogether.
-	for (blockno = 0; blockno < super->s_nblocks; blockno++) {
-		if (bitmap[blockno / 32] & (1 << (blockno % 32)))
+	if (super->s_nfree == 0)
+		return -E_NO_DISK;
+
+	if (goal == 0 || goal >= super->s_nblocks) {
+		goal = alloc_cursor;
+		next_fit = true;
+	}
+
+	blockno = bitmap_find(goal);
+	for (i = 0; i < PREALLOC_NWIN; i++) {
+		pa = prealloc_owner(blockno);
+		if (!pa || pa->pa_file == f)
 			break;
+
+		// reserved for another file, look behind its window
+		blockno = bitmap_find(pa->pa_end);
 	}
 
-	if (blockno == super->s_nblocks)
-		return -E_NO_DISK;
+	// all free blocks we found are reserved: take one from its owner
+	pa = prealloc_owner(blockno);
+	if (pa && pa->pa_file != f)
+		pa->pa_file = NULL;
 
 	/* clean free bit */
 	bitmap[blockno / 32] &= ~(1 << (blockno % 32));
-	/* flush the bitmap back to disk */
-	flush_block(&bitmap[blockno / 32]);
+	bitmap_nfree[blockno / BLKBITSIZE]--;
+	super->s_nfree--;
+	if (next_fit)
+		alloc_cursor = blockno + 1;
 
 	return blockno;
 }
 
+// Allocate a block that belongs to no file in particular, from the
+// next-fit cursor on.  The free blocks promised to delayed blocks are
+// not handed out.
+//
+// Return block number allocated on success,
+// -E_NO_DISK if we are out of blocks.
+int
+alloc_block(void)
+{
+	if (super->s_nfree <= ndelayed)
+		return -E_NO_DISK;
+
+	return alloc_block_near(0, NULL);
+}
+
+// Number of set bits in x; we don't link libgcc for __builtin_popcount
+static uint32_t
+bitcount(uint32_t x)
+{
+	x = x - ((x >> 1) & 0x55555555);
+	x = (x & 0x33333333) + ((x >> 2) & 0x33333333);
+	x = (x + (x >> 4)) & 0x0F0F0F0F;
+	return (x * 0x01010101) >> 24;
+}
+
+// Count the free blocks of every bitmap block.  Bits past the end of
+// the disk are cleared so the word scan never returns them.
+static void
+bitmap_init(void)
+{
+	uint32_t i, nwords, nfree = 0;
+
+	nwords = (super->s_nblocks + 31) / 32;
+	if (super->s_nblocks % 32 &&
+	    bitmap[nwords - 1] & ~((1 << (super->s_nblocks % 32)) - 1))
+		bitmap[nwords - 1] &= (1 << (super->s_nblocks % 32)) - 1;
+
+	for (i = 0; i < nwords; i++) {
+		bitmap_nfree[i / BITMAP_WORDS] += bitcount(bitmap[i]);
+		nfree += bitcount(bitmap[i]);
+	}
+
+	if (super->s_nfree != nfree) {
+		cprintf("superblock free count %u, bitmap %u\n",
+			super->s_nfree, nfree);
+		super->s_nfree = nfree;
+	}
+}
+
 // Validate the file system bitmap.
 //
 // Check that all reserved blocks -- 0, 1, and the bitmap blocks themselves --
@@ -97,6 +346,10 @@ check_bitmap(void)
 	assert(!block_is_free(0));
 	assert(!block_is_free(1));
 
+	// Make sure the journal blocks are marked in-use
+	for (i = 0; i < super->s_njournal; i++)
+		assert(!block_is_free(super->s_journal + i));
+
 	cprintf("bitmap is good\n");
 }
 
@@ -124,7 +377,11 @@ fs_init(void)
 
 	// Set "bitmap" to the beginning of the first bitmap block.
 	bitmap = diskaddr(2);
+
+	// Finish the last metadata transaction if it was cut short.
+	journal_init();
 	check_bitmap();
+	bitmap_init();
 }
 
 // Find the disk block number slot for the 'filebno'th block in file 'f'.
@@ -143,7 +400,7 @@ fs_init(void)
 static int
 file_block_walk(struct File *f, uint32_t filebno, uint32_t **ppdiskbno, bool alloc)
 {
-	int ret, blockno;
+	int blockno;
 	uint32_t *block_addr;
 
 	if (!ppdiskbno)
@@ -168,22 +425,61 @@ file_block_walk(struct File *f, uint32_t filebno, uint32_t **ppdiskbno, bool all
 			return -E_NO_DISK;
 
 		f->f_indirect = blockno;
-		block_addr = BLKNO2ADDR(blockno);
-		ret = sys_page_alloc(0, block_addr, PTE_SYSCALL);
-		if (ret < 0)
-			panic("%s sys_page_alloc %e", __func__, ret);
-
-		/* initialize f->f_indirect block */
-		memset(block_addr, 0, BLKSIZE);
+		/* a zeroed f->f_indirect block */
+		block_addr = bc_alloc_block(blockno);
 
 	} else {
 		block_addr = BLKNO2ADDR(f->f_indirect);
 	}
+	bc_set_meta(f->f_indirect, 1);
 
 	*ppdiskbno = &block_addr[filebno - NDIRECT];
 	return 0;
 }
 
+// Set *blockno to the disk block of the filebno'th block of file 'f',
+// 0 if it has none, through its extents or its block pointers.
+//
+// Returns 0 on success, -E_INVAL if filebno is out of range.
+int
+file_map_block(struct File *f, uint32_t filebno, uint32_t *blockno)
+{
+	int ret;
+	uint32_t *ptr;
+
+	if (f->f_flags & FILE_EXTENTS)
+		return extent_lookup(f, filebno, blockno);
+
+	ret = file_block_walk(f, filebno, &ptr, 0);
+	if (ret == -E_NOT_FOUND) {
+		*blockno = 0;
+		return 0;
+	}
+	if (ret < 0)
+		return ret;
+
+	*blockno = *ptr;
+	return 0;
+}
+
+// Make the new block 'blockno' the filebno'th block of file 'f'.
+static int
+file_set_block(struct File *f, uint32_t filebno, uint32_t blockno)
+{
+	int ret;
+	uint32_t *ptr;
+
+	if (f->f_flags & FILE_EXTENTS)
+		return extent_insert(f, filebno, blockno);
+
+	ret = file_block_walk(f, filebno, &ptr, 1);
+	if (ret < 0)
+		return ret;
+
+	*ptr = blockno;
+	return 0;
+}
+
 // skip over slashes
 static const char *
 skip_slash(const char *p)
@@ -194,9 +490,281 @@ skip_slash(const char *p)
 	return p;
 }
 
+// --------------------------------------------------------------
+// Delayed allocation
+// --------------------------------------------------------------
+
+static void *
+delay_addr(uint32_t slot)
+{
+	return (char *)DELAYMAP + slot * BLKSIZE;
+}
+
+static uint32_t *
+delay_chain(struct File *f, uint32_t filebno)
+{
+	return &delay_hash[((uint32_t)f / sizeof(struct File) + filebno) %
+			   DELAY_HASH];
+}
+
+// Remove slot 'slot' from its hash chain and free it.  The page is
+// left to the caller.
+static void
+delay_unlink(uint32_t slot)
+{
+	uint32_t *link;
+
+	link = delay_chain(delayed[slot].d_file, delayed[slot].d_filebno);
+	while (*link != slot + 1)
+		link = &delayed[*link - 1].d_next;
+	*link = delayed[slot].d_next;
+
+	delayed[slot].d_file = NULL;
+	ndelayed--;
+}
+
+// Put slot 'slot' on the hash chain of block 'filebno' of file 'f'.
+static void
+delay_link(uint32_t slot, struct File *f, uint32_t filebno)
+{
+	uint32_t *chain = delay_chain(f, filebno);
+
+	delayed[slot].d_file = f;
+	delayed[slot].d_filebno = filebno;
+	delayed[slot].d_next = *chain;
+	*chain = slot + 1;
+	ndelayed++;
+}
+
+// Return the page of the delayed block 'filebno' of file 'f', or NULL.
+static void *
+delay_lookup(struct File *f, uint32_t filebno)
+{
+	uint32_t i;
+
+	for (i = *delay_chain(f, filebno); i; i = delayed[i - 1].d_next) {
+		if (delayed[i - 1].d_file == f &&
+		    delayed[i - 1].d_filebno == filebno)
+			return delay_addr(i - 1);
+	}
+
+	return NULL;
+}
+
+// Make 'filebno' of file 'f' a delayed block backed by a zeroed page.
+// One free disk block is kept for it from now on.
+//
+// Returns the page on success, NULL if the disk is full.
+static void *
+delay_alloc(struct File *f, uint32_t filebno)
+{
+	uint32_t slot;
+	int ret;
+
+	if (ndelayed == DELAY_NBLOCKS)
+		delalloc_resolve();
+
+	if (super->s_nfree <= ndelayed + DELAY_SLACK)
+		return NULL;
+
+	for (slot = delay_free; delayed[slot].d_file;
+	     slot = (slot + 1) % DELAY_NBLOCKS)
+		;
+	delay_free = (slot + 1) % DELAY_NBLOCKS;
+
+	ret = sys_page_alloc(0, delay_addr(slot), PTE_W);
+	if (ret < 0)
+		panic("%s: sys_page_alloc %e", __func__, ret);
+
+	delay_link(slot, f, filebno);
+	return delay_addr(slot);
+}
+
+// Throw away the delayed blocks of file 'f' from block 'from' on.
+static void
+delay_drop(struct File *f, uint32_t from)
+{
+	uint32_t slot;
+	int ret;
+
+	for (slot = 0; ndelayed && slot < DELAY_NBLOCKS; slot++) {
+		if (delayed[slot].d_file != f || delayed[slot].d_filebno < from)
+			continue;
+
+		delay_unlink(slot);
+		ret = sys_page_unmap(0, delay_addr(slot));
+		if (ret < 0)
+			panic("%s: sys_page_unmap %e", __func__, ret);
+	}
+}
+
+// Hand the delayed blocks of 'from' over to 'to', whose struct File it
+// has been moved to.
+static void
+delay_move(struct File *from, struct File *to)
+{
+	uint32_t slot;
+
+	for (slot = 0; ndelayed && slot < DELAY_NBLOCKS; slot++) {
+		if (delayed[slot].d_file != from)
+			continue;
+
+		delay_unlink(slot);
+		delay_link(slot, to, delayed[slot].d_filebno);
+	}
+}
+
+// Where the blocks of file 'f' from 'filebno' on should go: the start
+// of its window, or right behind the closest block before 'filebno'.
+// Returns 0 if the file has no say.
+static uint32_t
+file_goal(struct File *f, uint32_t filebno)
+{
+	struct Prealloc *pa;
+	uint32_t blockno;
+
+	pa = prealloc_find(f);
+	if (pa)
+		return pa->pa_start;
+
+	if (f->f_flags & FILE_EXTENTS)
+		return extent_goal(f, filebno);
+
+	while (filebno-- > 0) {
+		if (file_map_block(f, filebno, &blockno) == 0 && blockno)
+			return blockno + 1;
+	}
+
+	return 0;
+}
+
+// Take block 'blockno', which could not be set as block 'filebno' of
+// file 'f', back out of the block cache into delayed slot 'slot'.
+static void
+delay_undo(uint32_t slot, struct File *f, uint32_t filebno, uint32_t blockno)
+{
+	int ret;
+
+	ret = sys_page_map(0, diskaddr(blockno), 0, delay_addr(slot), PTE_W);
+	if (ret < 0)
+		panic("%s: sys_page_map %e", __func__, ret);
+
+	discard_block(diskaddr(blockno));
+	free_block(blockno);
+	delay_link(slot, f, filebno);
+}
+
+// Metadata blocks giving 'f' one more block may dirty: the bitmap, the
+// superblock, the block holding 'f' and its indirect block, or both
+// halves of a split on every level of its extent tree.
+static uint32_t
+file_grow_meta(struct File *f)
+{
+	if (f->f_flags & FILE_EXTENTS)
+		return 3 + 2 * (f->f_depth + 1);
+
+	return 4;
+}
+
+// Does delayed slot 'a' come before slot 'b' in disk order?
+static bool
+delay_before(uint32_t a, uint32_t b)
+{
+	if (delayed[a].d_file != delayed[b].d_file)
+		return delayed[a].d_file < delayed[b].d_file;
+
+	return delayed[a].d_filebno < delayed[b].d_filebno;
+}
+
+// Give every delayed block a disk block.  The blocks of one file are
+// allocated in file order from its goal on, so a file written
+// sequentially ends up in one run, and the file keeps a window behind
+// its last block for the next write-back.  Each page moves into the
+// block cache as a dirty block before the block pointer is set, so a
+// write-back in between never writes a pointer to unwritten data.
+//
+// The free blocks kept for extent tree nodes may run out on a badly
+// fragmented disk; the blocks not resolved by then stay delayed, and
+// delay_alloc refuses new ones.
+void
+delalloc_resolve(void)
+{
+	static uint32_t order[DELAY_NBLOCKS];
+	static bool busy;
+	uint32_t i, j, gap, n = 0, slot, goal = 0, filebno;
+	struct File *f = NULL;
+	int ret, blockno;
+
+	if (busy || ndelayed == 0)
+		return;
+	busy = true;
+
+	for (slot = 0; slot < DELAY_NBLOCKS; slot++) {
+		if (delayed[slot].d_file)
+			order[n++] = slot;
+	}
+
+	// shell sort by file and block
+	for (gap = n / 2; gap > 0; gap /= 2) {
+		for (i = gap; i < n; i++) {
+			slot = order[i];
+			for (j = i; j >= gap && delay_before(slot, order[j - gap]); j -= gap)
+				order[j] = order[j - gap];
+			order[j] = slot;
+		}
+	}
+
+	for (i = 0; i < n; i++) {
+		slot = order[i];
+		if (delayed[slot].d_file != f) {
+			f = delayed[slot].d_file;
+			goal = file_goal(f, delayed[slot].d_filebno);
+		}
+		filebno = delayed[slot].d_filebno;
+
+		// an insert may split a node on every level of the tree, and
+		// one failing half way would lose the entries split off
+		if ((f->f_flags & FILE_EXTENTS) &&
+		    super->s_nfree < ndelayed + f->f_depth + 1)
+			break;
+
+		// the rest waits for the next commit to make room in it
+		if (!bc_meta_room(file_grow_meta(f)))
+			break;
+
+		// delay_alloc kept this block free
+		blockno = alloc_block_near(goal, f);
+		if (blockno < 0)
+			panic("%s: %e", __func__, blockno);
+		delay_unlink(slot);
+		bc_insert_block(blockno, delay_addr(slot));
+
+		// file_get_block made the indirect block before delaying,
+		// but the extent tree may need more nodes than were kept
+		ret = file_set_block(f, filebno, blockno);
+		if (ret < 0) {
+			delay_undo(slot, f, filebno, blockno);
+			break;
+		}
+
+		if (blockno == goal)
+			astat.contig++;
+		astat.resolved++;
+		goal = blockno + 1;
+
+		if (i + 1 == n || delayed[order[i + 1]].d_file != f)
+			prealloc_set(f, goal);
+	}
+
+	busy = false;
+}
+
 // Set *blk to the address in memory where the filebno'th
 // block of file 'f' would be mapped.
 //
+// A missing block of a regular file is delayed: *blk is set to a page
+// outside the block cache, which is only valid until the next fs_sync.
+//
 // Returns 0 on success, < 0 on error.  Errors are:
 //	-E_NO_DISK if a block needed to be allocated but the disk is full.
 //	-E_INVAL if filebno is out of range.
@@ -204,35 +772,56 @@ int
 file_get_block(struct File *f, uint32_t filebno, char **blk)
 {
 	int ret;
-	uint32_t *pdiskbno = NULL;
+	uint32_t blockno, *ptr;
 
-	ret = file_block_walk(f, filebno, &pdiskbno, 1);
+	ret = file_map_block(f, filebno, &blockno);
 	if (ret < 0)
 		return ret;
 
-	if (!*pdiskbno) {
+	if (!blockno && f->f_type == FTYPE_REG) {
+		if (!(f->f_flags & FILE_EXTENTS)) {
+			// the indirect block is not delayed
+			ret = file_block_walk(f, filebno, &ptr, 1);
+			if (ret < 0)
+				return ret;
+		}
+
+		*blk = delay_lookup(f, filebno);
+		if (!*blk)
+			*blk = delay_alloc(f, filebno);
+
+		return *blk ? 0 : -E_NO_DISK;
+	}
+
+	if (!blockno) {
 		ret = alloc_block();
 		if (ret < 0)
 			return ret;
 
-		/* set struct File f->f_direct or f->f_indirect */
-		*pdiskbno = ret;
-
-		ret = sys_page_alloc(0, BLKNO2ADDR(*pdiskbno), PTE_SYSCALL);
-		if (ret < 0)
-			panic("%s sys_page_alloc %e", __func__, ret);
+		blockno = ret;
+		bc_alloc_block(blockno);
+		ret = file_set_block(f, filebno, blockno);
+		if (ret < 0) {
+			free_block(blockno);
+			discard_block(BLKNO2ADDR(blockno));
+			return ret;
+		}
 	}
 
-	*blk = BLKNO2ADDR(*pdiskbno);
+	/* directory blocks are written back after the files in them */
+	if (f->f_type == FTYPE_DIR)
+		bc_set_meta(blockno, 1);
+
+	*blk = bc_lookup(blockno);
 	return 0;
 }
 
-// Try to find a file named "name" in dir.  If so, set *file to it.
+// Read dir to find a file named "name".  If so, set *file to it.
 //
 // Returns 0 and sets *file on success, < 0 on error.  Errors are:
 //	-E_NOT_FOUND if the file is not found
 static int
-dir_lookup(struct File *dir, const char *name, struct File **file)
+dir_search(struct File *dir, const char *name, struct File **file)
 {
 	int ret;
 	uint32_t i, j, nblock;
@@ -244,6 +833,10 @@ dir_lookup(struct File *dir, const char *name, struct File **file)
 	// is always a multiple of the file system's block size.
 	assert((dir->f_size % BLKSIZE) == 0);
 
+	ret = htree_lookup(dir, name, file);
+	if (ret != -E_NOT_SUPP)
+		return ret;
+
 	nblock = dir->f_size / BLKSIZE;
 	for (i = 0; i < nblock; i++) {
 		ret = file_get_block(dir, i, &blk);
@@ -261,10 +854,33 @@ dir_lookup(struct File *dir, const char *name, struct File **file)
 	return -E_NOT_FOUND;
 }
 
-// Set *file to point at a free File structure in dir.  The caller is
-// responsible for filling in the File fields.
+// Try to find a file named "name" in dir, through the lookup cache.
+// If so, set *file to it.
+//
+// Returns 0 and sets *file on success, < 0 on error.  Errors are:
+//	-E_NOT_FOUND if the file is not found
 static int
-dir_alloc_file(struct File *dir, struct File **file)
+dir_lookup(struct File *dir, const char *name, struct File **file)
+{
+	int ret;
+
+	if (dcache_lookup(dir, name, file))
+		return *file ? 0 : -E_NOT_FOUND;
+
+	ret = dir_search(dir, name, file);
+	if (ret == 0)
+		dcache_enter(dir, name, *file);
+	else if (ret == -E_NOT_FOUND)
+		dcache_enter(dir, name, NULL);
+
+	return ret;
+}
+
+// Set *file to point at a free File structure in dir, cleared, and *loc
+// to its entry number.  The caller is responsible for filling in the
+// File fields and then calling htree_add.
+static int
+dir_alloc_file(struct File *dir, struct File **file, uint32_t *loc)
 {
 	int ret;
 	uint32_t n_block, i, j;
@@ -274,6 +890,15 @@ dir_alloc_file(struct File *dir, struct File **file)
 	/* dir->f_size is aligned to BLKSIZE */
 	assert((dir->f_size % BLKSIZE) == 0);
 
+	ret = htree_alloc(dir, file, loc);
+	if (ret == 0) {
+		// a dropped index leaves words behind in free entries
+		memset(*file, 0, sizeof(struct File));
+		return 0;
+	}
+	if (ret != -E_NOT_SUPP)
+		return ret;
+
 	n_block = dir->f_size / BLKSIZE;
 	for (i = 0; i < n_block; i++) {
 		ret = file_get_block(dir, i, &blk);
@@ -283,7 +908,9 @@ dir_alloc_file(struct File *dir, struct File **file)
 		f = (struct File *)blk;
 		for (j = 0; j < BLKFILES; j++) {
 			if (f[j].f_name[0] == '\0') {
+				memset(&f[j], 0, sizeof(struct File));
 				*file = &f[j];
+				*loc = i * BLKFILES + j;
 				return 0;
 			}
 		}
@@ -297,6 +924,7 @@ dir_alloc_file(struct File *dir, struct File **file)
 
 	f = (struct File *)blk;
 	*file = &f[0];
+	*loc = i * BLKFILES;
 	return 0;
 }
 
@@ -375,6 +1003,7 @@ file_create(const char *path, struct File **pf, bool is_dir)
 {
 	char name[MAXPATHLEN];
 	int ret;
+	uint32_t loc;
 	struct File *dir, *f;
 
 	ret = walk_path(path, &dir, &f, name);
@@ -384,14 +1013,16 @@ file_create(const char *path, struct File **pf, bool is_dir)
 	if (ret != -E_NOT_FOUND || dir == NULL)
 		return ret;
 
-	ret = dir_alloc_file(dir, &f);
+	ret = dir_alloc_file(dir, &f, &loc);
 	if (ret < 0)
 		return ret;
 
 	strcpy(f->f_name, name);
 	f->f_type = (is_dir ? FTYPE_DIR : FTYPE_REG);
+	f->f_flags = FILE_EXTENTS;
+	htree_add(dir, loc);
+	dcache_invalidate(dir, name);
 	*pf = f;
-	file_flush(dir);
 
 	return 0;
 }
@@ -404,6 +1035,14 @@ file_open(const char *path, struct File **pfile)
 	return walk_path(path, NULL, pfile, NULL);
 }
 
+// Open "path" and the directory it is in, which is NULL for the root.
+// On error return < 0.
+int
+file_open_parent(const char *path, struct File **pdir, struct File **pfile)
+{
+	return walk_path(path, pdir, pfile, NULL);
+}
+
 // Read count bytes from f into buf, starting from seek position
 // offset.  This meant to mimic the standard pread function.
 // Returns the number of bytes read, < 0 on error.
@@ -434,6 +1073,68 @@ file_read(struct File *f, void *buf, size_t count, off_t offset)
 	return count;
 }
 
+// Read ahead of a read of 'count' bytes at 'offset' from 'f' through an
+// open file with read-ahead state 'ra'.  A read starting where the last
+// one stopped keeps a window of blocks cached beyond it, refilled once
+// the reader is half way through.  The window doubles while the blocks
+// read ahead are still cached when read, up to one IDE command, and
+// halves when some were evicted unused.  Other reads reset it.
+void
+file_readahead(struct File *f, struct Readahead *ra, size_t count, off_t offset)
+{
+	uint32_t first, last, nblocks, bno, blockno, next, start, run;
+	bool waste = false;
+
+	if (f->f_type != FTYPE_REG || count == 0 || offset >= f->f_size)
+		return;
+
+	first = offset / BLKSIZE;
+	last = (MIN(offset + count, f->f_size) - 1) / BLKSIZE;
+	nblocks = ROUNDUP(f->f_size, BLKSIZE) / BLKSIZE;
+
+	if (first != ra->ra_next && first + 1 != ra->ra_next) {
+		ra->ra_next = last + 1;
+		ra->ra_size = 0;
+		ra->ra_end = 0;
+		return;
+	}
+	ra->ra_next = last + 1;
+
+	for (bno = MAX(first, ra->ra_start); bno <= last && bno < ra->ra_end; bno++) {
+		if (file_map_block(f, bno, &blockno) == 0 && blockno &&
+		    !va_is_mapped(diskaddr(blockno)))
+			waste = true;
+	}
+
+	if (waste)
+		ra->ra_size = MAX(ra->ra_size / 2, RA_MIN);
+	if (ra->ra_size && last + ra->ra_size / 2 < ra->ra_end)
+		return;
+	if (!ra->ra_size)
+		ra->ra_size = RA_MIN;
+	else if (!waste)
+		ra->ra_size = MIN(2 * ra->ra_size, RA_MAX);
+
+	start = MAX(ra->ra_end, last + 1);
+	ra->ra_start = start;
+	ra->ra_end = MIN(last + 1 + ra->ra_size, nblocks);
+
+	// one read per run of blocks contiguous on disk
+	for (bno = start; bno < ra->ra_end; bno += MAX(run, 1)) {
+		if (file_map_block(f, bno, &blockno) < 0 || !blockno) {
+			run = 0;
+			continue;
+		}
+
+		for (run = 1; bno + run < ra->ra_end; run++) {
+			if (file_map_block(f, bno + run, &next) < 0 ||
+			    next != blockno + run)
+				break;
+		}
+		bc_readahead(blockno, run);
+	}
+}
+
 // Write count bytes from buf into f, starting at seek position
 // offset.  This is meant to mimic the standard pwrite function.
 // Extends the file if necessary.
@@ -445,6 +1146,9 @@ file_write(struct File *f, const void *buf, size_t count, off_t offset)
 	off_t pos;
 	char *blk;
 
+	if (offset < 0 || count > MAXFILESIZE - offset)
+		return -E_INVAL;
+
 	/* Extend file if necessary */
 	if (offset + count > f->f_size) {
 		ret = file_set_size(f, offset + count);
@@ -468,50 +1172,48 @@ file_write(struct File *f, const void *buf, size_t count, off_t offset)
 }
 
 // Flush the contents and metadata of file f out to disk.
-// Loop over all the blocks in file.
-// Translate the file block number into a disk block number
-// and then check whether that disk block is dirty.  If so, write it out.
+// The bitmap and inode blocks it changed are shared with other files,
+// so this commits the whole dirty set: the data is written in place and
+// the metadata of every file goes out in one journal write.
 void
 file_flush(struct File *f)
 {
-	int i;
-	uint32_t *pdiskbno;
-
-	for (i = 0; i < (f->f_size + BLKSIZE - 1) / BLKSIZE; i++) {
-		if (file_block_walk(f, i, &pdiskbno, 0) < 0 ||
-			pdiskbno == NULL || *pdiskbno == 0)
-			continue;
-
-		flush_block(diskaddr(*pdiskbno));
-	}
-
-	flush_block(f);
-	if (f->f_indirect)
-		flush_block(diskaddr(f->f_indirect));
+	fs_sync();
 }
 
 // Close file
-// Loop over all the blocks in file, and free page cache for recycling.
+// Loop over all the blocks in file, and release them from the block
+// cache for recycling.  Dirty blocks stay until they are written back.
 void file_close(struct File *f)
 {
 	int i;
 	uint32_t *blockno;
 
-	for (i = 0; i < NDIRECT; i++)
-		sys_page_unmap(0, BLKNO2ADDR(f->f_direct[i]));
+	if (f->f_flags & FILE_EXTENTS) {
+		extent_release(f);
+		goto out;
+	}
+
+	for (i = 0; i < NDIRECT; i++) {
+		if (f->f_direct[i])
+			release_block(BLKNO2ADDR(f->f_direct[i]));
+	}
 
 	if (f->f_indirect) {
 
 		for (i = 0; i < (f->f_size / BLKSIZE - NDIRECT); i++) {
 
 			blockno = BLKNO2ADDR(f->f_indirect);
-			sys_page_unmap(0, BLKNO2ADDR(blockno[i]));
+			if (blockno[i])
+				release_block(BLKNO2ADDR(blockno[i]));
 		}
 
-		sys_page_unmap(0, BLKNO2ADDR(f->f_indirect));
+		release_block(BLKNO2ADDR(f->f_indirect));
 	}
 
-	sys_page_unmap(0, f);
+out:
+	prealloc_drop(f);
+	release_block(f);
 }
 
 // Remove a block from file f.  If it's not there, just silently succeed.
@@ -520,16 +1222,17 @@ static int
 file_free_block(struct File *f, uint32_t filebno)
 {
 	int ret;
-	uint32_t *ptr;
+	uint32_t *ptr, bno;
 
 	ret = file_block_walk(f, filebno, &ptr, 0);
 	if (ret < 0)
 		return ret;
 
 	if (*ptr) {
-		free_block(*ptr);
-		sys_page_unmap(0, BLKNO2ADDR(*ptr));
+		bno = *ptr;
 		*ptr = 0;
+		free_block(bno);
+		discard_block(BLKNO2ADDR(bno));
 	}
 
 	return 0;
@@ -548,11 +1251,17 @@ static void
 file_truncate_blocks(struct File *f, off_t newsize)
 {
 	int ret;
-	uint32_t bno, old_nblocks, new_nblocks;
+	uint32_t bno, old_nblocks, new_nblocks, indirect;
 
 	old_nblocks = (f->f_size + BLKSIZE - 1) / BLKSIZE;
 	new_nblocks = (newsize + BLKSIZE - 1) / BLKSIZE;
 
+	delay_drop(f, new_nblocks);
+	if (f->f_flags & FILE_EXTENTS) {
+		extent_truncate(f, new_nblocks);
+		return;
+	}
+
 	for (bno = new_nblocks; bno < old_nblocks; bno++) {
 		ret = file_free_block(f, bno);
 		if (ret < 0)
@@ -560,9 +1269,10 @@ file_truncate_blocks(struct File *f, off_t newsize)
 	}
 
 	if (new_nblocks <= NDIRECT && f->f_indirect) {
-		free_block(f->f_indirect);
-		sys_page_unmap(0, BLKNO2ADDR(f->f_indirect));
+		indirect = f->f_indirect;
 		f->f_indirect = 0;
+		free_block(indirect);
+		discard_block(BLKNO2ADDR(indirect));
 	}
 }
 
@@ -573,57 +1283,81 @@ file_set_size(struct File *f, off_t newsize)
 	if (f->f_size > newsize)
 		file_truncate_blocks(f, newsize);
 
+	/* an emptied file is mapped by extents from now on */
+	if (newsize == 0 && !(f->f_flags & FILE_EXTENTS)) {
+		f->f_nextent = 0;
+		f->f_depth = 0;
+		f->f_flags |= FILE_EXTENTS;
+	}
+
+	/* the inode is written back with the dirty set */
 	f->f_size = newsize;
-	/* update file meta data */
-	flush_block(f);
 	return 0;
 }
 
-// Sync the entire file system.  A big hammer.
+// Sync the entire file system by giving the delayed blocks their disk
+// blocks and writing back every dirty block.  Delayed blocks that do
+// not fit in one commit go out in the next ones.
 void
 fs_sync(void)
 {
-	int i;
+	uint32_t n;
 
-	for (i = 1; i < super->s_nblocks; i++)
-		flush_block(diskaddr(i));
+	do {
+		n = ndelayed;
+		delalloc_resolve();
+		bc_sync();
+	} while (ndelayed && ndelayed < n);
 }
 
+// Called between requests, where a commit catches none half done.
+// Write back once the dirty metadata takes half of the journal or the
+// delayed blocks half of their table, so the next request fits.
+void
+fs_sync_point(void)
+{
+	if (bc_commit_due() || ndelayed >= DELAY_NBLOCKS / 2)
+		fs_sync();
+}
+
+// Remove 'f' from 'dir', which is NULL for the root.
 int
-file_remove(struct File *f)
+file_remove(struct File *dir, struct File *f)
 {
 	// delete file content
 	file_truncate_blocks(f, 0);
+	prealloc_drop(f);
 
 	// delete file node
+	if (dir)
+		htree_remove(dir, f);
+	dcache_forget(f);
 	memset(f, 0, sizeof(struct File));
-	flush_block(f);
 
 	/* !recycle: dir data block */
 	return 0;
 }
 
 int
-file_dir_each_file(struct File *dir, int (*handler)(struct File *f))
+file_dir_each_file(struct File *dir,
+		   int (*handler)(struct File *dir, struct File *f))
 {
 	int i, j, ret;
 	struct File *sub_f;
-	struct File **sub_fp;
+	char *blk;
 
 	if (dir->f_type != FTYPE_DIR)
 		return -E_INVAL;
 
 	for (i = 0; i < (dir->f_size / BLKSIZE); i++) {
-		if (i < NDIRECT)
-			sub_f = BLKNO2ADDR(dir->f_direct[i]);
-		else {
-			sub_fp = BLKNO2ADDR(dir->f_indirect);
-			sub_f = sub_fp[i - NDIRECT];
-		}
+		ret = file_get_block(dir, i, &blk);
+		if (ret < 0)
+			return ret;
+		sub_f = (struct File *)blk;
 
 		for (j = 0; j < BLKFILES; j++) {
 			if (sub_f[j].f_name[0]) {
-				ret = handler(&sub_f[j]);
+				ret = handler(dir, &sub_f[j]);
 				if (ret < 0)
 					return ret;
 			}
@@ -633,25 +1367,103 @@ file_dir_each_file(struct File *dir, int (*handler)(struct File *f))
 	return 0;
 }
 
+// Move 'src_file' out of 'src_dir', NULL for the root, into 'dir'.
 int
-file_rename(struct File *dir, struct File *src_file)
+file_rename(struct File *dir, struct File *src_dir, struct File *src_file)
 {
 	int ret;
+	uint32_t loc;
 	struct File *new_file;
 
 	/* only support dst path is existing directory */
 	if (dir->f_type != FTYPE_DIR)
 		return -E_INVAL;
 
-	ret = dir_alloc_file(dir, &new_file);
+	ret = dir_alloc_file(dir, &new_file, &loc);
 	if (ret < 0)
 		return ret;
 
 	memcpy(new_file, src_file, sizeof(struct File));
-	flush_block(new_file);
-
+	htree_add(dir, loc);
+	dcache_invalidate(dir, new_file->f_name);
+	if (src_dir)
+		htree_remove(src_dir, src_file);
+	dcache_forget(src_file);
 	memset(src_file, 0, sizeof(struct File));
-	flush_block(src_file);
+	delay_move(src_file, new_file);
+	prealloc_drop(src_file);
+	extent_forget(src_file);
 
 	return 0;
 }
+
+// Allocate and zero the missing blocks backing bytes [offset, offset +
+// len) of regular file 'f', in one run behind its last block where the
+// disk allows, and extend the file to cover them.  Later writes there
+// need no allocation and cannot fail for lack of space.
+int
+file_allocate(struct File *f, off_t offset, off_t len)
+{
+	uint32_t bno, end, goal, blockno;
+	off_t covered = 0;
+	int ret = 0;
+
+	if (f->f_type != FTYPE_REG || offset < 0 || len <= 0 ||
+	    len > ((f->f_flags & FILE_EXTENTS) ? MAXFILESIZE : MAXFILESIZE_PTR) - offset)
+		return -E_INVAL;
+
+	bno = offset / BLKSIZE;
+	end = (offset + len + BLKSIZE - 1) / BLKSIZE;
+	goal = file_goal(f, bno);
+
+	for (; bno < end; bno++) {
+		ret = file_map_block(f, bno, &blockno);
+		if (ret < 0)
+			break;
+
+		// a delayed block has its free block kept already
+		if (!blockno && !delay_lookup(f, bno)) {
+			if (super->s_nfree <= ndelayed + DELAY_SLACK) {
+				ret = -E_NO_DISK;
+				break;
+			}
+
+			ret = alloc_block_near(goal, f);
+			if (ret < 0)
+				break;
+
+			blockno = ret;
+			bc_alloc_block(blockno);
+			ret = file_set_block(f, bno, blockno);
+			if (ret < 0) {
+				free_block(blockno);
+				discard_block(BLKNO2ADDR(blockno));
+				break;
+			}
+			goal = blockno + 1;
+			astat.falloc++;
+		}
+
+		covered = MIN(offset + len, (off_t)(bno + 1) * BLKSIZE);
+	}
+
+	// the file grows over the blocks it got, even when the disk
+	// filled up before the rest
+	if (covered > f->f_size)
+		f->f_size = covered;
+	if (ret < 0)
+		return ret;
+
+	prealloc_set(f, goal);
+	return 0;
+}
+
+// Report the allocation counters.
+void
+alloc_info(struct Fsreq_info *info)
+{
+	info->da_pending = ndelayed;
+	info->da_resolved = astat.resolved;
+	info->da_contig = astat.contig;
+	info->da_falloc = astat.falloc;
+}
@@ -125,6 +125,10 @@ opendisk(const char *name)
 	nbitblocks = (nblocks + BLKBITSIZE - 1) / BLKBITSIZE;
 	bitmap = alloc(nbitblocks * BLKSIZE);
 	memset(bitmap, 0xFF, nbitblocks * BLKSIZE);
+
+	/* metadata journal, an empty one is all zeroes */
+	super->s_journal = blockof(alloc(JOURNAL_NBLOCKS * BLKSIZE));
+	super->s_njournal = JOURNAL_NBLOCKS;
 }
 
 /* fill dir with file */
@@ -166,21 +170,18 @@ readn(int fd, void *out, size_t n)
 	}
 }
 
+/* every file is contiguous, a single extent */
 static void
 finishfile(struct File *file, uint32_t start_blk, uint32_t len)
 {
-	int i;
-
 	file->f_size = len;
+	file->f_flags = FILE_EXTENTS;
 	len = ROUNDUP(len, BLKSIZE);
-	for (i = 0; i < len / BLKSIZE && i < NDIRECT; ++i)
-		file->f_direct[i] = start_blk + i;
-	if (i == NDIRECT) {
-		uint32_t *index = alloc(BLKSIZE);
-
-		file->f_indirect = blockof(index);
-		for (; i < len / BLKSIZE; ++i)
-			index[i - NDIRECT] = start_blk + i;
+	if (len) {
+		file->f_nextent = 1;
+		file->f_extent[0].e_fileblk = 0;
+		file->f_extent[0].e_start = start_blk;
+		file->f_extent[0].e_len = len / BLKSIZE;
 	}
 }
 
@@ -242,6 +243,12 @@ finishdisk(void)
 		/* clear block-free bit */
 		bitmap[i / 32] &= ~(1 << (i % 32));
 
+	/* clear the bits past the end of the disk */
+	for (i = nblocks; i % BLKBITSIZE; ++i)
+		bitmap[i / 32] &= ~(1 << (i % 32));
+
+	super->s_nfree = nblocks - blockof(diskpos);
+
 	/* wait for sync whole memory */
 	ret = msync(diskmap, nblocks * BLKSIZE, MS_SYNC);
 	if (ret < 0)
@@ -0,0 +1,613 @@
+/*
+ * Hashed directory index, after the htree of ext3.
+ *
+ * A directory of HTREE_MIN_BLOCKS blocks or more gets an index of its
+ * names when one is next added, kept in blocks of the directory itself: a root holding the
+ * hash ranges of the index leaves, leaves holding sorted (hash, entry)
+ * pairs, and a map of the directory blocks that have free entries.
+ * Entries never move, so the struct File of an open file stays put.
+ * Looking a name up reads the root, one leaf and the block of each
+ * entry with the same hash; finding a free entry reads the map and one
+ * block.
+ *
+ * Index blocks leave the first byte of every struct File slot zero, so
+ * code scanning the directory linearly sees only free entries in them.
+ * An index block found with a name in it, or any index update that
+ * fails, drops the index and the directory is scanned linearly again.
+ *
+ * A writer that does not know the index (an older file server) adds
+ * names without it, and the index would then miss them.  So the first
+ * time an index is used after the file server starts, every name in
+ * the directory is checked against it, and a stale one is dropped.
+ */
+
+#include <lib.h>
+#include <fs/fs.h>
+
+// Smaller directories are only scanned linearly
+#define HTREE_MIN_BLOCKS	2
+
+// Directories whose index is known to hold all their names
+#define HTREE_NCHECKED	32
+
+// Index words per struct File slot, after the word holding f_name[0]
+#define HTREE_SLOT_WORDS	(sizeof(struct File) / 4 - 1)
+#define HTREE_WORDS		(BLKFILES * HTREE_SLOT_WORDS)
+
+#define HTREE_ROOT_MAGIC	0x544f4f52	// 'ROOT'
+#define HTREE_LEAF_MAGIC	0x4641454c	// 'LEAF'
+#define HTREE_FREE_MAGIC	0x45455246	// 'FREE'
+
+// Root: magic, leaves, free map block, then (first hash, leaf block)
+#define ROOT_NLEAF	1
+#define ROOT_FREE	2
+#define ROOT_ENTRY	4
+#define ROOT_MAX	((HTREE_WORDS - ROOT_ENTRY) / 2)
+
+// Leaf: magic, entries, then (hash, entry number) sorted by hash
+#define LEAF_COUNT	1
+#define LEAF_ENTRY	2
+#define LEAF_MAX	((HTREE_WORDS - LEAF_ENTRY) / 2)
+
+// Free map: magic, then one bit per directory block with free entries
+#define FREE_BITS	1
+#define FREE_MAX	((HTREE_WORDS - FREE_BITS) * 32)
+
+// The i'th index word of block 'blk'
+static uint32_t *
+hw(void *blk, uint32_t i)
+{
+	return (uint32_t *)blk + (i / HTREE_SLOT_WORDS) * (sizeof(struct File) / 4) +
+		1 + i % HTREE_SLOT_WORDS;
+}
+
+static struct File *htree_checked[HTREE_NCHECKED];
+
+static struct File **
+checked_slot(struct File *dir)
+{
+	return &htree_checked[(uint32_t)dir / sizeof(struct File) % HTREE_NCHECKED];
+}
+
+// FNV-1a hash of a name
+static uint32_t
+htree_hash(const char *name)
+{
+	uint32_t h = 2166136261u;
+
+	while (*name)
+		h = (h ^ (uint8_t)*name++) * 16777619;
+
+	return h;
+}
+
+// Give up the index of 'dir'; its blocks read as free entries.
+static void
+htree_drop(struct File *dir)
+{
+	dir->f_flags &= ~FILE_HTREE;
+	if (*checked_slot(dir) == dir)
+		*checked_slot(dir) = NULL;
+}
+
+// Map index block 'filebno' of 'dir' and check that it is one.
+static int
+htree_block(struct File *dir, uint32_t filebno, uint32_t magic, char **blk)
+{
+	int ret;
+	uint32_t i;
+
+	if (filebno >= dir->f_size / BLKSIZE)
+		return -E_INVAL;
+
+	ret = file_get_block(dir, filebno, blk);
+	if (ret < 0)
+		return ret;
+
+	if (*hw(*blk, 0) != magic)
+		return -E_INVAL;
+
+	for (i = 0; i < BLKFILES; i++) {
+		if ((*blk)[i * sizeof(struct File)] != '\0')
+			return -E_INVAL;
+	}
+
+	return 0;
+}
+
+// Add an empty index block with 'magic' at the end of 'dir'.
+static int
+htree_append(struct File *dir, uint32_t magic, uint32_t *filebno, char **blk)
+{
+	int ret;
+
+	*filebno = dir->f_size / BLKSIZE;
+	dir->f_size += BLKSIZE;
+
+	ret = file_get_block(dir, *filebno, blk);
+	if (ret < 0) {
+		dir->f_size -= BLKSIZE;
+		return ret;
+	}
+
+	memset(*blk, 0, BLKSIZE);
+	*hw(*blk, 0) = magic;
+	return 0;
+}
+
+// Index of the root entry whose leaf holds hash 'h'
+static uint32_t
+root_search(char *root, uint32_t h)
+{
+	uint32_t lo = 0, hi = *hw(root, ROOT_NLEAF), mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (*hw(root, ROOT_ENTRY + 2 * mid) <= h)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo ? lo - 1 : 0;
+}
+
+// Index of the first leaf entry with a hash of at least 'h'
+static uint32_t
+leaf_search(char *leaf, uint32_t h)
+{
+	uint32_t lo = 0, hi = *hw(leaf, LEAF_COUNT), mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (*hw(leaf, LEAF_ENTRY + 2 * mid) < h)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+// Index of the first leaf entry with a hash above 'h', where an entry
+// with hash 'h' goes after those already there
+static uint32_t
+leaf_search_upper(char *leaf, uint32_t h)
+{
+	uint32_t lo = 0, hi = *hw(leaf, LEAF_COUNT), mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (*hw(leaf, LEAF_ENTRY + 2 * mid) <= h)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+// Map the leaf holding hash 'h'; '*ri' is set to its root entry.
+static int
+htree_leaf(struct File *dir, uint32_t h, char **root, uint32_t *ri,
+	   char **leaf)
+{
+	int ret;
+
+	ret = htree_block(dir, dir->f_index, HTREE_ROOT_MAGIC, root);
+	if (ret < 0)
+		return ret;
+
+	if (*hw(*root, ROOT_NLEAF) == 0 || *hw(*root, ROOT_NLEAF) > ROOT_MAX)
+		return -E_INVAL;
+
+	*ri = root_search(*root, h);
+	return htree_block(dir, *hw(*root, ROOT_ENTRY + 2 * *ri + 1),
+			   HTREE_LEAF_MAGIC, leaf);
+}
+
+static void
+leaf_put(char *leaf, uint32_t i, uint32_t h, uint32_t loc)
+{
+	uint32_t n = *hw(leaf, LEAF_COUNT);
+
+	for (; n > i; n--) {
+		*hw(leaf, LEAF_ENTRY + 2 * n) = *hw(leaf, LEAF_ENTRY + 2 * n - 2);
+		*hw(leaf, LEAF_ENTRY + 2 * n + 1) = *hw(leaf, LEAF_ENTRY + 2 * n - 1);
+	}
+
+	*hw(leaf, LEAF_ENTRY + 2 * i) = h;
+	*hw(leaf, LEAF_ENTRY + 2 * i + 1) = loc;
+	(*hw(leaf, LEAF_COUNT))++;
+}
+
+// Record that entry 'loc' of 'dir' has a name hashing to 'h'.  A full
+// leaf is split at a hash boundary, so all entries of one hash stay in
+// one leaf.
+static int
+htree_insert(struct File *dir, uint32_t h, uint32_t loc)
+{
+	char *root, *leaf, *new;
+	uint32_t ri, n, mid, i, filebno, nleaf;
+	int ret;
+
+	ret = htree_leaf(dir, h, &root, &ri, &leaf);
+	if (ret < 0)
+		return ret;
+
+	n = *hw(leaf, LEAF_COUNT);
+	if (n < LEAF_MAX) {
+		leaf_put(leaf, leaf_search_upper(leaf, h), h, loc);
+		return 0;
+	}
+
+	nleaf = *hw(root, ROOT_NLEAF);
+	if (nleaf == ROOT_MAX)
+		return -E_NO_DISK;
+
+	for (mid = n / 2; mid < n && *hw(leaf, LEAF_ENTRY + 2 * mid) ==
+	     *hw(leaf, LEAF_ENTRY + 2 * mid - 2); mid++)
+		;
+	if (mid == n) {
+		for (mid = n / 2; mid > 0 && *hw(leaf, LEAF_ENTRY + 2 * mid) ==
+		     *hw(leaf, LEAF_ENTRY + 2 * mid - 2); mid--)
+			;
+		if (mid == 0)
+			return -E_NO_DISK;
+	}
+
+	ret = htree_append(dir, HTREE_LEAF_MAGIC, &filebno, &new);
+	if (ret < 0)
+		return ret;
+
+	for (i = mid; i < n; i++) {
+		*hw(new, LEAF_ENTRY + 2 * (i - mid)) = *hw(leaf, LEAF_ENTRY + 2 * i);
+		*hw(new, LEAF_ENTRY + 2 * (i - mid) + 1) = *hw(leaf, LEAF_ENTRY + 2 * i + 1);
+	}
+	*hw(new, LEAF_COUNT) = n - mid;
+	*hw(leaf, LEAF_COUNT) = mid;
+
+	for (i = nleaf; i > ri + 1; i--) {
+		*hw(root, ROOT_ENTRY + 2 * i) = *hw(root, ROOT_ENTRY + 2 * i - 2);
+		*hw(root, ROOT_ENTRY + 2 * i + 1) = *hw(root, ROOT_ENTRY + 2 * i - 1);
+	}
+	*hw(root, ROOT_ENTRY + 2 * (ri + 1)) = *hw(new, LEAF_ENTRY);
+	*hw(root, ROOT_ENTRY + 2 * (ri + 1) + 1) = filebno;
+	*hw(root, ROOT_NLEAF) = nleaf + 1;
+
+	if (h >= *hw(new, LEAF_ENTRY))
+		leaf = new;
+	leaf_put(leaf, leaf_search_upper(leaf, h), h, loc);
+	return 0;
+}
+
+// Mark directory block 'filebno' as having free entries or not.
+static int
+htree_set_free(struct File *dir, char *root, uint32_t filebno, bool free)
+{
+	char *map;
+	int ret;
+
+	if (filebno >= FREE_MAX)
+		return -E_NO_DISK;
+
+	ret = htree_block(dir, *hw(root, ROOT_FREE), HTREE_FREE_MAGIC, &map);
+	if (ret < 0)
+		return ret;
+
+	if (free)
+		*hw(map, FREE_BITS + filebno / 32) |= 1 << (filebno % 32);
+	else
+		*hw(map, FREE_BITS + filebno / 32) &= ~(1 << (filebno % 32));
+	return 0;
+}
+
+// Index all entries of the linear directory 'dir'.
+static int
+htree_build(struct File *dir)
+{
+	char *root, *map, *leaf, *blk;
+	uint32_t i, j, nblock, nfree, rootbno, mapbno, leafbno;
+	struct File *f;
+	int ret;
+
+	nblock = dir->f_size / BLKSIZE;
+	if ((ret = htree_append(dir, HTREE_ROOT_MAGIC, &rootbno, &root)) < 0 ||
+	    (ret = htree_append(dir, HTREE_FREE_MAGIC, &mapbno, &map)) < 0 ||
+	    (ret = htree_append(dir, HTREE_LEAF_MAGIC, &leafbno, &leaf)) < 0)
+		return ret;
+
+	*hw(root, ROOT_NLEAF) = 1;
+	*hw(root, ROOT_FREE) = mapbno;
+	*hw(root, ROOT_ENTRY) = 0;
+	*hw(root, ROOT_ENTRY + 1) = leafbno;
+	dir->f_index = rootbno;
+	dir->f_flags |= FILE_HTREE;
+	*checked_slot(dir) = dir;
+
+	for (i = 0; i < nblock; i++) {
+		ret = file_get_block(dir, i, &blk);
+		if (ret < 0)
+			goto fail;
+
+		f = (struct File *)blk;
+		for (nfree = 0, j = 0; j < BLKFILES; j++) {
+			if (f[j].f_name[0] == '\0') {
+				nfree++;
+				continue;
+			}
+
+			ret = htree_insert(dir, htree_hash(f[j].f_name),
+					   i * BLKFILES + j);
+			if (ret < 0)
+				goto fail;
+		}
+
+		if (nfree) {
+			ret = htree_set_free(dir, root, i, 1);
+			if (ret < 0)
+				goto fail;
+		}
+	}
+
+	return 0;
+
+fail:
+	htree_drop(dir);
+	return ret;
+}
+
+// Check that every name in 'dir' is in its index, once per directory
+// while the file server runs.  Returns 0 if the index can be used.
+static int
+htree_verify(struct File *dir)
+{
+	char *root, *leaf, *blk;
+	uint32_t i, j, k, n, h, ri, nblock, loc;
+	struct File *f;
+	int ret;
+
+	if (*checked_slot(dir) == dir)
+		return 0;
+
+	nblock = dir->f_size / BLKSIZE;
+	for (i = 0; i < nblock; i++) {
+		ret = file_get_block(dir, i, &blk);
+		if (ret < 0)
+			return ret;
+
+		f = (struct File *)blk;
+		for (j = 0; j < BLKFILES; j++) {
+			if (f[j].f_name[0] == '\0')
+				continue;
+
+			h = htree_hash(f[j].f_name);
+			ret = htree_leaf(dir, h, &root, &ri, &leaf);
+			if (ret < 0)
+				return ret;
+
+			loc = i * BLKFILES + j;
+			n = *hw(leaf, LEAF_COUNT);
+			for (k = leaf_search(leaf, h); k < n &&
+			     *hw(leaf, LEAF_ENTRY + 2 * k) == h; k++) {
+				if (*hw(leaf, LEAF_ENTRY + 2 * k + 1) == loc)
+					break;
+			}
+			if (k == n || *hw(leaf, LEAF_ENTRY + 2 * k) != h)
+				return -E_INVAL;
+		}
+	}
+
+	*checked_slot(dir) = dir;
+	return 0;
+}
+
+// Look 'name' up through the index of 'dir'.
+//
+// Returns 0 and sets *file on success, < 0 on error.  Errors are:
+//	-E_NOT_FOUND if the file is not found.
+//	-E_NOT_SUPP if 'dir' has no usable index; scan it linearly.
+int
+htree_lookup(struct File *dir, const char *name, struct File **file)
+{
+	char *root, *leaf, *blk;
+	uint32_t h, ri, i, n, loc;
+	struct File *f;
+	int ret;
+
+	if (!(dir->f_flags & FILE_HTREE))
+		return -E_NOT_SUPP;
+	if (htree_verify(dir) < 0)
+		goto drop;
+
+	h = htree_hash(name);
+	ret = htree_leaf(dir, h, &root, &ri, &leaf);
+	if (ret < 0)
+		goto drop;
+
+	n = *hw(leaf, LEAF_COUNT);
+	for (i = leaf_search(leaf, h); i < n && *hw(leaf, LEAF_ENTRY + 2 * i) == h; i++) {
+		loc = *hw(leaf, LEAF_ENTRY + 2 * i + 1);
+		ret = file_get_block(dir, loc / BLKFILES, &blk);
+		if (ret < 0)
+			goto drop;
+
+		f = (struct File *)blk + loc % BLKFILES;
+		if (strcmp(f->f_name, name) == 0) {
+			*file = f;
+			return 0;
+		}
+	}
+
+	return -E_NOT_FOUND;
+
+drop:
+	htree_drop(dir);
+	return -E_NOT_SUPP;
+}
+
+// Find a free entry in the indexed directory 'dir', adding a block if
+// there is none.  Sets *file to it and *loc to its entry number.
+//
+// Returns 0 on success, -E_NOT_SUPP if 'dir' has no usable index,
+// other errors < 0.
+static int
+htree_free_entry(struct File *dir, struct File **file, uint32_t *loc)
+{
+	char *root, *map, *blk;
+	uint32_t w, b, j, nfree, nblock;
+	struct File *f;
+	int ret;
+
+	if (htree_verify(dir) < 0)
+		goto drop;
+	ret = htree_block(dir, dir->f_index, HTREE_ROOT_MAGIC, &root);
+	if (ret < 0)
+		goto drop;
+	ret = htree_block(dir, *hw(root, ROOT_FREE), HTREE_FREE_MAGIC, &map);
+	if (ret < 0)
+		goto drop;
+
+	nblock = dir->f_size / BLKSIZE;
+	for (w = 0; w * 32 < nblock && w < FREE_MAX / 32; ) {
+		if (*hw(map, FREE_BITS + w) == 0) {
+			w++;
+			continue;
+		}
+
+		b = w * 32 + __builtin_ctz(*hw(map, FREE_BITS + w));
+		ret = file_get_block(dir, b, &blk);
+		if (ret < 0)
+			return ret;
+
+		f = (struct File *)blk;
+		for (nfree = 0, j = BLKFILES; j-- > 0; ) {
+			if (f[j].f_name[0] == '\0') {
+				nfree++;
+				*file = &f[j];
+				*loc = b * BLKFILES + j;
+			}
+		}
+
+		// the entry about to be taken was the last free one
+		if (nfree <= 1)
+			*hw(map, FREE_BITS + w) &= ~(1 << (b % 32));
+		if (nfree)
+			return 0;
+	}
+
+	if (nblock >= FREE_MAX)
+		return -E_NO_DISK;
+
+	dir->f_size += BLKSIZE;
+	ret = file_get_block(dir, nblock, &blk);
+	if (ret < 0) {
+		dir->f_size -= BLKSIZE;
+		return ret;
+	}
+
+	*hw(map, FREE_BITS + nblock / 32) |= 1 << (nblock % 32);
+	*file = (struct File *)blk;
+	*loc = nblock * BLKFILES;
+	return 0;
+
+drop:
+	htree_drop(dir);
+	return -E_NOT_SUPP;
+}
+
+// Find a free entry in 'dir' for a new name through its index, building
+// the index once the directory is large enough.
+//
+// Returns 0 on success, -E_NOT_SUPP if 'dir' is left to the linear
+// scan, other errors < 0.
+int
+htree_alloc(struct File *dir, struct File **file, uint32_t *loc)
+{
+	int ret;
+
+	if (!(dir->f_flags & FILE_HTREE)) {
+		if (dir->f_size / BLKSIZE < HTREE_MIN_BLOCKS)
+			return -E_NOT_SUPP;
+
+		ret = htree_build(dir);
+		if (ret < 0)
+			return -E_NOT_SUPP;
+	}
+
+	return htree_free_entry(dir, file, loc);
+}
+
+// Index the name just given to entry 'loc' of 'dir'.
+void
+htree_add(struct File *dir, uint32_t loc)
+{
+	struct File *f;
+	char *blk;
+	int ret;
+
+	if (!(dir->f_flags & FILE_HTREE))
+		return;
+
+	ret = file_get_block(dir, loc / BLKFILES, &blk);
+	if (ret < 0)
+		goto drop;
+
+	f = (struct File *)blk + loc % BLKFILES;
+	ret = htree_insert(dir, htree_hash(f->f_name), loc);
+	if (ret < 0)
+		goto drop;
+
+	return;
+
+drop:
+	htree_drop(dir);
+}
+
+// Remove the name of 'f', about to be cleared, from the index of 'dir'
+// and mark its block as having a free entry.
+void
+htree_remove(struct File *dir, struct File *f)
+{
+	char *root, *leaf, *blk;
+	uint32_t h, ri, i, n, loc;
+	int ret;
+
+	// another directory may take the place of 'f'
+	if (*checked_slot(f) == f)
+		*checked_slot(f) = NULL;
+
+	if (!(dir->f_flags & FILE_HTREE))
+		return;
+
+	h = htree_hash(f->f_name);
+	ret = htree_leaf(dir, h, &root, &ri, &leaf);
+	if (ret < 0)
+		goto drop;
+
+	n = *hw(leaf, LEAF_COUNT);
+	for (i = leaf_search(leaf, h); i < n && *hw(leaf, LEAF_ENTRY + 2 * i) == h; i++) {
+		loc = *hw(leaf, LEAF_ENTRY + 2 * i + 1);
+		ret = file_get_block(dir, loc / BLKFILES, &blk);
+		if (ret < 0)
+			goto drop;
+
+		if ((struct File *)blk + loc % BLKFILES != f)
+			continue;
+
+		for (n--; i < n; i++) {
+			*hw(leaf, LEAF_ENTRY + 2 * i) = *hw(leaf, LEAF_ENTRY + 2 * i + 2);
+			*hw(leaf, LEAF_ENTRY + 2 * i + 1) = *hw(leaf, LEAF_ENTRY + 2 * i + 3);
+		}
+		*hw(leaf, LEAF_COUNT) = n;
+
+		ret = htree_set_free(dir, root, loc / BLKFILES, 1);
+		if (ret < 0)
+			goto drop;
+		return;
+	}
+
+	// not indexed: the index is stale
+drop:
+	htree_drop(dir);
+}
@@ -1,5 +1,8 @@
 /*
- * Minimal PIO-based (non-interrupt-driven) IDE driver code.
+ * Minimal IDE driver code.  Transfers go by bus-master DMA, the kernel
+ * blocking us in sys_ide_dma until the interrupt of the transfer, and
+ * fall back to PIO (non-interrupt-driven) without a bus-master
+ * controller or for a buffer the kernel cannot hand to the device.
  * For information about what all this IDE/ATA magic means,
  * see the materials available on the class references page.
  */
@@ -13,7 +16,18 @@
 #define IDE_DF		0x20
 #define IDE_ERR		0x01
 
+#define IDE_CMD_READ		0x20
+#define IDE_CMD_WRITE		0x30
+#define IDE_CMD_READ_DMA	0xC8
+#define IDE_CMD_WRITE_DMA	0xCA
+
 static int diskno = 1;
+static bool ide_use_dma = true;
+
+static struct {
+	uint32_t dma;		// commands done by DMA
+	uint32_t pio;		// commands done by PIO
+} ide_stat;
 
 static int
 ide_wait_ready(bool check_error)
@@ -61,13 +75,10 @@ ide_set_disk(int disk_no)
 	diskno = disk_no;
 }
 
-int
-ide_read(uint32_t secno, void *dst, size_t nsecs)
+// Set the task file up for a transfer of 'nsecs' sectors at 'secno'.
+static void
+ide_select(uint32_t secno, size_t nsecs)
 {
-	int ret;
-
-	assert(nsecs <= 256);
-
 	ide_wait_ready(0);
 
 	outb(0x1F2, nsecs);
@@ -75,7 +86,47 @@ ide_read(uint32_t secno, void *dst, size_t nsecs)
 	outb(0x1F4, (secno >> 8) & 0xFF);
 	outb(0x1F5, (secno >> 16) & 0xFF);
 	outb(0x1F6, 0xE0 | ((diskno&1)<<4) | ((secno>>24)&0x0F));
-	outb(0x1F7, 0x20);	// CMD 0x20 means read sector
+}
+
+// Transfer 'nsecs' sectors at 'secno' by DMA command 'cmd'.  Returns
+// < 0 if the transfer has to be done by PIO instead.
+static int
+ide_dma(int cmd, uint32_t secno, const void *buf, size_t nsecs)
+{
+	int ret;
+
+	if (!ide_use_dma)
+		return -E_NOT_SUPP;
+
+	ide_select(secno, nsecs);
+	ret = sys_ide_dma(cmd, buf, nsecs * SECTSIZE);
+	if (ret == 0) {
+		ide_stat.dma++;
+		return 0;
+	}
+
+	// no controller, or one that fails: PIO from now on
+	if (ret == -E_IO)
+		cprintf("ide: DMA failed, falling back to PIO\n");
+	if (ret == -E_NOT_SUPP || ret == -E_IO)
+		ide_use_dma = false;
+
+	return ret;
+}
+
+int
+ide_read(uint32_t secno, void *dst, size_t nsecs)
+{
+	int ret;
+
+	assert(nsecs <= 256);
+
+	if (ide_dma(IDE_CMD_READ_DMA, secno, dst, nsecs) == 0)
+		return 0;
+
+	ide_select(secno, nsecs);
+	outb(0x1F7, IDE_CMD_READ);
+	ide_stat.pio++;
 
 	for (; nsecs > 0; nsecs--, dst += SECTSIZE) {
 		ret = ide_wait_ready(1);
@@ -96,14 +147,12 @@ ide_write(uint32_t secno, const void *src, size_t nsecs)
 
 	assert(nsecs <= 256);
 
-	ide_wait_ready(0);
+	if (ide_dma(IDE_CMD_WRITE_DMA, secno, src, nsecs) == 0)
+		return 0;
 
-	outb(0x1F2, nsecs);
-	outb(0x1F3, secno & 0xFF);
-	outb(0x1F4, (secno >> 8) & 0xFF);
-	outb(0x1F5, (secno >> 16) & 0xFF);
-	outb(0x1F6, 0xE0 | ((diskno&1)<<4) | ((secno>>24)&0x0F));
-	outb(0x1F7, 0x30);	// CMD 0x30 means write sector
+	ide_select(secno, nsecs);
+	outb(0x1F7, IDE_CMD_WRITE);
+	ide_stat.pio++;
 
 	for (; nsecs > 0; nsecs--, src += SECTSIZE) {
 		ret = ide_wait_ready(1);
@@ -115,3 +164,11 @@ ide_write(uint32_t secno, const void *src, size_t nsecs)
 
 	return 0;
 }
+
+// Report how the transfers were done.
+void
+ide_info(struct Fsreq_info *info)
+{
+	info->ide_dma = ide_stat.dma;
+	info->ide_pio = ide_stat.pio;
+}
@@ -0,0 +1,441 @@
+/*
+ * Write-ahead journal for the metadata blocks: the bitmap, the
+ * superblock, indirect blocks and directory blocks.
+ *
+ * A commit first writes the dirty data blocks in place, then copies all
+ * dirty metadata blocks behind a header at the head of the journal and
+ * writes header and copies with one sequential transfer.  The cached
+ * blocks are then clean.  Every sync or flush is one commit of the
+ * whole dirty set, which batches the updates of all clients into one
+ * journal write.  Commits only happen between requests, and one always
+ * fits in the journal (see bc_commit_due), so a request is either
+ * entirely in a transaction or not at all.
+ *
+ * The journal is a start block followed by a ring of transactions.
+ * They reach their home locations only at a checkpoint, from the
+ * write-back timer or when the ring has no room for the next commit, so
+ * a sync costs one sequential write and a block updated by many commits
+ * is written in place once.  The checkpoint then records in the start
+ * block which transaction comes next.  A block read from disk while the
+ * ring holds a newer copy is read from that copy.
+ *
+ * fs_init replays the transactions from the start block on for as long
+ * as their checksums match; installing one again is harmless.  That is
+ * only true if no logged block was written in place since, so a freed
+ * metadata block is not handed out again before the checkpoint after
+ * the commit that records the free.
+ */
+
+#include <lib.h>
+#include <fs/fs.h>
+
+// Blocks per ide_write
+#define JOURNAL_BATCH	(256 / BLKSECTS)
+
+// Transactions the ring can hold, each a header and at least one copy
+#define JOURNAL_MAXTXN	512
+
+#define JOURNAL_NMAP	(DISKSIZE / BLKSIZE / 32)
+
+static struct JournalStart *js;		// start block, mapped at its block
+static uint32_t jseq;			// sequence number of the next commit
+static uint32_t jhead;			// where the next commit goes unless it wraps
+
+// Header positions of the transactions not installed yet, oldest first
+static uint32_t jlog[JOURNAL_MAXTXN];
+static uint32_t jlive;
+
+// Blocks with a copy in a transaction not installed yet
+static uint32_t jpendmap[JOURNAL_NMAP];
+
+// Metadata blocks freed since the last commit, freed by a transaction
+// not installed yet, and freed by an installed one, for journal_release
+static uint32_t jfreemap[JOURNAL_NMAP];
+static uint32_t jheldmap[JOURNAL_NMAP];
+static uint32_t jreadymap[JOURNAL_NMAP];
+
+static struct {
+	uint32_t commit;	// transactions committed
+	uint32_t logged;	// blocks logged
+	uint32_t install;	// checkpoints
+} jstat;
+
+static void
+jmap_set(uint32_t *map, uint32_t blockno)
+{
+	map[blockno / 32] |= 1 << (blockno % 32);
+}
+
+static bool
+jmap_test(const uint32_t *map, uint32_t blockno)
+{
+	return map[blockno / 32] & (1 << (blockno % 32));
+}
+
+// Add the blocks of 'from' to 'to' and empty 'from'.
+static void
+jmap_move(uint32_t *from, uint32_t *to)
+{
+	uint32_t i;
+
+	for (i = 0; i * 32 < super->s_nblocks; i++) {
+		to[i] |= from[i];
+		from[i] = 0;
+	}
+}
+
+// Address of the journal block at position 'pos'
+static void *
+journal_block(uint32_t pos)
+{
+	return diskaddr(super->s_journal + pos);
+}
+
+// Address of the i'th copy of the transaction with header 'h'
+static void *
+journal_copy(struct JournalHeader *h, uint32_t i)
+{
+	return (char *)h + (1 + i) * BLKSIZE;
+}
+
+static uint32_t
+journal_sum(struct JournalHeader *h)
+{
+	uint32_t i, j, sum = 0;
+	uint32_t *p;
+
+	for (i = 0; i < h->jh_nblocks; i++)
+		sum = sum * 31 + h->jh_blockno[i];
+
+	for (i = 0; i < h->jh_nblocks; i++) {
+		p = journal_copy(h, i);
+		for (j = 0; j < BLKSIZE / 4; j++)
+			sum = sum * 31 + p[j];
+	}
+
+	return sum;
+}
+
+// Move 'nblocks' blocks starting at 'blockno' between the disk and
+// their pages, as few IDE commands as possible.
+static void
+journal_io(uint32_t blockno, uint32_t nblocks, bool write)
+{
+	uint32_t n;
+	int ret;
+
+	for (; nblocks > 0; blockno += n, nblocks -= n) {
+		n = MIN(nblocks, JOURNAL_BATCH);
+		if (write)
+			ret = ide_write(blockno * BLKSECTS, diskaddr(blockno),
+					n * BLKSECTS);
+		else
+			ret = ide_read(blockno * BLKSECTS, diskaddr(blockno),
+				       n * BLKSECTS);
+		if (ret < 0)
+			panic("%s: ide %e", __func__, ret);
+	}
+}
+
+// Is there a committed transaction 'seq' with its header at 'pos'?
+static bool
+journal_valid(uint32_t pos, uint32_t seq)
+{
+	struct JournalHeader *h = journal_block(pos);
+
+	if (h->jh_magic != JOURNAL_MAGIC || h->jh_seq != seq ||
+	    h->jh_nblocks == 0 || h->jh_nblocks >= super->s_njournal - pos)
+		return false;
+
+	return journal_sum(h) == h->jh_sum;
+}
+
+// Find transaction 'seq', which follows the one ending at 'pos': there,
+// or at the front of the ring if it did not fit before the end.
+// Returns its position, 0 if it was not committed.
+static uint32_t
+journal_find(uint32_t pos, uint32_t seq)
+{
+	if (pos > 0 && pos < super->s_njournal && journal_valid(pos, seq))
+		return pos;
+	if (pos != 1 && journal_valid(1, seq))
+		return 1;
+	return 0;
+}
+
+// Where a transaction of 'need' blocks goes without overwriting one that
+// is not installed: at the head, or at the front of the ring if it does
+// not fit before the end.  Returns 0 if there is no room.
+static uint32_t
+journal_place(uint32_t need)
+{
+	uint32_t first;
+
+	if (!jlive)
+		return jhead + need <= super->s_njournal ? jhead : 1;
+
+	first = jlog[0];
+	if (jhead > first) {
+		if (jhead + need <= super->s_njournal)
+			return jhead;
+		return 1 + need <= first ? 1 : 0;
+	}
+
+	return jhead + need <= first ? jhead : 0;
+}
+
+// Checkpoint: write the newest logged copy of every block to its home
+// location and record in the start block that the ring is empty.  The
+// blocks the installed transactions freed are released by the next
+// journal_release.
+void
+journal_install(void)
+{
+	struct JournalHeader *h;
+	uint32_t i, k, blockno;
+	int ret;
+
+	if (!jlive)
+		return;
+
+	// newest first, older copies of the same block are skipped
+	for (k = jlive; k-- > 0; ) {
+		h = journal_block(jlog[k]);
+		for (i = 0; i < h->jh_nblocks; i++) {
+			blockno = h->jh_blockno[i];
+			if (!jmap_test(jpendmap, blockno))
+				continue;
+
+			ret = ide_write(blockno * BLKSECTS, journal_copy(h, i),
+					BLKSECTS);
+			if (ret < 0)
+				panic("%s: ide_write %e", __func__, ret);
+			jpendmap[blockno / 32] &= ~(1 << (blockno % 32));
+		}
+	}
+
+	js->js_magic = JOURNAL_MAGIC;
+	js->js_seq = jseq;
+	js->js_pos = jhead;
+	journal_io(super->s_journal, 1, 1);
+
+	jlive = 0;
+	jmap_move(jheldmap, jreadymap);
+	jstat.install++;
+}
+
+// Is the home location of 'blockno' older than its journal copy?
+bool
+journal_pending(uint32_t blockno)
+{
+	return js && jmap_test(jpendmap, blockno);
+}
+
+// Fill the page at 'va' with the newest logged copy of 'blockno'.
+// Returns false if its home location is up to date.
+bool
+journal_read(uint32_t blockno, void *va)
+{
+	struct JournalHeader *h;
+	void *copy = NULL;
+	uint32_t i, k;
+
+	if (!journal_pending(blockno))
+		return false;
+
+	for (k = 0; k < jlive; k++) {
+		h = journal_block(jlog[k]);
+		for (i = 0; i < h->jh_nblocks; i++) {
+			if (h->jh_blockno[i] == blockno)
+				copy = journal_copy(h, i);
+		}
+	}
+
+	if (!copy)
+		panic("%s: block %08x is not logged", __func__, blockno);
+
+	memmove(va, copy, BLKSIZE);
+	return true;
+}
+
+// Hold back freeing the metadata block 'blockno' until the commit that
+// records the free is installed.  Returns false if it can be freed
+// right away.
+bool
+journal_free(uint32_t blockno)
+{
+	if (!js)
+		return false;
+
+	jmap_set(jfreemap, blockno);
+	return true;
+}
+
+// Most metadata blocks one commit can take
+uint32_t
+journal_capacity(void)
+{
+	if (!js)
+		return ~0U;
+
+	return super->s_njournal - 2;
+}
+
+// Commit the dirty metadata blocks listed in 'blocks' as one
+// transaction.  They are clean in the block cache afterwards.
+void
+journal_commit(const uint32_t *blocks, uint32_t nblocks)
+{
+	struct JournalHeader *h;
+	uint32_t i, n, pos;
+	void *va;
+
+	if (!js) {
+		// an image without a journal is written in place
+		for (i = 0; i < nblocks; i++)
+			flush_block(diskaddr(blocks[i]));
+		return;
+	}
+
+	for (n = 0, i = 0; i < nblocks; i++) {
+		va = diskaddr(blocks[i]);
+		if (va_is_mapped(va) && va_is_dirty(va))
+			n++;
+	}
+
+	if (n == 0)
+		return;
+	if (n > journal_capacity())
+		panic("%s: more than %u blocks", __func__, journal_capacity());
+
+	pos = journal_place(1 + n);
+	if (!pos) {
+		journal_install();
+		pos = journal_place(1 + n);
+	}
+
+	h = journal_block(pos);
+	for (n = 0, i = 0; i < nblocks; i++) {
+		va = diskaddr(blocks[i]);
+		if (!va_is_mapped(va) || !va_is_dirty(va))
+			continue;
+
+		memmove(journal_copy(h, n), va, BLKSIZE);
+		h->jh_blockno[n++] = blocks[i];
+		jmap_set(jpendmap, blocks[i]);
+		clean_block(va);
+	}
+
+	h->jh_magic = JOURNAL_MAGIC;
+	h->jh_seq = jseq++;
+	h->jh_nblocks = n;
+	h->jh_sum = journal_sum(h);
+	journal_io(super->s_journal + pos, 1 + n, 1);
+
+	jlog[jlive++] = pos;
+	jhead = pos + 1 + n;
+	jmap_move(jfreemap, jheldmap);
+	jstat.commit++;
+	jstat.logged += n;
+}
+
+// Free the metadata blocks held back until the transactions that stopped
+// referencing them were installed.  The bitmap update goes out with the
+// next commit.
+void
+journal_release(void)
+{
+	uint32_t i, b;
+
+	if (!js)
+		return;
+
+	for (i = 0; i * 32 < super->s_nblocks; i++) {
+		while (jreadymap[i]) {
+			b = __builtin_ctz(jreadymap[i]);
+			jreadymap[i] &= ~(1 << b);
+			block_set_free(i * 32 + b);
+		}
+	}
+}
+
+// Map the journal, replay the transactions committed since the last
+// checkpoint and install them.
+void
+journal_init(void)
+{
+	struct JournalHeader *h;
+	uint32_t i, k, pos, seq, blockno;
+	int ret;
+
+	if (!super->s_njournal)
+		return;
+
+	if (super->s_njournal < 3 ||
+	    super->s_njournal - 2 > (BLKSIZE - sizeof(*h)) / sizeof(uint32_t) ||
+	    super->s_journal + super->s_njournal > super->s_nblocks)
+		panic("bad journal at block %u, %u blocks",
+		      super->s_journal, super->s_njournal);
+
+	// the journal stays mapped and outside of the block cache
+	for (i = 0; i < super->s_njournal; i++) {
+		ret = sys_page_alloc(0, journal_block(i), PTE_W);
+		if (ret < 0)
+			panic("%s: sys_page_alloc %e", __func__, ret);
+	}
+	journal_io(super->s_journal, super->s_njournal, 0);
+
+	js = journal_block(0);
+	jlive = 0;
+	if (js->js_magic != JOURNAL_MAGIC) {
+		cprintf("journal is empty\n");
+		jseq = 1;
+		jhead = 1;
+		return;
+	}
+
+	for (pos = js->js_pos, seq = js->js_seq; jlive < JOURNAL_MAXTXN; seq++) {
+		k = journal_find(pos, seq);
+		if (!k)
+			break;
+
+		h = journal_block(k);
+		for (i = 0; i < h->jh_nblocks; i++) {
+			blockno = h->jh_blockno[i];
+			if (blockno == 0 || blockno >= super->s_nblocks ||
+			    (blockno >= super->s_journal &&
+			     blockno < super->s_journal + super->s_njournal))
+				panic("journal logs bad block %08x", blockno);
+			jmap_set(jpendmap, blockno);
+		}
+
+		jlog[jlive++] = k;
+		pos = k + 1 + h->jh_nblocks;
+	}
+
+	jseq = seq;
+	jhead = (pos > 0 && pos <= super->s_njournal) ? pos : 1;
+	if (!jlive) {
+		cprintf("journal is empty\n");
+		return;
+	}
+
+	// drop the stale copies read before the replay
+	for (k = 0; k < jlive; k++) {
+		h = journal_block(jlog[k]);
+		for (i = 0; i < h->jh_nblocks; i++)
+			release_block(diskaddr(h->jh_blockno[i]));
+	}
+
+	cprintf("journal replays transactions %u-%u\n", js->js_seq, seq - 1);
+	journal_install();
+}
+
+// Report the journal counters.
+void
+journal_info(struct Fsreq_info *info)
+{
+	info->j_commit = jstat.commit;
+	info->j_logged = jstat.logged;
+	info->j_install = jstat.install;
+}
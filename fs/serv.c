@@ -4,9 +4,18 @@
 
 #define debug 0
 
+// Seconds between write-backs of the dirty blocks
+#define WRITEBACK_SEC	5
+
+// Most bytes allocated between two chances to commit
+#define FALLOC_CHUNK	(64 * BLKSIZE)
+
 // Max number of open files in the file system at once
 #define MAXOPEN		1024
 #define FILEVA		0xD0000000
+// Second mapping of the Fd page of files opened through a ring,
+// which keeps them open while no client maps the Fd page.
+#define RINGFILEVA	(FILEVA + MAXOPEN * PGSIZE)
 
 // The file system server maintains three structures
 // for each open file.
@@ -33,6 +42,8 @@ struct OpenFile {
 	struct File *o_file;		// mapped descriptor for open file
 	int o_mode;			// open mode
 	struct Fd *o_fd;		// Fd page
+	envid_t o_ring;			// ring client holding it open, if any
+	struct Readahead o_ra;		// sequential read state
 };
 
 // initialize to force into data section
@@ -40,6 +51,15 @@ struct OpenFile opentab[MAXOPEN] = {
 	{ 0, 0, 1, 0 },
 };
 
+// Submission/completion rings of the clients
+static struct Ring rings[NRINGSRV];
+
+// Environment that wakes us up for periodic write-back
+static envid_t writeback_envid;
+
+// Set while draining a ring, whose flushes share one commit
+static bool ring_batch;
+
 // Virtual address at which to receive page mappings containing client requests.
 union Fsipc *fsreq = (union Fsipc *)0x0ffff000;
 
@@ -54,6 +74,22 @@ serve_init(void)
 		opentab[i].o_fd = (struct Fd *)va;
 		va += PGSIZE;
 	}
+
+	ring_srv_init(rings, NRINGSRV);
+}
+
+static void *
+openfile_ringva(struct OpenFile *o)
+{
+	return (void *)(RINGFILEVA + (o->o_fileid % MAXOPEN) * PGSIZE);
+}
+
+// Drop the extra Fd mapping taken for a file opened through a ring.
+static void
+openfile_unpin(struct OpenFile *o)
+{
+	sys_page_unmap(0, openfile_ringva(o));
+	o->o_ring = 0;
 }
 
 // Allocate an open file.
@@ -64,6 +100,10 @@ openfile_alloc(struct OpenFile **o)
 
 	// Find an available open-file table entry
 	for (i = 0; i < MAXOPEN; i++) {
+		// files the ring client never closed before exiting
+		if (opentab[i].o_ring && !ring_alive(opentab[i].o_ring))
+			openfile_unpin(&opentab[i]);
+
 		switch (pageref(opentab[i].o_fd)) {
 		case 0:
 			/* this case is opentab[i].o_fd never be used before */
@@ -188,6 +228,7 @@ try_open:
 	o->o_fd->fd_omode = req->req_omode & O_ACCMODE;
 	o->o_fd->fd_dev_id = devfile.dev_id;
 	o->o_mode = req->req_omode;
+	memset(&o->o_ra, 0, sizeof(o->o_ra));
 
 	if (debug)
 		cprintf("sending success, page %08x\n", (uintptr_t)o->o_fd);
@@ -249,6 +290,7 @@ serve_read(envid_t envid, union Fsipc *ipc)
 	if (ret < 0)
 		return ret;
 
+	file_readahead(o->o_file, &o->o_ra, req->req_n, o->o_fd->fd_offset);
 	ret = file_read(o->o_file, req_ret->ret_buf, req->req_n, o->o_fd->fd_offset);
 	if (ret < 0)
 		return ret;
@@ -334,7 +376,12 @@ static int serve_flush(envid_t envid, struct Fsreq_flush *req)
 	if (ret < 0)
 		return ret;
 
-	file_flush(o->o_file);
+	if (!ring_batch)
+		file_flush(o->o_file);
+
+	// flush is the close of a file opened through a ring
+	if (o->o_ring)
+		openfile_unpin(o);
 
 	// all processes detach this file
 	if (fileisclosed(o->o_file))
@@ -343,7 +390,7 @@ static int serve_flush(envid_t envid, struct Fsreq_flush *req)
 	return 0;
 }
 
-static int file_mutex_remove(struct File *f)
+static int file_mutex_remove(struct File *dir, struct File *f)
 {
 	int ret;
 
@@ -364,7 +411,7 @@ static int file_mutex_remove(struct File *f)
 	if (debug)
 		cprintf("remove %s\n", f->f_name);
 
-	ret = file_remove(f);
+	ret = file_remove(dir, f);
 	if (ret < 0) {
 		if (debug)
 			warn("file_remove failed: %e", ret);
@@ -380,7 +427,7 @@ serve_remove(envid_t envid, struct Fsreq_remove *req)
 {
 	char path[MAXPATHLEN];
 	int ret;
-	struct File *f;
+	struct File *dir, *f;
 
 	if (debug)
 		cprintf("%s %08x %s\n", __func__, envid, req->req_path);
@@ -389,7 +436,7 @@ serve_remove(envid_t envid, struct Fsreq_remove *req)
 	memmove(path, req->req_path, MAXPATHLEN);
 	path[MAXPATHLEN - 1] = 0;
 
-	ret = file_open(path, &f);
+	ret = file_open_parent(path, &dir, &f);
 	if (ret < 0) {
 		if (debug)
 			warn("file_open failed: %e", ret);
@@ -397,7 +444,7 @@ serve_remove(envid_t envid, struct Fsreq_remove *req)
 		return ret;
 	}
 
-	return file_mutex_remove(f);
+	return file_mutex_remove(dir, f);
 }
 
 static int
@@ -410,16 +457,14 @@ serve_sync(envid_t envid, union Fsipc *req)
 static int
 serve_info(envid_t envid, union Fsipc *req)
 {
-	uint32_t cnt;
-	int i;
-
-	for (cnt = 0, i = 0; i < super->s_nblocks; i++) {
-		if (!block_is_free(i))
-			cnt++;
-	}
-
 	req->info.blk_num = super->s_nblocks;
-	req->info.blk_ocp = cnt;
+	req->info.blk_ocp = super->s_nblocks - super->s_nfree;
+	ide_info(&req->info);
+	bc_info(&req->info);
+	journal_info(&req->info);
+	alloc_info(&req->info);
+	extent_info(&req->info);
+	dcache_info(&req->info);
 
 	return 0;
 }
@@ -428,9 +473,9 @@ static int
 serve_rename(envid_t envid, union Fsipc *req)
 {
 	int ret;
-	struct File *dst_file, *src_file;
+	struct File *dst_file, *src_dir, *src_file;
 
-	ret = file_open(req->rename.src_path, &src_file);
+	ret = file_open_parent(req->rename.src_path, &src_dir, &src_file);
 	if (ret < 0)
 		return ret;
 
@@ -441,7 +486,41 @@ serve_rename(envid_t envid, union Fsipc *req)
 	if (ret < 0)
 		return ret;
 
-	return file_rename(dst_file, src_file);
+	return file_rename(dst_file, src_dir, src_file);
+}
+
+// Allocate the blocks of bytes [req->req_offset, req->req_offset +
+// req->req_len) of req->req_fileid, extending the file if necessary.
+// A large range is allocated FALLOC_CHUNK bytes at a time, each one
+// like a request of its own, so its metadata fits in one commit.
+static int
+serve_fallocate(envid_t envid, struct Fsreq_fallocate *req)
+{
+	struct OpenFile *o;
+	off_t offset = req->req_offset, len = req->req_len, n;
+	int ret;
+
+	if (debug)
+		cprintf("%s %08x %08x %08x %08x\n", __func__, envid,
+			req->req_fileid, req->req_offset, req->req_len);
+
+	ret = openfile_lookup(envid, req->req_fileid, &o);
+	if (ret < 0)
+		return ret;
+
+	if (offset < 0 || len <= 0 || len > MAXFILESIZE - offset)
+		return -E_INVAL;
+
+	for (; len > 0; offset += n, len -= n) {
+		n = MIN(len, FALLOC_CHUNK);
+		ret = file_allocate(o->o_file, offset, n);
+		if (ret < 0)
+			return ret;
+
+		fs_sync_point();
+	}
+
+	return 0;
 }
 
 typedef int (*fshandler)(envid_t envid, union Fsipc *req);
@@ -458,23 +537,111 @@ fshandler handlers[] = {
 	[FSREQ_SYNC] = serve_sync,
 	[FSREQ_INFO] = serve_info,
 	[FSREQ_RENAME] = serve_rename,
+	[FSREQ_FALLOCATE] = (fshandler)serve_fallocate,
 };
 
+// Open a file for a ring client.  Instead of sharing the Fd page,
+// keep it mapped a second time here and return the file id.
+static int
+serve_ring_open(envid_t envid, struct Fsreq_open *req)
+{
+	struct Fd *fd;
+	struct OpenFile *o;
+	int perm, ret;
+
+	ret = serve_open(envid, req, (void **)&fd, &perm);
+	if (ret < 0)
+		return ret;
+
+	o = &opentab[fd->fd_file.id % MAXOPEN];
+	ret = sys_page_map(0, fd, 0, openfile_ringva(o), PTE_P | PTE_U | PTE_W);
+	if (ret < 0)
+		return ret;
+
+	o->o_ring = envid;
+	return o->o_fileid;
+}
+
+// Drain the submission queue of envid's ring in one batch.  Results
+// go to the completion queue; the client gets no IPC reply unless it
+// 'wait's for a completion.
+static void
+serve_ring(envid_t envid, bool wait)
+{
+	struct Ring *r;
+	struct ring_sqe sqe;
+	struct ring_sqe flushes[RING_ENTRIES];
+	union Fsipc *req;
+	int ret, i, n = 0, nflush = 0;
+
+	r = ring_lookup(rings, NRINGSRV, envid);
+	if (!r) {
+		cprintf("Ring request from %08x without ring\n", envid);
+		return;
+	}
+
+	ring_batch = true;
+	while ((req = ring_next(r, &sqe))) {
+		if (sqe.sqe_op == FSREQ_OPEN)
+			ret = serve_ring_open(envid, &req->open);
+		else if (sqe.sqe_op < ARRAY_SIZE(handlers) && handlers[sqe.sqe_op])
+			ret = handlers[sqe.sqe_op](envid, req);
+		else
+			ret = -E_INVAL;
+
+		n++;
+		fs_sync_point();
+
+		// a flush completes once the commit below is on disk
+		if (sqe.sqe_op == FSREQ_FLUSH && ret == 0 && nflush < RING_ENTRIES) {
+			flushes[nflush++] = sqe;
+			continue;
+		}
+		ring_complete(r, &sqe, ret);
+	}
+	ring_batch = false;
+
+	// group commit: all flushes of the batch share one journal write
+	if (nflush > 0) {
+		fs_sync();
+		for (i = 0; i < nflush; i++)
+			ring_complete(r, &flushes[i], 0);
+	}
+
+	if (wait)
+		ring_srv_wait(r);
+
+	if (debug)
+		cprintf("%s %08x: %d requests\n", __func__, envid, n);
+}
+
 static void
 serve(void)
 {
 	uint32_t req;
 	envid_t whom;
-	int perm, ret;
+	int i, perm, ret;
 	void *pg;
 
 	while (1) {
+		// a ring client may not have reached ipc_recv when its
+		// completion was posted; one that never does only gets a
+		// few tries
+		for (i = 0; ring_srv_notify(rings, NRINGSRV) && i < 32; i++)
+			sys_yield();
+
 		perm = 0;
 		req = ipc_recv(&whom, fsreq, &perm);
 		if (debug)
 			cprintf("fs req %d from %08x [page %08x: %s]\n",
 				req, whom, uvpt[PGNUM(fsreq)], (char *)fsreq);
 
+		if (req == FSREQ_WRITEBACK && whom == writeback_envid) {
+			fs_sync();
+			journal_install();
+			continue;
+		}
+
 		// All requests must contain an argument page
 		if (!(perm & PTE_P)) {
 			cprintf("Invalid request from %08x: no argument page\n",
@@ -486,6 +653,17 @@ serve(void)
 		if (req == FSREQ_OPEN) {
 			ret = serve_open(whom, (struct Fsreq_open *)fsreq, &pg, &perm);
 
+		} else if (req == FSREQ_RING_SETUP) {
+			ret = ring_attach(rings, NRINGSRV, whom, fsreq);
+
+		} else if (req == FSREQ_RING_BUF) {
+			ret = ring_attach_buf(rings, NRINGSRV, whom, fsreq);
+
+		} else if (req == FSREQ_RING_ENTER || req == FSREQ_RING_WAIT) {
+			serve_ring(whom, req == FSREQ_RING_WAIT);
+			sys_page_unmap(0, fsreq);
+			continue;
+
 		} else if (req < ARRAY_SIZE(handlers) && handlers[req]) {
 			ret = handlers[req](whom, fsreq);
 
@@ -496,21 +674,50 @@ serve(void)
 
 		ipc_send(whom, ret, pg, perm);
 		sys_page_unmap(0, fsreq);
+		fs_sync_point();
+	}
+}
+
+// Wake the server every WRITEBACK_SEC seconds to write back the dirty
+// blocks, so they reach the disk even if nobody syncs.
+static void
+writeback_timer(envid_t envid)
+{
+	sys_env_name(0, "fs_writeback");
+
+	while (1) {
+		sleep(WRITEBACK_SEC);
+		ipc_send(envid, FSREQ_WRITEBACK, NULL, 0);
 	}
 }
 
 void
 umain(int argc, char **argv)
 {
+	envid_t fs_envid = sys_getenvid();
+
 	static_assert(sizeof(struct File) == 256);
 	sys_env_name(0, "fs");
 	cprintf("FS is running\n");
 
+	// fork off the write-back timer before the disk is mapped,
+	// so it shares none of the block cache
+	writeback_envid = fork();
+	if (writeback_envid < 0) {
+		panic("error forking");
+	} else if (writeback_envid == 0) {
+		writeback_timer(fs_envid);
+		return;
+	}
+
 	// Check that we are able to do I/O
 	outw(0x8A00, 0x8A00);
 	cprintf("FS can do I/O\n");
 
 	serve_init();
 	fs_init();
+#ifdef FS_TEST
+	fs_test();
+#endif
 	serve();
 }
@@ -3,29 +3,39 @@
 #include <fs/fs.h>
 #include <lib.h>
 
+// The tests change the image they run on, so the file server only runs
+// them when built with -DFS_TEST (see prep-fstest), on a fresh fs.img.
+
 static char *msg = "This is the NEW message of the day!\n\n";
 
-void
-fs_test(void)
+// Scratch page for bitmap and disk block copies
+static uint32_t *scratch = (uint32_t *) PGSIZE;
+
+static void
+test_alloc_block(void)
 {
-	struct File *f;
 	int r;
-	char *blk;
-	uint32_t *bits;
 
-	// back up bitmap
-	if ((r = sys_page_alloc(0, (void *) PGSIZE, PTE_P|PTE_U|PTE_W)) < 0)
-		panic("sys_page_alloc: %e", r);
-	bits = (uint32_t *) PGSIZE;
-	memmove(bits, bitmap, PGSIZE);
+	memmove(scratch, bitmap, PGSIZE);
 	// allocate block
 	if ((r = alloc_block()) < 0)
 		panic("alloc_block: %e", r);
 	// check that block was free
-	assert(bits[r/32] & (1 << (r%32)));
+	assert(scratch[r/32] & (1 << (r%32)));
 	// and is not free any more
 	assert(!(bitmap[r/32] & (1 << (r%32))));
+	free_block(r);
+	assert(bitmap[r/32] & (1 << (r%32)));
 	cprintf("alloc_block is good\n");
+}
+
+static void
+test_file(void)
+{
+	struct File *f;
+	int r;
+	char *blk;
+	uint32_t blockno;
 
 	if ((r = file_open("/not-found", &f)) < 0 && r != -E_NOT_FOUND)
 		panic("file_open /not-found: %e", r);
@@ -49,19 +59,222 @@ fs_test(void)
 
 	if ((r = file_set_size(f, 0)) < 0)
 		panic("file_set_size: %e", r);
-	assert(f->f_direct[0] == 0);
-	assert(!(uvpt[PGNUM(f)] & PTE_D));
+	assert(file_map_block(f, 0, &blockno) == 0 && blockno == 0);
+	// the inode waits in the dirty set instead of being flushed
+	assert(va_is_dirty(f));
 	cprintf("file_truncate is good\n");
 
 	if ((r = file_set_size(f, strlen(msg))) < 0)
 		panic("file_set_size 2: %e", r);
-	assert(!(uvpt[PGNUM(f)] & PTE_D));
 	if ((r = file_get_block(f, 0, &blk)) < 0)
 		panic("file_get_block 2: %e", r);
 	strcpy(blk, msg);
 	assert((uvpt[PGNUM(blk)] & PTE_D));
+	// the block gets its disk block only when it is written back
+	assert(file_map_block(f, 0, &blockno) == 0 && blockno == 0);
 	file_flush(f);
-	assert(!(uvpt[PGNUM(blk)] & PTE_D));
-	assert(!(uvpt[PGNUM(f)] & PTE_D));
+	assert(file_map_block(f, 0, &blockno) == 0 && blockno != 0);
+	assert(!va_is_dirty(f));
+	if ((r = file_get_block(f, 0, &blk)) < 0)
+		panic("file_get_block 3: %e", r);
+	assert(blk == diskaddr(blockno));
+	assert(strcmp(blk, msg) == 0 && !va_is_dirty(blk));
 	cprintf("file rewrite is good\n");
 }
+
+// Repeated writes to a block are written back once by fs_sync.
+static void
+test_sync(void)
+{
+	struct File *f;
+	int r;
+	char *blk;
+
+	if ((r = file_open("/newmotd", &f)) < 0)
+		panic("file_open /newmotd: %e", r);
+	if ((r = file_get_block(f, 0, &blk)) < 0)
+		panic("file_get_block: %e", r);
+
+	*(volatile char *)blk = 'T';
+	*(volatile char *)blk = msg[0];
+	assert(va_is_dirty(blk));
+	fs_sync();
+	assert(!va_is_dirty(blk) && !va_is_dirty(f));
+	cprintf("fs_sync is good\n");
+}
+
+// More extents than the File holds move into a tree block.
+static void
+test_extents(void)
+{
+	struct File *f;
+	int r;
+	uint32_t blockno, i, nfree;
+
+	if ((r = file_create("/extents", &f, 0)) < 0)
+		panic("file_create /extents: %e", r);
+	nfree = super->s_nfree;
+	for (i = 0; i < 2 * NEXTENT; i++) {
+		if ((r = file_allocate(f, 2 * i * BLKSIZE, BLKSIZE)) < 0)
+			panic("file_allocate: %e", r);
+	}
+	assert(f->f_depth == 1 && f->f_nextent == 1);
+	for (i = 0; i < 4 * NEXTENT; i++) {
+		assert(file_map_block(f, i, &blockno) == 0);
+		assert((blockno != 0) == (i % 2 == 0));
+	}
+	file_remove(&super->s_root, f);
+	fs_sync();
+	assert(super->s_nfree == nfree);
+	cprintf("extent tree is good\n");
+}
+
+// A directory of a few blocks gets a name index.
+static void
+test_htree(void)
+{
+	struct File *f, *d;
+	int r;
+	char path[MAXPATHLEN];
+	uint32_t i;
+	off_t size;
+
+	if ((r = file_create("/htree", &d, 1)) < 0)
+		panic("file_create /htree: %e", r);
+	for (i = 0; i < 4 * BLKFILES; i++) {
+		snprintf(path, sizeof(path), "/htree/f%d", i);
+		if ((r = file_create(path, &f, 0)) < 0)
+			panic("file_create %s: %e", path, r);
+	}
+	assert(d->f_flags & FILE_HTREE);
+	size = d->f_size;
+	for (i = 0; i < 4 * BLKFILES; i += 2) {
+		snprintf(path, sizeof(path), "/htree/f%d", i);
+		if ((r = file_open(path, &f)) < 0)
+			panic("file_open %s: %e", path, r);
+		assert(strcmp(f->f_name, path + 7) == 0);
+		file_remove(d, f);
+		assert(file_open(path, &f) == -E_NOT_FOUND);
+	}
+	for (i = 0; i < 4 * BLKFILES; i += 2) {
+		snprintf(path, sizeof(path), "/htree/g%d", i);
+		if ((r = file_create(path, &f, 0)) < 0)
+			panic("file_create %s: %e", path, r);
+	}
+	assert(d->f_flags & FILE_HTREE);
+	assert(d->f_size == size);
+	for (i = 0; i < 4 * BLKFILES; i++) {
+		snprintf(path, sizeof(path), "/htree/%c%d", i % 2 ? 'f' : 'g', i);
+		if ((r = file_open(path, &f)) < 0)
+			panic("file_open %s: %e", path, r);
+		file_remove(d, f);
+	}
+	file_remove(&super->s_root, d);
+	cprintf("htree is good\n");
+}
+
+// Cached misses and files follow creates and removes.
+static void
+test_dcache(void)
+{
+	struct File *f, *d;
+	int r;
+
+	assert(file_open("/dcache", &f) == -E_NOT_FOUND);
+	assert(file_open("/dcache", &f) == -E_NOT_FOUND);
+	if ((r = file_create("/dcache", &d, 0)) < 0)
+		panic("file_create /dcache: %e", r);
+	assert(file_open("/dcache", &f) == 0 && f == d);
+	assert(file_open("/dcache", &f) == 0 && f == d);
+	file_remove(&super->s_root, d);
+	assert(file_open("/dcache", &f) == -E_NOT_FOUND);
+	cprintf("dcache is good\n");
+}
+
+// Sequential reads bring the following blocks in ahead of time.
+static void
+test_readahead(void)
+{
+	struct File *f;
+	int r;
+	uint32_t blockno, i;
+	struct Readahead ra;
+
+	if ((r = file_create("/readahead", &f, 0)) < 0)
+		panic("file_create /readahead: %e", r);
+	if ((r = file_allocate(f, 0, 4 * RA_MAX * BLKSIZE)) < 0)
+		panic("file_allocate: %e", r);
+	fs_sync();
+	for (i = 0; i < 4 * RA_MAX; i++) {
+		assert(file_map_block(f, i, &blockno) == 0 && blockno);
+		evict_block(diskaddr(blockno));
+	}
+	memset(&ra, 0, sizeof(ra));
+	for (i = 0; i < 2 * RA_MAX; i++) {
+		file_readahead(f, &ra, BLKSIZE, i * BLKSIZE);
+		assert(ra.ra_end > i + 1);
+		assert(file_map_block(f, i + 1, &blockno) == 0);
+		assert(va_is_mapped(diskaddr(blockno)));
+	}
+	assert(ra.ra_size == RA_MAX);
+	file_readahead(f, &ra, BLKSIZE, 0);
+	assert(ra.ra_size == 0);
+	file_remove(&super->s_root, f);
+	cprintf("readahead is good\n");
+}
+
+// A commit stays in the journal until a checkpoint, and replaying the
+// journal writes it to the home blocks.
+static void
+test_journal(void)
+{
+	struct File *f;
+	int r;
+	char *name;
+	uint32_t blockno;
+
+	if (!super->s_njournal)
+		return;
+
+	journal_install();
+	if ((r = file_create("/journal", &f, 0)) < 0)
+		panic("file_create /journal: %e", r);
+	blockno = ((uint32_t)f - DISKMAP) / BLKSIZE;
+	name = (char *)scratch + PGOFF(f);
+	fs_sync();
+	fs_sync();
+	assert(journal_pending(blockno));
+	if ((r = ide_read(blockno * BLKSECTS, scratch, BLKSECTS)) < 0)
+		panic("ide_read: %e", r);
+	assert(strcmp(name, "journal") != 0);
+	journal_init();
+	assert(!journal_pending(blockno));
+	if ((r = ide_read(blockno * BLKSECTS, scratch, BLKSECTS)) < 0)
+		panic("ide_read: %e", r);
+	assert(strcmp(name, "journal") == 0);
+	if ((r = file_open("/journal", &f)) < 0)
+		panic("file_open /journal: %e", r);
+	file_remove(&super->s_root, f);
+	fs_sync();
+	cprintf("journal replay is good\n");
+}
+
+void
+fs_test(void)
+{
+	int r;
+
+	if ((r = sys_page_alloc(0, scratch, PTE_P|PTE_U|PTE_W)) < 0)
+		panic("sys_page_alloc: %e", r);
+
+	test_alloc_block();
+	test_file();
+	test_sync();
+	test_extents();
+	test_htree();
+	test_dcache();
+	test_readahead();
+	test_journal();
+
+	sys_page_unmap(0, scratch);
+}
@@ -0,0 +1,11 @@
+// Console line discipline modes, set with sys_cons_mode().
+
+#ifndef INC_CONS_H
+#define INC_CONS_H
+
+// Raw input (0) hands out characters as they are typed.
+#define CONS_CANON	0x1	// hand out whole lines, edited with ^H ^U
+#define CONS_ECHO	0x2	// echo input as it is typed
+#define CONS_MODES	(CONS_CANON | CONS_ECHO)
+
+#endif	// !INC_CONS_H
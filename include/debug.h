@@ -1,12 +1,16 @@
 #ifndef INC_DEBUG_H
 #define INC_DEBUG_H
 
+#include <env.h>
+
 enum {
 	CPU_INFO,
 	MEM_INFO,
 	FS_INFO,
 	ENV_INFO,
 	VMA_INFO,
+	ENV_STAT,
+	LOCK_INFO,
 	MAXDEBUGOPT,
 };
 
@@ -16,6 +20,15 @@ static const char * const debug_option[MAXDEBUGOPT] = {
 	[FS_INFO]	= "fs",
 	[ENV_INFO]	= "env",
 	[VMA_INFO]	= "vma",
+	[ENV_STAT]	= "stat",
+	[LOCK_INFO]	= "lock",
+};
+
+// ENV_STAT reads an array of these, one per live environment
+struct DebugEnvStat {
+	envid_t ds_env;
+	uint32_t ds_runs;
+	struct EnvStat ds_stat;
 };
 
 #endif
@@ -9,6 +9,8 @@
 
 #include <vm.h>
 #include <fs.h>
+#include <perf.h>
+#include <compiler_attributes.h>
 
 typedef int32_t envid_t;
 
@@ -41,6 +43,22 @@ enum {
 	ENV_NOT_RUNNABLE
 };
 
+// Scheduling priority classes.  sched_yield() runs the runnable env with
+// the least weighted run time (env_vruns), which grows more slowly the
+// higher the class: higher classes get a larger share of the CPU without
+// starving the lower ones, which matters because much of the system
+// spins on sys_yield.
+enum {
+	ENV_PRIO_LOW = 0,
+	ENV_PRIO_NORMAL,	// default for user environments
+	ENV_PRIO_HIGH,
+	ENV_PRIO_SERVER,	// default for the fs and ns servers
+	NENVPRIO
+};
+
+// CPU affinity mask covering every CPU (env_affinity has a bit per CPU)
+#define ENV_AFFINITY_ALL	0xff
+
 // Special environment types
 enum EnvType {
 	ENV_TYPE_USER = 0,
@@ -48,6 +66,8 @@ enum EnvType {
 	ENV_TYPE_NS,		// Network server
 };
 
+// Kept to two cache lines: the trapframe, then everything sched_yield()
+// and IPC look at.  Bulky, rarely used state lives in struct EnvInfo.
 struct Env {
 	struct Trapframe env_tf;	// Saved registers
 	struct Env *env_link;		// Next free Env
@@ -56,22 +76,49 @@ struct Env {
 	enum EnvType env_type;		// Indicates special system environments
 	unsigned int env_status;		// Status of the environment
 	uint32_t env_runs;		// Number of times environment has run
-	int env_cpunum;			// The CPU that the env is running on
+	uint32_t env_vruns;		// Run count weighted by priority class
+	uint8_t env_cpunum;		// The CPU that the env is running on
+	uint8_t env_prio;		// Priority class, possibly inherited
+	uint8_t env_base_prio;		// Priority class set for the env
+	uint8_t env_affinity;		// Mask of CPUs (by id) it may run on
+	uint8_t env_base_affinity;	// Mask to restore when its CPU is released
+	envid_t env_boost_from;		// Client env_prio is inherited from
 
 	// Address space
 	pde_t *env_pgdir;		// Kernel virtual address of page dir
-	// VMA
-	int vma_valid;
-	struct vm_area_struct vma[VMA_PER_ENV];
 
 	// Exception handling
 	void *env_pgfault_upcall;	// Page fault upcall entry point
 
+	// IPC
 	bool env_ipc_recving;		// Env is blocked receiving
 	void *env_ipc_dstva;		// VA at which to map received page
 	int env_ipc_value;		// Data value send to us
 	envid_t env_ipc_from;		// envid of the sender
 	int env_ipc_perm;		// Perm of page mapping received
+} __aligned(CACHELINE);
+
+// CPU time, in TSC cycles, and event counts of an environment
+struct EnvStat {
+	uint64_t es_user;		// Running in user mode
+	uint64_t es_kern;		// In the kernel on the env's behalf
+	uint64_t es_wait;		// Runnable, waiting for a CPU
+	uint64_t es_ready;		// TSC when it last became runnable
+	uint32_t es_ipc_sent;		// IPC messages sent
+	uint32_t es_ipc_recv;		// IPC messages received
+	uint32_t es_pgfaults;		// Page faults taken
+};
+
+// Per-environment metadata off the scheduling path, in an array parallel
+// to envs[] (mapped read-only by the user at UENVINFO).
+struct EnvInfo {
+	// VMA
+	int vma_valid;
+	struct vm_area_struct vma[VMA_PER_ENV];
+
+	// Accounting
+	struct EnvStat env_stat;
+	struct EnvPerf env_perf;
 
 	// Signal
 
@@ -25,6 +25,7 @@ enum {
 	E_NOT_SUPP,		// Operation not supported
 	E_BUSY,			// Device busy
 	E_BAD_REQ,		// Bad HTTP request
+	E_IO,			// Device I/O error
 
 	MAXERROR,		// the maximum allowed
 };
@@ -27,23 +27,67 @@
 // Number of direct block pointers in an indirect block
 #define NINDIRECT	(BLKSIZE / 4)
 
-#define MAXFILESIZE	((NDIRECT + NINDIRECT) * BLKSIZE)
+// Largest file mapped by block pointers
+#define MAXFILESIZE_PTR	((NDIRECT + NINDIRECT) * BLKSIZE)
+// Largest file mapped by extents; f_size is an off_t
+#define MAXFILESIZE	(0x80000000 - BLKSIZE)
+
+// A run of e_len blocks of a file starting at file block e_fileblk,
+// stored from disk block e_start on.  In the index levels of the tree
+// e_start is the child node holding the extents from e_fileblk on, and
+// e_len is unused.
+struct Extent {
+	uint32_t e_fileblk;
+	uint32_t e_start;
+	uint32_t e_len;
+};
+
+// Number of extents held in a File descriptor
+#define NEXTENT		9
 
 struct File {
 	char f_name[MAXNAMELEN];	// filename
 	off_t f_size;			// file size in bytes
 	uint32_t f_type;		// file type
 
-	// Block pointers.
-	// A block is allocated iff its value is != 0.
-	uint32_t f_direct[NDIRECT];	// direct blocks
-	uint32_t f_indirect;		// indirect block
+	union {
+		// Block pointers, unless FILE_EXTENTS is set.
+		// A block is allocated iff its value is != 0.
+		struct {
+			uint32_t f_direct[NDIRECT];	// direct blocks
+			uint32_t f_indirect;		// indirect block
+		};
+		// Root of the extent tree, if FILE_EXTENTS is set
+		struct {
+			uint16_t f_nextent;	// entries in f_extent[]
+			uint16_t f_depth;	// tree levels below the root
+			struct Extent f_extent[NEXTENT];
+		};
+	};
+	uint32_t f_flags;		// FILE_* flags
+	uint32_t f_index;		// index root block, if FILE_HTREE is set
 
 	// Pad out to 256 bytes; must do arithmetic in case we're compiling
 	// fsformat on a 64-bit machine.
-	uint8_t f_pad[256 - MAXNAMELEN - 8 - 4*NDIRECT - 4];
+	uint8_t f_pad[256 - MAXNAMELEN - 8 - (4 + 12*NEXTENT) - 8];
 } __packed;	// required only on some 64-bit machines
 
+// File flags
+#define FILE_EXTENTS	0x1	// blocks are mapped by extents
+#define FILE_HTREE	0x2	// directory has a hashed name index
+
+// A node of the extent tree below the File descriptor, one block.
+// Entries are sorted by e_fileblk; leaves have depth 0.
+#define EXTENT_MAGIC	0x54585445	// 'ETXT'
+#define NEXTENT_BLOCK	((BLKSIZE - 8) / sizeof(struct Extent))
+
+struct ExtentNode {
+	uint32_t en_magic;		// Magic number: EXTENT_MAGIC
+	uint16_t en_nentries;		// entries in en_extent[]
+	uint16_t en_depth;		// tree levels below this node
+	struct Extent en_extent[NEXTENT_BLOCK];
+};
+
 // An inode block contains exactly BLKFILES 'struct File's
 #define BLKFILES	(BLKSIZE / sizeof(struct File))
 
@@ -60,6 +104,33 @@ struct Super {
 	uint32_t s_magic;		// Magic number: FS_MAGIC
 	uint32_t s_nblocks;		// Total number of blocks on disk
 	struct File s_root;		// Root directory node
+	uint32_t s_journal;		// First block of the metadata journal
+	uint32_t s_njournal;		// Blocks in the journal, 0 if none
+	uint32_t s_nfree;		// Free blocks in the bitmap
+};
+
+// Metadata journal (on-disk).  Bitmap, inode and directory blocks are
+// logged before they are written in place.  The first journal block
+// says where replay starts, the others are a ring of transactions, each
+// a header followed by copies of the blocks it lists.  A transaction is
+// committed once its header and copies are on disk with a matching
+// checksum, and installed by a later checkpoint.
+
+#define JOURNAL_MAGIC	0x4c4e524a	// 'JRNL'
+#define JOURNAL_NBLOCKS	256		// journal size made by fsformat
+
+struct JournalStart {
+	uint32_t js_magic;		// Magic number: JOURNAL_MAGIC
+	uint32_t js_seq;		// First transaction not installed
+	uint32_t js_pos;		// Where it starts unless it wrapped
+};
+
+struct JournalHeader {
+	uint32_t jh_magic;		// Magic number: JOURNAL_MAGIC
+	uint32_t jh_seq;		// Transaction sequence number
+	uint32_t jh_nblocks;		// Blocks logged
+	uint32_t jh_sum;		// Checksum of the block list and copies
+	uint32_t jh_blockno[];		// Home block of each copy
 };
 
 // Definitions for requests from clients to file system
@@ -77,6 +148,19 @@ enum {
 
 	FSREQ_INFO,
 	FSREQ_RENAME,
+
+	// Ring setup passes the control page, then each buffer page;
+	// enter passes the control page and gets no reply, wait passes it
+	// and gets one once a completion is ready (see ring.h)
+	FSREQ_RING_SETUP,
+	FSREQ_RING_BUF,
+	FSREQ_RING_ENTER,
+	FSREQ_RING_WAIT,
+
+	// Sent by the server's write-back timer, without an argument page
+	FSREQ_WRITEBACK,
+
+	FSREQ_FALLOCATE,
 };
 
 union Fsipc {
@@ -117,11 +201,42 @@ union Fsipc {
 	struct Fsreq_info {
 		uint32_t blk_num;
 		uint32_t blk_ocp;
+		uint32_t ide_dma;	// disk commands done by DMA
+		uint32_t ide_pio;	// disk commands done by PIO
+		uint32_t bc_blocks;	// blocks in the block cache
+		uint32_t bc_limit;	// most blocks the cache holds
+		uint32_t bc_hit;
+		uint32_t bc_miss;
+		uint32_t bc_evict;
+		uint32_t bc_writeback;	// dirty blocks written on eviction
+		uint32_t bc_dirty;	// blocks waiting for write-back
+		uint32_t bc_sync;	// write-backs of the dirty blocks
+		uint32_t ra_read;	// read-ahead commands
+		uint32_t ra_blocks;	// blocks read ahead
+		uint32_t ra_hit;	// of them used
+		uint32_t ra_waste;	// of them evicted unused
+		uint32_t j_commit;	// journal transactions
+		uint32_t j_logged;	// blocks logged in them
+		uint32_t j_install;	// checkpoints
+		uint32_t da_pending;	// blocks waiting for a disk block
+		uint32_t da_resolved;	// delayed blocks given one
+		uint32_t da_contig;	// of them next to the previous block
+		uint32_t da_falloc;	// blocks allocated by fallocate
+		uint32_t ex_hit;	// extent lookups served by the cache
+		uint32_t ex_miss;	// extent lookups walking the tree
+		uint32_t dc_hit;	// name lookups finding a cached file
+		uint32_t dc_neg;	// name lookups finding a cached miss
+		uint32_t dc_miss;	// name lookups reading the directory
 	} info;
 	struct Fsreq_rename {
 		char src_path[MAXPATHLEN];
 		char dst_path[MAXPATHLEN];
 	} rename;
+	struct Fsreq_fallocate {
+		int req_fileid;
+		off_t req_offset;
+		off_t req_len;
+	} fallocate;
 
 	// Ensure Fsipc is one page
 	char _pad[PGSIZE];
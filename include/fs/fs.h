@@ -12,40 +12,118 @@
 /* Maximum disk size we can handle (3GB) */
 #define DISKSIZE	0xC0000000
 
+/* File blocks written before they get a disk block are mapped at
+ * DELAYMAP, DELAY_NBLOCKS of them at most.
+ */
+#define DELAYMAP	0xD1000000
+#define DELAY_NBLOCKS	1024
+
 struct Super *super;		// superblock
 uint32_t *bitmap;		// bitmap blocks mapped in memory
 
+/* Blocks read ahead of a sequential reader: at least RA_MIN, at most
+ * one IDE command.
+ */
+#define RA_MIN		4
+#define RA_MAX		(256 / BLKSECTS)
+
+/* Read-ahead state of an open file */
+struct Readahead {
+	uint32_t ra_next;	// block after the last one read
+	uint32_t ra_start;	// first block of the window
+	uint32_t ra_end;	// block after the window
+	uint32_t ra_size;	// blocks in the window, 0 if not sequential
+};
+
 /* ide.c */
 bool ide_probe_disk1(void);
 void ide_set_disk(int diskno);
 void ide_set_partition(uint32_t first_sect, uint32_t nsect);
 int ide_read(uint32_t secno, void *dst, size_t nsecs);
 int ide_write(uint32_t secno, const void *src, size_t nsecs);
+void ide_info(struct Fsreq_info *info);
 
 /* bc.c */
 void *diskaddr(uint32_t blockno);
 bool va_is_mapped(void *va);
 bool va_is_dirty(void *va);
 void flush_block(void *addr);
+void clean_block(void *addr);
+void evict_block(void *addr);
+void release_block(void *addr);
+void discard_block(void *addr);
+void *bc_alloc_block(uint32_t blockno);
+void bc_insert_block(uint32_t blockno, void *va);
+void *bc_lookup(uint32_t blockno);
+void bc_readahead(uint32_t blockno, uint32_t nblocks);
+void bc_set_meta(uint32_t blockno, bool meta);
+bool bc_is_meta(uint32_t blockno);
+void bc_sync(void);
+bool bc_meta_room(uint32_t n);
+bool bc_commit_due(void);
+void bc_info(struct Fsreq_info *info);
 void bc_init(void);
 
+/* journal.c */
+void journal_init(void);
+uint32_t journal_capacity(void);
+void journal_commit(const uint32_t *blocks, uint32_t nblocks);
+void journal_install(void);
+bool journal_pending(uint32_t blockno);
+bool journal_read(uint32_t blockno, void *va);
+bool journal_free(uint32_t blockno);
+void journal_release(void);
+void journal_info(struct Fsreq_info *info);
+
+/* extent.c */
+int extent_lookup(struct File *f, uint32_t filebno, uint32_t *blockno);
+uint32_t extent_goal(struct File *f, uint32_t filebno);
+int extent_insert(struct File *f, uint32_t filebno, uint32_t blockno);
+void extent_truncate(struct File *f, uint32_t nblocks);
+void extent_release(struct File *f);
+void extent_forget(struct File *f);
+void extent_info(struct Fsreq_info *info);
+
+/* htree.c */
+int htree_lookup(struct File *dir, const char *name, struct File **file);
+int htree_alloc(struct File *dir, struct File **file, uint32_t *loc);
+void htree_add(struct File *dir, uint32_t loc);
+void htree_remove(struct File *dir, struct File *f);
+
+/* dcache.c */
+bool dcache_lookup(struct File *dir, const char *name, struct File **file);
+void dcache_enter(struct File *dir, const char *name, struct File *file);
+void dcache_invalidate(struct File *dir, const char *name);
+void dcache_forget(struct File *f);
+void dcache_info(struct Fsreq_info *info);
+
 /* fs.c */
 void fs_init(void);
+int file_map_block(struct File *f, uint32_t filebno, uint32_t *blockno);
 int file_get_block(struct File *f, uint32_t file_blockno, char **pblk);
 int file_create(const char *path, struct File **f, bool is_dir);
 int file_open(const char *path, struct File **f);
+int file_open_parent(const char *path, struct File **dir, struct File **f);
 ssize_t file_read(struct File *f, void *buf, size_t count, off_t offset);
+void file_readahead(struct File *f, struct Readahead *ra, size_t count, off_t offset);
 int file_write(struct File *f, const void *buf, size_t count, off_t offset);
 int file_set_size(struct File *f, off_t newsize);
 void file_flush(struct File *f);
 void file_close(struct File *f);
-int file_remove(struct File *f);
+int file_remove(struct File *dir, struct File *f);
 void fs_sync(void);
-int file_rename(struct File *dir, struct File *src_file);
-int file_dir_each_file(struct File *dir, int (*handler)(struct File *f));
+void fs_sync_point(void);
+int file_rename(struct File *dir, struct File *src_dir, struct File *src_file);
+int file_dir_each_file(struct File *dir,
+		       int (*handler)(struct File *dir, struct File *f));
+int file_allocate(struct File *f, off_t offset, off_t len);
+void delalloc_resolve(void);
+void alloc_info(struct Fsreq_info *info);
 
 /* int	map_block(uint32_t); */
 bool block_is_free(uint32_t blockno);
+void block_set_free(uint32_t blockno);
+void free_block(uint32_t blockno);
 int alloc_block(void);
 
 /* test.c */
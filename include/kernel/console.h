@@ -15,8 +15,20 @@
 #define CRT_COLS	80
 #define CRT_SIZE	(CRT_ROWS * CRT_COLS)
 
+#include <types.h>
+
+struct Env;
+
 void cons_init(void);
 int cons_getc(void);
+int cons_read(char *buf, size_t n);
+int cons_wait(struct Env *e);
+bool cons_waiting(void);
+int cons_set_mode(int mode);
+void cons_putc(int c);
+void cons_flush(void);
+void cons_start_async(void);
+void cons_panic_flush(void);
 
 void kbd_intr(void); // irq 1
 void serial_intr(void); // irq 4
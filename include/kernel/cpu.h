@@ -7,6 +7,7 @@
 #include <types.h>
 #include <mmu.h>
 #include <memlayout.h>
+#include <env.h>
 
 // Maximum number of CPUs
 #define NCPU  8
@@ -20,9 +21,13 @@ enum {
 
 // Per-CPU state
 struct CpuInfo {
+	struct CpuInfo *cpu_self;		// This entry; read through %gs
 	uint8_t cpu_id;				// Local APIC ID; index into cpus[] below
 	volatile unsigned int cpu_status;	// The status of the CPU
 	struct Env *cpu_env;			// The currently-running environment.
+	envid_t cpu_fpu_env;			// Env whose state the FPU holds
+	envid_t cpu_dedicated;			// Env that owns this CPU, or 0
+	uint64_t cpu_tsc;			// TSC at the last user/kernel switch
 	struct Taskstate cpu_ts;		// Used by x86 to find stack for interrupt
 };
 
@@ -36,7 +41,34 @@ extern physaddr_t lapicaddr;        // Physical MMIO address of the local APIC
 extern unsigned char percpu_kstacks[NCPU][KSTKSIZE];
 
 int cpunum(void);
-#define thiscpu (&cpus[cpunum()])
+
+// Each CPU's %gs selects a data segment based at its own CpuInfo (see
+// env_init_percpu), so finding it is a single load with no LAPIC read.
+// A CPU never changes under running kernel code, so the result may be
+// cached freely.
+static inline struct CpuInfo *
+this_cpu(void)
+{
+	struct CpuInfo *c;
+
+	asm("movl %%gs:%c1, %0"
+	    : "=r" (c) : "i" (offsetof(struct CpuInfo, cpu_self)));
+	return c;
+}
+
+#define thiscpu (this_cpu())
+
+// Current environment of this CPU; the "m" operand orders the load after
+// any store to cpus[].
+static inline struct Env *
+this_env(void)
+{
+	struct Env *e;
+
+	asm("movl %%gs:%c1, %0"
+	    : "=r" (e) : "i" (offsetof(struct CpuInfo, cpu_env)), "m" (cpus));
+	return e;
+}
 
 void mp_init(void);
 void lapic_init(void);
@@ -9,9 +9,10 @@
 #include <env.h>
 #include <kernel/cpu.h>
 
-#define curenv (thiscpu->cpu_env)
+#define curenv (this_env())
 
 extern struct Env *envs;		// All environments
+extern struct EnvInfo *envinfos;	// Their metadata, indexed like envs
 extern struct Segdesc gdt[];
 
 void env_init(void);
@@ -26,6 +27,22 @@ int envid2env(envid_t envid, struct Env **env_store, bool checkperm);
 void __noreturn env_run(struct Env *e);
 void __noreturn env_pop_tf(struct Trapframe *tf);
 
+static inline struct EnvInfo *
+env_info(struct Env *e)
+{
+	return &envinfos[ENVX(e->env_id)];
+}
+
+static inline struct EnvStat *
+env_stat(struct Env *e)
+{
+	return &env_info(e)->env_stat;
+}
+
+void env_ready(struct Env *e);
+void env_account_trap(void);
+void env_account_halt(void);
+
 int env_add_vma(struct Env *e, unsigned long start, uint32_t size, uint32_t perm);
 
 // Without this extra macro, we couldn't pass macros like TEST to
@@ -0,0 +1,27 @@
+#ifndef KERN_FPU_H
+#define KERN_FPU_H
+#ifndef TOYNIX_KERNEL
+# error "This is a Toynix kernel header; user programs should not #include it"
+#endif
+
+#include <types.h>
+#include <env.h>
+#include <trap.h>
+#include <compiler_attributes.h>
+
+// x87/MMX/SSE register image of an environment, in FXSAVE layout
+struct FpuState {
+	uint8_t fpu_fxsave[512];	// must be 16-byte aligned
+	int fpu_cpu;			// CPU whose registers last held it
+} __aligned(16);
+
+// Indexed by ENVX(env_id), allocated in mem_init
+extern struct FpuState *env_fpus;
+
+void fpu_init_percpu(void);
+void fpu_env_init(struct Env *e);
+void fpu_env_copy(struct Env *dst, struct Env *src);
+void fpu_switch_out(struct Env *e);
+void fpu_trap(struct Trapframe *tf);
+
+#endif	// !KERN_FPU_H
@@ -0,0 +1,15 @@
+#ifndef KERN_IDE_H
+#define KERN_IDE_H
+#ifndef TOYNIX_KERNEL
+# error "This is a Toynix kernel header; user programs should not #include it"
+#endif
+
+#include <kernel/pci.h>
+#include <kernel/env.h>
+
+int pci_ide_attach(struct pci_func *pcif);
+int ide_dma(struct Env *e, int cmd, const void *va, size_t len);
+void ide_intr(int irq);
+bool ide_waiting(void);
+
+#endif /* KERN_IDE_H */
@@ -21,6 +21,9 @@ struct Eipdebuginfo {
 	int eip_fn_arglen[MAXARGS];			// Length of arguments name
 };
 
+struct Env;
+
 int debuginfo_eip(uintptr_t eip, struct Eipdebuginfo *info);
+int debuginfo_env_eip(struct Env *e, uintptr_t eip, struct Eipdebuginfo *info);
 
 #endif
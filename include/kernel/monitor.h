@@ -22,5 +22,6 @@ int mon_setaddrmode(int argc, char **argv, struct Trapframe *tf);
 int mon_dump(int argc, char **argv, struct Trapframe *tf);
 int mon_continue(int argc, char **argv, struct Trapframe *tf);
 int mon_si(int argc, char **argv, struct Trapframe *tf);
+int mon_prof(int argc, char **argv, struct Trapframe *tf);
 
 #endif	// !KERN_MONITOR_H
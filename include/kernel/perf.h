@@ -0,0 +1,19 @@
+#ifndef KERN_PERF_H
+#define KERN_PERF_H
+#ifndef TOYNIX_KERNEL
+# error "This is a Toynix kernel header; user programs should not #include it"
+#endif
+
+#include <perf.h>
+#include <env.h>
+
+void perf_init(void);
+void perf_init_percpu(void);
+void perf_env_init(struct Env *e);
+void perf_env_fork(struct Env *child, struct Env *parent);
+void perf_env_free(struct Env *e);
+int perf_config(struct Env *e, const struct PerfConfig *pc);
+void perf_switch_in(struct Env *e);
+void perf_switch_out(struct Env *e);
+
+#endif	// !KERN_PERF_H
@@ -0,0 +1,19 @@
+#ifndef KERN_PROF_H
+#define KERN_PROF_H
+#ifndef TOYNIX_KERNEL
+# error "This is a Toynix kernel header; user programs should not #include it"
+#endif
+
+#include <prof.h>
+
+struct Trapframe;
+
+extern uint32_t prof_period;
+
+int prof_start(uint32_t period);
+void prof_stop(void);
+void prof_tick(struct Trapframe *tf);
+int prof_drain(struct ProfPage *pp);
+void prof_print(void);
+
+#endif	/* KERN_PROF_H */
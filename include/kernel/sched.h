@@ -4,7 +4,19 @@
 # error "This is a Toynix kernel header; user programs should not #include it"
 #endif
 
+#include <env.h>
+
+// env_vruns advances by this much per run: 8 for ENV_PRIO_LOW down to
+// 1 for ENV_PRIO_SERVER.
+#define ENV_PRIO_STRIDE(prio)	(1 << (ENV_PRIO_SERVER - (prio)))
+
 // This function does not return.
 void __noreturn sched_yield(void);
 
+void sched_set_priority(struct Env *e, int prio);
+int sched_dedicate_cpu(struct Env *e, int cpu);
+uint32_t sched_held_cpus(struct Env *e);
+void sched_ipc_boost(struct Env *server, struct Env *client);
+void sched_ipc_unboost(struct Env *server, struct Env *dst);
+
 #endif	// !KERN_SCHED_H
@@ -7,13 +7,30 @@
 #define DEBUG_SPINLOCK
 #define DEBUG_PCS	10
 
-// Mutual exclusion lock.
+// Comment this to disable per-lock contention and hold-time statistics
+#define SPINLOCK_STATS
+
+// Locks spin_initlock() registers for sys_debug_info, kernel_lock included
+#define NSPINLOCK	16
+
+// Mutual exclusion lock: a ticket lock, so CPUs get it in the order
+// they asked for it.
 struct spinlock {
-	unsigned int locked;		// Is the lock held?
+	volatile uint32_t next;		// Next ticket to hand out
+	volatile uint32_t owner;	// Ticket of the holder
+	const char *name;		// Name of lock.
+
+#ifdef SPINLOCK_STATS
+	// Only the holder updates these
+	uint64_t acquired;		// Acquisitions
+	uint64_t contended;		// Acquisitions that had to wait
+	uint64_t spin_cycles;		// TSC cycles spent waiting
+	uint64_t max_hold;		// Longest hold, in TSC cycles
+	uint64_t hold_start;		// TSC when the holder got it
+#endif
 
 #ifdef DEBUG_SPINLOCK
 	// For debugging:
-	char *name;			// Name of lock.
 	struct CpuInfo *cpu;		// The CPU holding the lock.
 	uintptr_t pcs[DEBUG_PCS];	// The call stack (an array of program counters) that locked the lock.
 #endif
@@ -22,6 +39,7 @@ struct spinlock {
 void __spin_initlock(struct spinlock *lk, char *name);
 void spin_lock(struct spinlock *lk);
 void spin_unlock(struct spinlock *lk);
+int spin_debug_info(char *buf, size_t size);
 
 #define spin_initlock(lock)		__spin_initlock(lock, #lock)
 
@@ -33,16 +51,12 @@ lock_kernel(void)
 	spin_lock(&kernel_lock);
 }
 
+// Waiters are served in ticket order, so the releasing CPU can't take
+// the lock straight back ahead of them.
 static inline void
 unlock_kernel(void)
 {
 	spin_unlock(&kernel_lock);
-
-	// Normally we wouldn't need to do this, but QEMU only runs
-	// one CPU at a time and has a long time-slice.  Without the
-	// pause, this CPU is likely to reacquire the lock before
-	// another CPU has even been given a chance to acquire it.
-	asm volatile("pause");
 }
 
 #endif /* KERN_INC_SPINLOCK_H */
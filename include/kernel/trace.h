@@ -0,0 +1,22 @@
+#ifndef KERN_TRACE_H
+#define KERN_TRACE_H
+#ifndef TOYNIX_KERNEL
+# error "This is a Toynix kernel header; user programs should not #include it"
+#endif
+
+#include <trace.h>
+
+extern uint32_t trace_mask;
+
+void trace_log(int event, uint32_t a0, uint32_t a1, uint32_t a2, uint32_t a3);
+int trace_drain(struct TracePage *tp);
+
+// A tracepoint costs one load and test while its event is disabled
+#define trace(event, a0, a1, a2, a3)					\
+	do {								\
+		if (trace_mask & (1 << (event)))			\
+			trace_log(event, (uint32_t)(a0), (uint32_t)(a1),	\
+				  (uint32_t)(a2), (uint32_t)(a3));	\
+	} while (0)
+
+#endif	/* KERN_TRACE_H */
@@ -19,6 +19,10 @@
 #include <fd.h>
 #include <ns.h>
 #include <debug.h>
+#include <ring.h>
+#include <trace.h>
+#include <prof.h>
+#include <cons.h>
 
 #define USED(x)		((void)(x))
 
@@ -27,9 +31,11 @@ void umain(int argc, char **argv);
 
 // libmain.c or entry.S
 extern volatile struct Env envs[NENV];
+extern const volatile struct EnvInfo envinfos[NENV];
 extern const volatile struct PageInfo pages[];
 /* extern const volatile struct Env *thisenv; */
 #define thisenv (&envs[ENVX(sys_getenvid())])
+#define thisenvinfo (&envinfos[ENVX(sys_getenvid())])
 
 void libmain(int argc, char **argv);
 
@@ -75,6 +81,15 @@ int sys_chdir(const char *path);
 int sys_add_vma(envid_t envid, uintptr_t va, size_t memsz, int perm);
 int sys_copy_vma(envid_t src_env, envid_t dst_env);
 int sys_env_name(envid_t envid, const char *name);
+int sys_env_set_priority(envid_t envid, int prio);
+int sys_env_set_affinity(envid_t envid, uint32_t cpumask);
+int sys_env_dedicate_cpu(envid_t envid, int cpu);
+int sys_trace(int op, uint32_t arg);
+int sys_prof(int op, uint32_t arg);
+int sys_env_set_perf(envid_t envid, const struct PerfConfig *pc);
+int sys_cons_read(void *buf, size_t n);
+int sys_cons_mode(int mode);
+int sys_ide_dma(int cmd, const void *va, size_t len);
 
 static __always_inline envid_t
 sys_exofork(void)
@@ -110,6 +125,7 @@ int	pageref(void *addr);
 // file.c
 int	open(const char *path, int mode);
 int	ftruncate(int fd, off_t size);
+int	fallocate(int fd, off_t offset, off_t len);
 int	remove(const char *path);
 int	sync(void);
 
@@ -134,6 +150,9 @@ envid_t spawnl(const char *program, const char *arg0, ...);
 // wait.c
 void wait(envid_t env);
 
+// perf.c
+uint64_t perf_read(int counter);
+
 // console.c
 void cputchar(int c);
 int getchar(void);
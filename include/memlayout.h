@@ -17,6 +17,7 @@
 #define GD_UT     0x18     // user text
 #define GD_UD     0x20     // user data
 #define GD_TSS0   0x28     // Task segment selector for CPU 0
+#define GD_CPU0   0x68     // Per-CPU data segment for CPU 0 (after NCPU TSSs)
 
 /*
  * Virtual memory map:                                Permissions
@@ -50,7 +51,9 @@
  *    UVPT      ---->  +------------------------------+ 0xef400000
  *                     |          RO PAGES            | R-/R-  PTSIZE
  *    UPAGES    ---->  +------------------------------+ 0xef000000
- *                     |           RO ENVS            | R-/R-  PTSIZE
+ *                     |         RO ENV INFO          | R-/R-  PTSIZE/2
+ *    UENVINFO  ---->  +------------------------------+ 0xeee00000
+ *                     |           RO ENVS            | R-/R-  PTSIZE/2
  * UTOP,UENVS ------>  +------------------------------+ 0xeec00000
  * UXSTACKTOP -/       |     User Exception Stack     | RW/RW  PGSIZE
  *                     +------------------------------+ 0xeebff000
@@ -114,6 +117,8 @@
 #define UPAGES		(UVPT - PTSIZE)
 // Read-only copies of the global env structures
 #define UENVS		(UPAGES - PTSIZE)
+// Read-only copies of the per-env metadata (struct EnvInfo)
+#define UENVINFO	(UENVS + PTSIZE / 2)
 
 /*
  * Top of user VM. User can manipulate VA from UTOP-1 and down!
@@ -51,6 +51,8 @@
 #define PTSIZE		(PGSIZE*NPTENTRIES) // bytes mapped by a page directory entry
 #define PTSHIFT		22		// log2(PTSIZE)
 
+#define CACHELINE	64		// bytes in a cache line
+
 #define PTXSHIFT	12		// offset of PTX in a linear address
 #define PDXSHIFT	22		// offset of PDX in a linear address
 
@@ -92,7 +94,10 @@
 #define CR0_CD		0x40000000	// Cache Disable
 #define CR0_PG		0x80000000	// Paging
 
+#define CR4_OSXMMEXCPT	0x00000400	// Unmasked SIMD FP exceptions support
+#define CR4_OSFXSR	0x00000200	// FXSAVE/FXRSTOR and SSE support
 #define CR4_PCE		0x00000100	// Performance counter enable
+#define CR4_PGE		0x00000080	// Page Global Enable
 #define CR4_MCE		0x00000040	// Machine Check Enable
 #define CR4_PSE		0x00000010	// Page Size Extensions
 #define CR4_DE		0x00000008	// Debugging Extensions
@@ -31,6 +31,14 @@ enum {
 	NSREQ_SEND,
 	NSREQ_SOCKET,
 
+	// Ring setup passes the control page, then each buffer page;
+	// enter passes the control page and gets no reply, wait passes it
+	// and gets one once a completion is ready (see ring.h)
+	NSREQ_RING_SETUP,
+	NSREQ_RING_BUF,
+	NSREQ_RING_ENTER,
+	NSREQ_RING_WAIT,
+
 	// The following two messages pass a page containing a struct jif_pkt
 	NSREQ_INPUT,
 	// NSREQ_OUTPUT, unlike all other messages, is sent *from* the
@@ -0,0 +1,48 @@
+// Per-environment performance counters: formats shared by the kernel,
+// user space and user/perfstat.
+//
+// An env configured with sys_env_set_perf() owns the CPU's general
+// purpose counters while it runs; the kernel saves them into its
+// EnvInfo when it leaves the CPU and restarts them from zero when it
+// comes back.  Only user-mode events are counted.
+
+#ifndef INC_PERF_H
+#define INC_PERF_H
+
+#include <types.h>
+
+#define PERF_NCOUNTERS	4	// counters virtualized per env
+
+// Event select and unit mask, as in the IA32_PERFEVTSELx MSRs
+#define PERF_EVENT(event, umask)	(((umask) << 8) | (event))
+
+// Architectural events (CPUID leaf 0xA)
+#define PERF_CYCLES		PERF_EVENT(0x3c, 0x00)	// unhalted core cycles
+#define PERF_INSTRUCTIONS	PERF_EVENT(0xc0, 0x00)	// instructions retired
+#define PERF_LLC_REFS		PERF_EVENT(0x2e, 0x4f)	// last level cache refs
+#define PERF_LLC_MISSES		PERF_EVENT(0x2e, 0x41)	// last level cache misses
+#define PERF_BRANCHES		PERF_EVENT(0xc4, 0x00)	// branches retired
+#define PERF_BRANCH_MISSES	PERF_EVENT(0xc5, 0x00)	// mispredicted branches
+// Model specific: DTLB load misses that walk the page table
+// (Sandy Bridge through Skylake)
+#define PERF_DTLB_MISSES	PERF_EVENT(0x08, 0x01)
+
+// Configuration flags
+#define PERF_INHERIT	0x1	// children get the config, fold counts back
+#define PERF_RDPMC	0x2	// let the env read its counters with rdpmc
+
+struct PerfConfig {
+	uint32_t pc_flags;			// PERF_*
+	uint32_t pc_event[PERF_NCOUNTERS];	// PERF_EVENT(), 0 if unused
+};
+
+// Counter state of an env, in its EnvInfo
+struct EnvPerf {
+	uint32_t ep_flags;			// PERF_*
+	volatile uint32_t ep_seq;		// bumped whenever ep_count moves
+	uint32_t ep_event[PERF_NCOUNTERS];	// PERF_EVENT(), 0 if unused
+	uint64_t ep_count[PERF_NCOUNTERS];	// counts up to the last switch
+	uint64_t ep_child[PERF_NCOUNTERS];	// counts of exited children
+};
+
+#endif	// !INC_PERF_H
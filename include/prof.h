@@ -0,0 +1,39 @@
+// Sampling profiler: record formats shared with user/prof.
+//
+// While profiling is on, every CPU samples the interrupted eip and env
+// on each Nth timer tick and counts the samples in its own table.
+// sys_prof(PROF_DRAIN) resolves the counted eips to functions and moves
+// them into a user page laid out as struct ProfPage.
+
+#ifndef INC_PROF_H
+#define INC_PROF_H
+
+#include <types.h>
+#include <mmu.h>
+
+// sys_prof operations
+enum {
+	PROF_START = 0,		// sample every arg timer ticks
+	PROF_STOP,		// stop sampling, keep what was counted
+	PROF_DRAIN,		// move counted samples to the page at arg
+};
+
+#define PROF_NAMELEN	52
+
+struct ProfEntry {
+	envid_t pe_env;			// sampled env, 0 for the idle kernel
+	uintptr_t pe_fn;		// start of the function sampled
+	uint32_t pe_count;		// samples that hit it
+	char pe_name[PROF_NAMELEN];	// function name, "" if unknown
+};
+
+struct ProfPage {
+	uint32_t pp_count;	// entries in pp_entries
+	uint32_t pp_lost;	// samples lost to full tables since the last drain
+	struct ProfEntry pp_entries[];
+};
+
+#define PROF_PAGE_ENTRIES \
+	((PGSIZE - sizeof(struct ProfPage)) / sizeof(struct ProfEntry))
+
+#endif	// !INC_PROF_H
@@ -0,0 +1,111 @@
+// Shared-memory submission/completion rings between a client
+// environment and the fs or ns server.
+//
+// A ring is one control page holding the submission queue (SQ) and the
+// completion queue (CQ), followed by RING_ENTRIES buffer pages.  Every
+// submission owns one buffer page, laid out exactly like the page the
+// synchronous protocol sends (union Fsipc or union Nsipc), so servers
+// run the same handlers for both paths.  The client publishes any
+// number of entries and notifies the server once per batch with
+// FSREQ_RING_ENTER / NSREQ_RING_ENTER; the server drains the whole SQ
+// and posts results to the CQ without replying over IPC.  A client
+// with nothing left to do sends FSREQ_RING_WAIT / NSREQ_RING_WAIT
+// instead, which also drains the SQ, and blocks until the server
+// replies, once the CQ is not empty.
+
+#ifndef INC_RING_H
+#define INC_RING_H
+
+#include <types.h>
+#include <mmu.h>
+#include <env.h>
+
+// Number of entries in flight per ring; one buffer page per entry
+#define RING_ENTRIES	32
+#define RING_MASK	(RING_ENTRIES - 1)
+// Control page + buffer pages
+#define RING_PAGES	(1 + RING_ENTRIES)
+#define RING_SIZE	(RING_PAGES * PGSIZE)
+
+// Client-side rings, one per server type (indexed by enum EnvType)
+#define RINGTABLE	0xD0800000
+// Server-side rings, one per client environment
+#define NRINGSRV	8
+#define RINGSRVTABLE	0xD0C00000
+
+struct ring_sqe {
+	uint32_t sqe_op;	// FSREQ_* or NSREQ_* request code
+	uint32_t sqe_buf;	// buffer page index
+	uint32_t sqe_data;	// opaque, returned in the completion
+};
+
+struct ring_cqe {
+	uint32_t cqe_data;	// sqe_data of the request
+	uint32_t cqe_buf;	// buffer page holding any reply data
+	int cqe_res;		// return value of the request
+};
+
+// Heads are advanced by the consumer, tails by the producer.
+struct ring_ctrl {
+	volatile uint32_t sq_head;
+	volatile uint32_t sq_tail;
+	volatile uint32_t cq_head;
+	volatile uint32_t cq_tail;
+	struct ring_sqe sqes[RING_ENTRIES];
+	struct ring_cqe cqes[RING_ENTRIES];
+};
+
+struct Ring {
+	envid_t r_env;			// peer: server (client) or client (server)
+	envid_t r_owner;		// environment that set the ring up
+	enum EnvType r_type;		// server type
+	struct ring_ctrl *r_ctrl;
+	char *r_buf;			// first buffer page
+	uint32_t r_nbuf;		// buffer pages attached (server side)
+	uint32_t r_buf_free;		// free buffer pages (client side)
+	uint32_t r_tail;		// next SQ slot to fill (client side)
+	bool r_waiting;			// client blocked in ring_wait (server side)
+};
+
+// Both sides only run on x86, so ordering the queue index updates
+// against the entry contents just needs a compiler barrier.
+#define ring_barrier()	asm volatile("" : : : "memory")
+
+static inline void *
+ring_buf(struct Ring *r, uint32_t idx)
+{
+	return r->r_buf + (idx & RING_MASK) * PGSIZE;
+}
+
+// client
+int ring_init(struct Ring *r, enum EnvType type);
+void *ring_get(struct Ring *r, uint32_t op, uint32_t data);
+int ring_submit(struct Ring *r);
+struct ring_cqe *ring_peek(struct Ring *r);
+struct ring_cqe *ring_wait(struct Ring *r);
+void ring_seen(struct Ring *r, struct ring_cqe *cqe);
+int ring_fdid(int fdnum);
+
+int ring_prep_open(struct Ring *r, const char *path, int mode, uint32_t data);
+int ring_prep_read(struct Ring *r, int fileid, size_t n, uint32_t data);
+int ring_prep_write(struct Ring *r, int fileid, const void *buf, size_t n,
+		    uint32_t data);
+int ring_prep_stat(struct Ring *r, int fileid, uint32_t data);
+int ring_prep_close(struct Ring *r, int fileid, uint32_t data);
+int ring_prep_send(struct Ring *r, int sockid, const void *buf, int n,
+		   unsigned int flags, uint32_t data);
+int ring_prep_recv(struct Ring *r, int sockid, int n, unsigned int flags,
+		   uint32_t data);
+
+// server
+void ring_srv_init(struct Ring *tab, int n);
+int ring_attach(struct Ring *tab, int n, envid_t whom, void *pg);
+int ring_attach_buf(struct Ring *tab, int n, envid_t whom, void *pg);
+struct Ring *ring_lookup(struct Ring *tab, int n, envid_t whom);
+bool ring_alive(envid_t envid);
+void *ring_next(struct Ring *r, struct ring_sqe *sqe);
+void ring_complete(struct Ring *r, struct ring_sqe *sqe, int res);
+void ring_srv_wait(struct Ring *r);
+int ring_srv_notify(struct Ring *tab, int n);
+
+#endif	// !INC_RING_H
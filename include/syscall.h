@@ -25,6 +25,15 @@ enum {
 	SYS_add_vma,
 	SYS_copy_vma,
 	SYS_env_name,
+	SYS_env_set_priority,
+	SYS_env_set_affinity,
+	SYS_env_dedicate_cpu,
+	SYS_trace,
+	SYS_prof,
+	SYS_env_set_perf,
+	SYS_cons_read,
+	SYS_cons_mode,
+	SYS_ide_dma,
 	NUM_SYSCALLS
 };
 
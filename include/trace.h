@@ -0,0 +1,63 @@
+// Kernel event tracing: record formats shared with user/trace.
+//
+// Each CPU logs enabled events into its own ring; sys_trace(TRACE_DRAIN)
+// moves pending events into a user page laid out as struct TracePage.
+
+#ifndef INC_TRACE_H
+#define INC_TRACE_H
+
+#include <types.h>
+#include <mmu.h>
+
+// Events; bit (1 << event) of the trace mask enables one
+enum {
+	TRACE_SCHED = 0,	// sched_yield: yielding env
+	TRACE_ENV_RUN,		// env_run: env, previous env, weighted runs
+	TRACE_ENV_LOAD,		// load_icode: env, entry point
+	TRACE_SYSCALL,		// syscall: number, a1, a2, a3
+	TRACE_PGFAULT,		// page fault: va, eip, error code
+	TRACE_IPC_SEND,		// ipc send: target, value, srcva, perm
+	TRACE_IPC_RECV,		// ipc recv: dstva
+	TRACE_E1000_TX,		// e1000 tx: index, address, length, cmd
+	TRACE_E1000_RX,		// e1000 rx: index, address, length, status
+	NTRACE
+};
+
+#define TRACE_ALL	((1 << NTRACE) - 1)
+
+static const char * const trace_names[NTRACE] = {
+	[TRACE_SCHED]		= "sched",
+	[TRACE_ENV_RUN]		= "env_run",
+	[TRACE_ENV_LOAD]	= "env_load",
+	[TRACE_SYSCALL]		= "syscall",
+	[TRACE_PGFAULT]		= "pgfault",
+	[TRACE_IPC_SEND]	= "ipc_send",
+	[TRACE_IPC_RECV]	= "ipc_recv",
+	[TRACE_E1000_TX]	= "e1000_tx",
+	[TRACE_E1000_RX]	= "e1000_rx",
+};
+
+// sys_trace operations
+enum {
+	TRACE_MASK = 0,		// set the mask of enabled events, return the old one
+	TRACE_DRAIN,		// move pending events to the page at arg
+};
+
+struct TraceEvent {
+	uint64_t te_tsc;	// time stamp
+	uint16_t te_event;	// TRACE_*
+	uint16_t te_cpu;	// CPU that logged it
+	envid_t te_env;		// curenv of that CPU, or 0
+	uint32_t te_arg[4];	// event specific
+};
+
+struct TracePage {
+	uint32_t tp_count;	// events in tp_events
+	uint32_t tp_dropped;	// events lost to full rings since the last drain
+	struct TraceEvent tp_events[];
+};
+
+#define TRACE_PAGE_EVENTS \
+	((PGSIZE - sizeof(struct TracePage)) / sizeof(struct TraceEvent))
+
+#endif	// !INC_TRACE_H
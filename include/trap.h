@@ -29,6 +29,7 @@ void irqhandler_1(void);
 void irqhandler_4(void);
 void irqhandler_7(void);
 void irqhandler_14(void);
+void irqhandler_15(void);
 void irqhandler_19(void);
 #endif
 
@@ -68,6 +69,7 @@ void irqhandler_19(void);
 #define IRQ_SERIAL       4
 #define IRQ_SPURIOUS     7
 #define IRQ_IDE         14
+#define IRQ_IDE2        15
 #define IRQ_ERROR       19
 
 #ifndef __ASSEMBLER__
@@ -192,6 +192,30 @@ rcr4(void)
 	return cr4;
 }
 
+static inline void
+clts(void)
+{
+	asm volatile("clts");
+}
+
+static inline void
+fninit(void)
+{
+	asm volatile("fninit");
+}
+
+static inline void
+fxsave(void *area)
+{
+	asm volatile("fxsave (%0)" : : "r" (area) : "memory");
+}
+
+static inline void
+fxrstor(const void *area)
+{
+	asm volatile("fxrstor (%0)" : : "r" (area) : "memory");
+}
+
 static inline void
 tlbflush(void)
 {
@@ -252,6 +276,26 @@ cpuid(uint32_t info, uint32_t *eaxp, uint32_t *ebxp, uint32_t *ecxp, uint32_t *e
 		*edxp = edx;
 }
 
+// cpuid for leaves with sub-leaves, selected by 'count' in %ecx
+static inline void
+cpuid_count(uint32_t info, uint32_t count, uint32_t *eaxp, uint32_t *ebxp,
+	    uint32_t *ecxp, uint32_t *edxp)
+{
+	uint32_t eax, ebx, ecx, edx;
+
+	asm volatile("cpuid"
+		     : "=a" (eax), "=b" (ebx), "=c" (ecx), "=d" (edx)
+		     : "a" (info), "c" (count));
+	if (eaxp)
+		*eaxp = eax;
+	if (ebxp)
+		*ebxp = ebx;
+	if (ecxp)
+		*ecxp = ecx;
+	if (edxp)
+		*edxp = edx;
+}
+
 static inline uint64_t
 read_tsc(void)
 {
@@ -261,6 +305,42 @@ read_tsc(void)
 	return tsc;
 }
 
+static inline uint64_t
+rdmsr(uint32_t msr)
+{
+	uint64_t val;
+
+	asm volatile("rdmsr" : "=A" (val) : "c" (msr));
+	return val;
+}
+
+static inline void
+wrmsr(uint32_t msr, uint64_t val)
+{
+	asm volatile("wrmsr" : : "c" (msr), "A" (val));
+}
+
+// Allowed in user mode only while CR4_PCE is set
+static inline uint64_t
+rdpmc(uint32_t counter)
+{
+	uint64_t val;
+
+	asm volatile("rdpmc" : "=A" (val) : "c" (counter));
+	return val;
+}
+
+// Atomically add 'val' to *addr, returning the old value
+static inline uint32_t
+xadd(volatile uint32_t *addr, uint32_t val)
+{
+	asm volatile("lock; xaddl %0, %1"
+			: "+r" (val), "+m" (*addr)
+			:
+			: "cc", "memory");
+	return val;
+}
+
 static inline uint32_t
 xchg(volatile uint32_t *addr, uint32_t newval)
 {
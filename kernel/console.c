@@ -2,17 +2,23 @@
 
 #include <types.h>
 #include <x86.h>
+#include <mmu.h>
 #include <memlayout.h>
 #include <string.h>
 #include <stdio.h>
 #include <kbdreg.h>
 #include <trap.h>
+#include <error.h>
+#include <cons.h>
 #include <kernel/console.h>
 #include <kernel/picirq.h>
 #include <kernel/sched.h>
+#include <kernel/cpu.h>
+#include <kernel/spinlock.h>
+#include <kernel/env.h>
 
 static void cons_intr(int (*proc)(void));
-static void cons_putc(int c);
+static void cons_tx(void);
 
 // Stupid I/O delay routine necessitated by historical PC design flaws
 static void
@@ -34,8 +40,12 @@ delay(void)
 #define COM_DLM		1	// Out: Divisor Latch High (DLAB=1)
 #define COM_IER		1	// Out: Interrupt Enable Register
 #define COM_IER_RDI	0x01	//   Enable receiver data interrupt
+#define COM_IER_THRI	0x02	//   Enable transmitter empty interrupt
 #define COM_IIR		2	// In:	Interrupt ID Register
 #define COM_FCR		2	// Out: FIFO Control Register
+#define	COM_FCR_ENABLE	0x01	//   Enable the FIFOs
+#define	COM_FCR_CLEAR	0x06	//   Clear both FIFOs
+#define COM_FIFO_SIZE	16	// 16550 transmit FIFO depth
 #define COM_LCR		3	// Out: Line Control Register
 #define	COM_LCR_DLAB	0x80	//   Divisor latch access bit
 #define	COM_LCR_WLEN8	0x03	//   Wordlength: 8 bits
@@ -49,6 +59,7 @@ delay(void)
 #define COM_LSR_TSRE	0x40	//   Transmitter off
 
 static bool serial_exists;
+static uint8_t serial_ier;
 
 static int
 serial_proc_data(void)
@@ -61,8 +72,10 @@ serial_proc_data(void)
 void
 serial_intr(void)
 {
-	if (serial_exists)
+	if (serial_exists) {
 		cons_intr(serial_proc_data);
+		cons_tx();
+	}
 }
 
 static void
@@ -81,8 +94,8 @@ serial_putc(int c)
 static void
 serial_init(void)
 {
-	// Turn off the FIFO
-	outb(COM1 + COM_FCR, 0);
+	// Turn on the FIFOs, receive interrupts at every byte
+	outb(COM1 + COM_FCR, COM_FCR_ENABLE | COM_FCR_CLEAR);
 
 	// Set speed; requires DLAB latch
 	outb(COM1 + COM_LCR, COM_LCR_DLAB);
@@ -94,8 +107,9 @@ serial_init(void)
 
 	// No modem controls
 	outb(COM1 + COM_MCR, 0);
-	// Enable rcv interrupts
-	outb(COM1 + COM_IER, COM_IER_RDI);
+	// Enable rcv interrupts; transmit ones only while output is queued
+	serial_ier = COM_IER_RDI;
+	outb(COM1 + COM_IER, serial_ier);
 
 	// Clear any preexisting overrun indications and interrupts
 	// Serial port doesn't exist if COM_LSR returns 0xFF
@@ -126,6 +140,19 @@ lpt_putc(int c)
 	outb(0x378 + 2, 0x08);
 }
 
+// The parallel port has no interrupt here, so buffered output only
+// reaches it when it happens to be idle; the serial port is the console
+// that never loses output.
+static void
+lpt_tryputc(int c)
+{
+	if (!(inb(0x378 + 1) & 0x80))
+		return;
+	outb(0x378 + 0, c);
+	outb(0x378 + 2, 0x08 | 0x04 | 0x01);
+	outb(0x378 + 2, 0x08);
+}
+
 
 
 
@@ -186,11 +213,11 @@ cga_putc(int c)
 		crt_pos -= (crt_pos % CRT_COLS);
 		break;
 	case '\t':
-		cons_putc(' ');
-		cons_putc(' ');
-		cons_putc(' ');
-		cons_putc(' ');
-		cons_putc(' ');
+		cga_putc(' ');
+		cga_putc(' ');
+		cga_putc(' ');
+		cga_putc(' ');
+		cga_putc(' ');
 		break;
 	default:
 		crt_buf[crt_pos++] = c;		/* write the character */
@@ -385,60 +412,397 @@ kbd_init(void)
 // Here we manage the console input buffer,
 // where we stash characters received from the keyboard or serial port
 // whenever the corresponding interrupt occurs.
+//
+// Input in [rpos, epos) can be read.  In canonical mode [epos, wpos) is
+// the line still being typed, which only becomes readable at a newline
+// or ^D; otherwise epos always equals wpos.
 
-#define CONSBUFSIZE 512
+#define CONSBUFSIZE	512		// power of 2
+#define CONSBUFMASK	(CONSBUFSIZE - 1)
+#define NCONSWAIT	8
+
+#define C_EOF		0x04		// ^D
+#define C_KILL		0x15		// ^U
 
 static struct {
 	uint8_t buf[CONSBUFSIZE];
 	uint32_t rpos;
+	uint32_t epos;
 	uint32_t wpos;
+	int mode;			// CONS_*
+	envid_t waiters[NCONSWAIT];	// envs blocked in sys_cons_read
 } cons;
 
+static void
+cons_echo(int c)
+{
+	if (cons.mode & CONS_ECHO) {
+		cons_putc(c);
+		cons_flush();
+	}
+}
+
+static void
+cons_erase(void)
+{
+	cons.wpos--;
+	if (cons.mode & CONS_ECHO) {
+		cons_putc('\b');
+		cons_putc(' ');
+		cons_putc('\b');
+		cons_flush();
+	}
+}
+
+// Make the line being typed readable
+static void
+cons_commit_line(void)
+{
+	cons.epos = cons.wpos;
+}
+
+// Apply the line discipline to one input character
+static void
+cons_input(int c)
+{
+	// keep one byte free for the newline ending a canonical line
+	uint32_t room = CONSBUFSIZE - (cons.wpos - cons.rpos);
+
+	if (!(cons.mode & CONS_CANON)) {
+		if (!room)
+			return;
+		cons.buf[cons.wpos++ & CONSBUFMASK] = c;
+		cons_commit_line();
+		if (c >= ' ' || c == '\n' || c == '\r')
+			cons_echo(c == '\r' ? '\n' : c);
+		return;
+	}
+
+	switch (c) {
+	case '\b':
+	case '\x7f':
+		if (cons.wpos != cons.epos)
+			cons_erase();
+		break;
+
+	case C_KILL:
+		while (cons.wpos != cons.epos)
+			cons_erase();
+		break;
+
+	case C_EOF:
+		// ^D ends a partial line without a newline, and reads as
+		// end of file at the start of one
+		if (cons.wpos == cons.epos && room)
+			cons.buf[cons.wpos++ & CONSBUFMASK] = C_EOF;
+		cons_commit_line();
+		break;
+
+	case '\r':
+	case '\n':
+		cons.buf[cons.wpos++ & CONSBUFMASK] = '\n';
+		cons_commit_line();
+		cons_echo('\n');
+		break;
+
+	default:
+		if (c < ' ' || room <= 1)
+			break;
+		cons.buf[cons.wpos++ & CONSBUFMASK] = c;
+		cons_echo(c);
+		break;
+	}
+}
+
+// Make every env blocked in sys_cons_read runnable again; each one
+// restarts its read.
+static void
+cons_wakeup(void)
+{
+	struct Env *e;
+	int i;
+
+	for (i = 0; i < NCONSWAIT; i++) {
+		if (!cons.waiters[i])
+			continue;
+		if (envid2env(cons.waiters[i], &e, 0) >= 0 &&
+		    e->env_status == ENV_NOT_RUNNABLE)
+			env_ready(e);
+		cons.waiters[i] = 0;
+	}
+}
+
 // called by device interrupt routines to feed input characters
 // into the circular console input buffer.
 static void
 cons_intr(int (*proc)(void))
 {
+	uint32_t epos = cons.epos;
 	int c;
 
 	while ((c = (*proc)()) != -1) {
 		if (c == 0)
 			continue;
-		cons.buf[cons.wpos++] = c;
-		if (cons.wpos == CONSBUFSIZE)
-			cons.wpos = 0;
+		cons_input(c);
 	}
+
+	if (cons.epos != epos)
+		cons_wakeup();
 }
 
 // return the next input character from the console, or 0 if none waiting
 int
 cons_getc(void)
 {
-	int c;
-
-	// poll for any pending input characters,
-	// so that this function works even when interrupts are disabled
-	// (e.g., when called from the kernel monitor).
+	// poll for any pending input characters, and push out queued
+	// output, so that this function works even when interrupts are
+	// disabled (e.g., when called from the kernel monitor).
 	serial_intr();
 	kbd_intr();
 
 	// grab the next character from the input buffer.
-	if (cons.rpos != cons.wpos) {
-		c = cons.buf[cons.rpos++];
-		if (cons.rpos == CONSBUFSIZE)
-			cons.rpos = 0;
-		return c;
+	if (cons.rpos != cons.epos)
+		return cons.buf[cons.rpos++ & CONSBUFMASK];
+	return 0;
+}
+
+// Copy up to n bytes of readable input to buf, stopping after a newline
+// in canonical mode.  Returns the number of bytes copied, 0 at end of
+// file (^D), or -E_BUSY if there is nothing to read yet.
+int
+cons_read(char *buf, size_t n)
+{
+	size_t i = 0;
+	int c;
+
+	if (cons.rpos == cons.epos)
+		return -E_BUSY;
+
+	if (cons.buf[cons.rpos & CONSBUFMASK] == C_EOF) {
+		cons.rpos++;
+		return 0;
 	}
+
+	while (i < n && cons.rpos != cons.epos) {
+		c = cons.buf[cons.rpos & CONSBUFMASK];
+		if (c == C_EOF)
+			break;
+		buf[i++] = c;
+		cons.rpos++;
+		if (c == '\n' && (cons.mode & CONS_CANON))
+			break;
+	}
+
+	return i;
+}
+
+// Block env e until there is console input.  Returns -E_NO_MEM if too
+// many envs are waiting already.
+int
+cons_wait(struct Env *e)
+{
+	int i, slot = -1;
+
+	for (i = 0; i < NCONSWAIT; i++) {
+		if (cons.waiters[i] == e->env_id)
+			return 0;
+		if (!cons.waiters[i] && slot < 0)
+			slot = i;
+	}
+	if (slot < 0)
+		return -E_NO_MEM;
+
+	cons.waiters[slot] = e->env_id;
+	e->env_status = ENV_NOT_RUNNABLE;
 	return 0;
 }
 
-// output a character to the console
+// True if some env sleeps until the keyboard or serial port wakes it
+bool
+cons_waiting(void)
+{
+	struct Env *e;
+	int i;
+
+	for (i = 0; i < NCONSWAIT; i++)
+		if (cons.waiters[i] && envid2env(cons.waiters[i], &e, 0) >= 0)
+			return true;
+	return false;
+}
+
+// Switch line discipline, returning the old mode.  A line being typed
+// becomes readable when canonical mode ends.
+int
+cons_set_mode(int mode)
+{
+	int old = cons.mode;
+
+	if (mode & ~CONS_MODES)
+		return -E_INVAL;
+
+	cons.mode = mode;
+	if (!(mode & CONS_CANON) && cons.epos != cons.wpos) {
+		cons_commit_line();
+		cons_wakeup();
+	}
+	return old;
+}
+
+/***** Buffered console output *****/
+// Each CPU stages the output of one cprintf (or one sys_cputs) in its
+// own buffer, then copies it into cons_out under cons_lock, so lines
+// from different CPUs don't interleave.  The CGA screen is plain memory
+// and is updated right then; the serial port drains cons_out from its
+// transmit interrupt, a FIFO's worth at a time, so no CPU waits on the
+// UART while holding a lock.  Until cons_start_async(), and again after
+// a panic, every character is written out synchronously instead.
+
+#define CONS_OUT_SIZE	8192		// power of 2
+#define CONS_OUT_MASK	(CONS_OUT_SIZE - 1)
+#define CONS_STAGE_SIZE	256
+
+static struct {
+	uint8_t buf[CONS_OUT_SIZE];
+	uint32_t head;			// next byte to queue
+	uint32_t tail;			// next byte to transmit
+} cons_out;
+
+struct ConsStage {
+	uint8_t buf[CONS_STAGE_SIZE];
+	int len;
+} __aligned(CACHELINE);
+
+static struct ConsStage cons_stage[NCPU];
+static struct spinlock cons_lock;
+static bool cons_async;
+
+// Move as much of cons_out as the transmit FIFO takes, and ask for an
+// interrupt when it is empty again if there is more.
+// Called with cons_lock held.
+static void
+serial_tx(void)
+{
+	uint8_t ier;
+	int c, i;
+
+	if (!serial_exists) {
+		cons_out.tail = cons_out.head;
+		return;
+	}
+
+	if (inb(COM1 + COM_LSR) & COM_LSR_TXRDY) {
+		for (i = 0; i < COM_FIFO_SIZE && cons_out.tail != cons_out.head; i++) {
+			c = cons_out.buf[cons_out.tail++ & CONS_OUT_MASK];
+			outb(COM1 + COM_TX, c);
+			lpt_tryputc(c);
+		}
+	}
+
+	ier = COM_IER_RDI;
+	if (cons_out.tail != cons_out.head)
+		ier |= COM_IER_THRI;
+	if (ier != serial_ier) {
+		serial_ier = ier;
+		outb(COM1 + COM_IER, ier);
+	}
+}
+
 static void
+cons_tx(void)
+{
+	if (!cons_async)
+		return;
+
+	spin_lock(&cons_lock);
+	serial_tx();
+	spin_unlock(&cons_lock);
+}
+
+// Queue this CPU's staged output
+static void
+cons_commit(struct ConsStage *st)
+{
+	int c, i;
+
+	spin_lock(&cons_lock);
+	for (i = 0; i < st->len; i++) {
+		c = st->buf[i];
+		cga_putc(c);
+
+		// a full ring falls back to waiting for the UART
+		if (cons_out.head - cons_out.tail == CONS_OUT_SIZE)
+			serial_putc(cons_out.buf[cons_out.tail++ & CONS_OUT_MASK]);
+		cons_out.buf[cons_out.head++ & CONS_OUT_MASK] = c;
+	}
+	serial_tx();
+	spin_unlock(&cons_lock);
+
+	st->len = 0;
+}
+
+// output a character to the console; it may sit in this CPU's staging
+// buffer until cons_flush()
+void
 cons_putc(int c)
 {
-	serial_putc(c);
-	lpt_putc(c);
-	cga_putc(c);
+	struct ConsStage *st;
+
+	if (!cons_async) {
+		serial_putc(c);
+		lpt_putc(c);
+		cga_putc(c);
+		return;
+	}
+
+	st = &cons_stage[thiscpu->cpu_id];
+	st->buf[st->len++] = c;
+	if (st->len == CONS_STAGE_SIZE)
+		cons_commit(st);
+}
+
+// Queue whatever this CPU has staged
+void
+cons_flush(void)
+{
+	struct ConsStage *st;
+
+	if (!cons_async)
+		return;
+
+	st = &cons_stage[thiscpu->cpu_id];
+	if (st->len)
+		cons_commit(st);
+}
+
+// Every CPU can find its staging buffer through thiscpu from now on
+void
+cons_start_async(void)
+{
+	cons_async = true;
+}
+
+// Write out everything queued and staged, and stay synchronous.
+// Another CPU may have stopped holding cons_lock, so it is not taken.
+void
+cons_panic_flush(void)
+{
+	struct ConsStage *st;
+	int i;
+
+	if (!cons_async)
+		return;
+	cons_async = false;
+
+	while (cons_out.tail != cons_out.head) {
+		serial_putc(cons_out.buf[cons_out.tail & CONS_OUT_MASK]);
+		lpt_putc(cons_out.buf[cons_out.tail & CONS_OUT_MASK]);
+		cons_out.tail++;
+	}
+
+	st = &cons_stage[thiscpu->cpu_id];
+	for (i = 0; i < st->len; i++)
+		cons_putc(st->buf[i]);
+	st->len = 0;
 }
 
 // initialize the console devices
@@ -448,6 +812,7 @@ cons_init(void)
 	cga_init();
 	kbd_init();
 	serial_init();
+	spin_initlock(&cons_lock);
 
 	if (!serial_exists)
 		cprintf("Serial port does not exist!\n");
@@ -460,6 +825,7 @@ void
 cputchar(int c)
 {
 	cons_putc(c);
+	cons_flush();
 }
 
 int
@@ -8,12 +8,16 @@
 #include <kernel/monitor.h>
 #include <kernel/spinlock.h>
 #include <kernel/sched.h>
+#include <kernel/fpu.h>
+#include <kernel/trace.h>
+#include <kernel/perf.h>
 
 #define debug 0
 
 #define ENVGENSHIFT	12		// >= LOGNENV
 
 struct Env *envs;			// All environments
+struct EnvInfo *envinfos;		// Metadata of all environments
 static struct Env *env_free_list;	// Free environment list, linked by Env->env_link.
 
 // Global descriptor table.
@@ -31,7 +35,7 @@ static struct Env *env_free_list;	// Free environment list, linked by Env->env_l
 // definition of gdt specifies the Descriptor Privilege Level (DPL)
 // of that descriptor: 0 for kernel and 3 for user.
 //
-struct Segdesc gdt[NCPU + 5] = {
+struct Segdesc gdt[2 * NCPU + 5] = {
 	// 0x0 - unused (always faults -- for trapping NULL far pointers)
 	SEG_NULL,
 
@@ -50,6 +54,10 @@ struct Segdesc gdt[NCPU + 5] = {
 	// Per-CPU TSS descriptors (starting from GD_TSS0) are initialized
 	// in trap_init_percpu()
 	[GD_TSS0 >> 3] = SEG_NULL,
+
+	// Per-CPU data segments (starting from GD_CPU0) are initialized
+	// in env_init_percpu()
+	[GD_CPU0 >> 3] = SEG_NULL,
 };
 
 struct Pseudodesc gdt_pd = {
@@ -98,12 +106,23 @@ envid2env(envid_t envid, struct Env **env, bool checkperm)
 void
 env_init_percpu(void)
 {
+	struct CpuInfo *c = &cpus[cpunum()];
+	int id = c - cpus;
+
+	static_assert(GD_CPU0 == GD_TSS0 + (NCPU << 3));
+
+	// GS points at this CPU's CpuInfo so that thiscpu and curenv are
+	// plain GS-relative loads.  This is the last cpunum() a CPU needs.
+	c->cpu_self = c;
+	gdt[(GD_CPU0 >> 3) + id] = SEG16(STA_W, (uint32_t)c,
+					 sizeof(struct CpuInfo) - 1, 0);
+
 	// reload gdt (first load by boot.S and mpentry.S)
 	lgdt(&gdt_pd);
 
-	// The kernel never uses GS or FS, so we leave those set to
-	// the user data segment.
-	asm volatile("movw %%ax,%%gs" : : "a" (GD_UD|3));
+	// GS is reloaded on every trap (see alltraps), FS is never used
+	// by the kernel and stays set to the user data segment.
+	asm volatile("movw %%ax,%%gs" : : "a" (GD_CPU0 + (id << 3)));
 	asm volatile("movw %%ax,%%fs" : : "a" (GD_UD|3));
 
 	// The kernel does use ES, DS, and SS.  We'll change between
@@ -362,7 +381,7 @@ load_icode(struct Env *e, uint8_t *binary)
 		}
 	}
 
-	cprintf("ELFHDR->e_entry %08x\n", ELFHDR->e_entry);
+	trace(TRACE_ENV_LOAD, e->env_id, ELFHDR->e_entry, 0, 0);
 	e->env_tf.tf_eip = ELFHDR->e_entry;
 
 	init_stack(e);
@@ -402,9 +421,14 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 	// Set the basic status variables.
 	e->env_parent_id = parent_id;
 	e->env_type = ENV_TYPE_USER;
-	e->env_status = ENV_RUNNABLE;
+	memset(env_stat(e), 0, sizeof(struct EnvStat));
+	env_ready(e);
 	e->env_runs = 0;
-	e->vma_valid = 0;
+	e->env_vruns = 0;
+	sched_set_priority(e, ENV_PRIO_NORMAL);
+	e->env_affinity = ENV_AFFINITY_ALL;
+	e->env_base_affinity = ENV_AFFINITY_ALL;
+	env_info(e)->vma_valid = 0;
 
 	// Clear out all the saved register state,
 	// to prevent the register values
@@ -438,6 +462,10 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 	// Also clear the IPC receiving flag
 	e->env_ipc_recving = false;
 
+	// Start from a clean FPU, counting no events
+	fpu_env_init(e);
+	perf_env_init(e);
+
 	// Turn out the first entry of env_free_list
 	env_free_list = e->env_link;
 	*newenv_store = e;
@@ -466,12 +494,40 @@ env_create(uint8_t *binary, enum EnvType type)
 
 	load_icode(env, binary);
 	env->env_type = type;
+	if (type != ENV_TYPE_USER)
+		sched_set_priority(env, ENV_PRIO_SERVER);
 
 	/* If this is the file server, then give it I/O privileges. */
 	if (type == ENV_TYPE_FS)
 		env->env_tf.tf_eflags |= FL_IOPL_3;
 }
 
+// Make 'e' runnable; its wait for a CPU starts now.
+void
+env_ready(struct Env *e)
+{
+	e->env_status = ENV_RUNNABLE;
+	env_stat(e)->es_ready = read_tsc();
+}
+
+// Trap entry from user mode: account the user time since env_run().
+void
+env_account_trap(void)
+{
+	uint64_t now = read_tsc();
+
+	env_stat(curenv)->es_user += now - thiscpu->cpu_tsc;
+	thiscpu->cpu_tsc = now;
+}
+
+// This CPU is about to halt: account the kernel time since the trap.
+void
+env_account_halt(void)
+{
+	if (curenv)
+		env_stat(curenv)->es_kern += read_tsc() - thiscpu->cpu_tsc;
+}
+
 /*
  * Restores the register values in the Trapframe with the 'iret' instruction.
  * This exits the kernel and starts executing some environment's code.
@@ -482,7 +538,10 @@ void
 env_pop_tf(struct Trapframe *tf)
 {
 	// Record the CPU we are running on for user-space debugging
-	curenv->env_cpunum = cpunum();
+	curenv->env_cpunum = thiscpu->cpu_id;
+
+	// Hand user space the user data segment rather than the per-CPU one
+	asm volatile("movw %%ax,%%gs" : : "a" (GD_UD|3));
 
 	asm volatile(
 		"\tmovl %0, %%esp\n"		/* move tf arg to esp */
@@ -516,15 +575,42 @@ env_run(struct Env *e)
 	// Step 2: Use env_pop_tf() to restore the environment's
 	//	   registers and drop into user mode in the
 	//	   environment.
-	if (curenv && (curenv->env_status == ENV_RUNNING))
-		curenv->env_status = ENV_RUNNABLE;
+	uint64_t now = read_tsc();
+
+	trace(TRACE_ENV_RUN, e->env_id, curenv ? curenv->env_id : 0,
+	      e->env_vruns, 0);
+
+	// Account the time since the trap to curenv, the time since
+	// becoming runnable to e, and start e's user time.
+	if (curenv) {
+		env_stat(curenv)->es_kern += now - thiscpu->cpu_tsc;
+		if (curenv->env_status == ENV_RUNNING) {
+			curenv->env_status = ENV_RUNNABLE;
+			env_stat(curenv)->es_ready = now;
+		}
+	}
+	if (e->env_status == ENV_RUNNABLE)
+		env_stat(e)->es_wait += now - env_stat(e)->es_ready;
+	thiscpu->cpu_tsc = now;
+
+	if (curenv != e) {
+		fpu_switch_out(curenv);
+		perf_switch_out(curenv);
+		perf_switch_in(e);
+	}
 
-	curenv = e;
+	thiscpu->cpu_env = e;
 	e->env_status = ENV_RUNNING;
 	e->env_runs++;
+	e->env_vruns += ENV_PRIO_STRIDE(e->env_prio);
 
-	/* switch address space */
-	lcr3(PADDR(e->env_pgdir));
+	/*
+	 * switch address space, unless the CPU is still on it (the same
+	 * env resumed): env_free() and sched_halt() move a CPU back to
+	 * kern_pgdir, so a recycled pgdir page always forces a reload.
+	 */
+	if (rcr3() != PADDR(e->env_pgdir))
+		lcr3(PADDR(e->env_pgdir));
 
 	unlock_kernel();
 	/* run new env */
@@ -541,6 +627,9 @@ env_free(struct Env *e)
 	uint32_t pdeno, pteno;
 	physaddr_t pa;
 
+	// Stop its counters and pass their totals up
+	perf_env_free(e);
+
 	// If freeing the current environment, switch to kern_pgdir
 	// before freeing the page directory, just in case the page
 	// gets reused.
@@ -605,7 +694,7 @@ env_destroy(struct Env *e)
 	env_free(e);
 
 	if (curenv == e) {
-		curenv = NULL;
+		thiscpu->cpu_env = NULL;
 		sched_yield();
 	}
 }
@@ -0,0 +1,110 @@
+#include <x86.h>
+#include <mmu.h>
+#include <string.h>
+#include <assert.h>
+#include <kernel/env.h>
+#include <kernel/cpu.h>
+#include <kernel/fpu.h>
+
+// CPUID.1:EDX feature flags
+#define CPUID_FXSR	(1 << 24)
+#define CPUID_SSE	(1 << 25)
+
+#define FPU_FCW_INIT	0x037f	// x87 control word after fninit
+#define FPU_MXCSR_INIT	0x1f80	// all SIMD exceptions masked
+
+// Lazy FPU switching.
+//
+// CR0.TS is set whenever an environment is switched in, so its first
+// x87/MMX/SSE instruction raises #NM and fpu_trap loads its state.  An
+// environment that got the FPU this way saves it back when it leaves
+// the CPU.  Each CPU remembers whose state its registers still hold,
+// so an environment coming back to an untouched FPU skips the reload.
+// The kernel itself never uses the FPU.
+
+struct FpuState *env_fpus;
+
+static struct FpuState *
+env_fpu(struct Env *e)
+{
+	return &env_fpus[ENVX(e->env_id)];
+}
+
+void
+fpu_init_percpu(void)
+{
+	uint32_t edx;
+
+	cpuid(1, NULL, NULL, NULL, &edx);
+	if (!(edx & CPUID_FXSR) || !(edx & CPUID_SSE))
+		panic("CPU %d: no FXSAVE/SSE support", thiscpu->cpu_id);
+
+	lcr4(rcr4() | CR4_OSFXSR | CR4_OSXMMEXCPT);
+	clts();
+	fninit();
+	lcr0((rcr0() | CR0_MP | CR0_NE | CR0_TS) & ~CR0_EM);
+
+	thiscpu->cpu_fpu_env = 0;
+}
+
+// Give e the state fninit leaves, with all SIMD exceptions masked.
+void
+fpu_env_init(struct Env *e)
+{
+	struct FpuState *fpu = env_fpu(e);
+
+	memset(fpu, 0, sizeof(*fpu));
+	*(uint16_t *)&fpu->fpu_fxsave[0] = FPU_FCW_INIT;
+	*(uint32_t *)&fpu->fpu_fxsave[24] = FPU_MXCSR_INIT;
+	fpu->fpu_cpu = -1;
+}
+
+// Copy src's FPU state to dst, as of now.
+void
+fpu_env_copy(struct Env *dst, struct Env *src)
+{
+	if (!(rcr0() & CR0_TS) && thiscpu->cpu_fpu_env == src->env_id)
+		fxsave(env_fpu(src)->fpu_fxsave);
+
+	memmove(env_fpu(dst)->fpu_fxsave, env_fpu(src)->fpu_fxsave,
+		sizeof(env_fpu(dst)->fpu_fxsave));
+	env_fpu(dst)->fpu_cpu = -1;
+}
+
+// e (may be NULL if it was freed) is leaving this CPU: save its
+// registers if it used the FPU in this time slice, and make sure the
+// next environment traps on its first FPU instruction.
+void
+fpu_switch_out(struct Env *e)
+{
+	uint32_t cr0 = rcr0();
+
+	if (cr0 & CR0_TS)
+		return;
+
+	if (e && thiscpu->cpu_fpu_env == e->env_id)
+		fxsave(env_fpu(e)->fpu_fxsave);
+
+	lcr0(cr0 | CR0_TS);
+}
+
+// Device-not-available (#NM): curenv touched the FPU with CR0.TS set.
+void
+fpu_trap(struct Trapframe *tf)
+{
+	struct CpuInfo *c = thiscpu;
+	struct FpuState *fpu;
+
+	if ((tf->tf_cs & 3) != 3)
+		panic("FPU used in kernel at %08x", tf->tf_eip);
+
+	clts();
+
+	fpu = env_fpu(curenv);
+	if (c->cpu_fpu_env == curenv->env_id && fpu->fpu_cpu == c->cpu_id)
+		return;
+
+	fxrstor(fpu->fpu_fxsave);
+	c->cpu_fpu_env = curenv->env_id;
+	fpu->fpu_cpu = c->cpu_id;
+}
@@ -0,0 +1,190 @@
+/*
+ * Bus-master DMA for the primary channel of the PIIX IDE controller.
+ *
+ * The fs env drives the ATA task file itself, with IOPL 3.  The kernel
+ * owns what it cannot: the PRD table, which holds physical addresses,
+ * and IRQ 14.  ide_dma points the PRD table at a buffer of the env,
+ * issues the DMA command the env has set the task file up for and
+ * blocks the env; the interrupt at the end of the transfer makes it
+ * runnable again, with the result of the system call.  IRQ 15 of the
+ * secondary channel is only acknowledged.
+ */
+
+#include <types.h>
+#include <x86.h>
+#include <error.h>
+#include <stdio.h>
+#include <string.h>
+#include <kernel/ide.h>
+#include <kernel/pmap.h>
+#include <kernel/picirq.h>
+
+// ATA registers of the two channels
+#define ATA_PRIMARY	0x1F0
+#define ATA_SECONDARY	0x170
+#define ATA_STATUS	7
+
+#define ATA_DF		0x20
+#define ATA_ERR		0x01
+
+#define ATA_READ_DMA	0xC8
+#define ATA_WRITE_DMA	0xCA
+
+// Bus-master registers, 8 ports per channel
+#define BM_CMD		0
+#define BM_STATUS	2
+#define BM_PRDT		4
+
+#define BM_CMD_START	0x01
+#define BM_CMD_READ	0x08	// device to memory
+
+#define BM_STATUS_ERR	0x02
+#define BM_STATUS_IRQ	0x04
+
+// Physical region descriptor
+struct Prd {
+	uint32_t prd_addr;
+	uint16_t prd_len;
+	uint16_t prd_flags;
+};
+
+#define PRD_EOT		0x8000
+
+// An ATA command moves at most 256 sectors, one region per page touched
+#define NPRD		(256 * 512 / PGSIZE + 1)
+
+// The table must not cross a 64KB boundary
+static struct Prd prd[NPRD] __aligned(512);
+static struct PageInfo *prd_page[NPRD];
+static uint32_t nprd;
+
+static uint16_t bmbase;		// bus-master ports, 0 without a controller
+static envid_t dma_env;		// env waiting for the transfer
+
+int
+pci_ide_attach(struct pci_func *pcif)
+{
+	pci_func_enable(pcif);
+
+	// the ATA channels stay at their legacy ports and IRQs
+	if (!pcif->reg_base[4])
+		return 0;
+
+	bmbase = pcif->reg_base[4];
+	outb(bmbase + BM_STATUS, BM_STATUS_IRQ | BM_STATUS_ERR);
+	outb(bmbase + 8 + BM_STATUS, BM_STATUS_IRQ | BM_STATUS_ERR);
+
+	irq_setmask_8259A(irq_mask_8259A & ~(1 << IRQ_IDE) & ~(1 << IRQ_IDE2));
+	cprintf("ide: bus-master DMA at port 0x%x\n", bmbase);
+	return 1;
+}
+
+static void
+prd_release(void)
+{
+	uint32_t i;
+
+	for (i = 0; i < nprd; i++)
+		page_decref(prd_page[i]);
+	nprd = 0;
+}
+
+// Start the ATA DMA command 'cmd' moving 'len' bytes at 'va' in the
+// address space of 'e', the task file being set up for it, and block
+// 'e' until it completes.  Its pages are held until then.
+//
+// Returns 0 if the transfer started, < 0 on error.  Errors are:
+//	-E_NOT_SUPP if there is no bus-master controller.
+//	-E_BUSY if a transfer is in flight.
+//	-E_INVAL if 'cmd' is no DMA command or the buffer is not mapped
+//		with the permissions the transfer needs.
+int
+ide_dma(struct Env *e, int cmd, const void *va, size_t len)
+{
+	struct PageInfo *pp;
+	uintptr_t addr = (uintptr_t)va;
+	uint32_t n;
+	pte_t *pte;
+	int perm;
+
+	if (!bmbase)
+		return -E_NOT_SUPP;
+	if (dma_env)
+		return -E_BUSY;
+	if ((cmd != ATA_READ_DMA && cmd != ATA_WRITE_DMA) ||
+	    len == 0 || len > 256 * 512 || len % 512 || addr % 2 ||
+	    addr + len > UTOP || addr + len < addr)
+		return -E_INVAL;
+
+	// the device writes memory on a read
+	perm = PTE_P | PTE_U | (cmd == ATA_READ_DMA ? PTE_W : 0);
+	for (; len > 0; addr += n, len -= n) {
+		pp = page_lookup(e->env_pgdir, (void *)addr, &pte);
+		if (!pp || (*pte & perm) != perm) {
+			prd_release();
+			return -E_INVAL;
+		}
+
+		n = MIN(len, PGSIZE - PGOFF(addr));
+		pp->pp_ref++;
+		prd_page[nprd] = pp;
+		prd[nprd].prd_addr = page2pa(pp) + PGOFF(addr);
+		prd[nprd].prd_len = n;
+		prd[nprd].prd_flags = 0;
+		nprd++;
+	}
+	prd[nprd - 1].prd_flags = PRD_EOT;
+
+	outb(bmbase + BM_CMD, 0);
+	outb(bmbase + BM_STATUS, BM_STATUS_IRQ | BM_STATUS_ERR);
+	outl(bmbase + BM_PRDT, PADDR(prd));
+	outb(ATA_PRIMARY + ATA_STATUS, cmd);
+	outb(bmbase + BM_CMD,
+	     BM_CMD_START | (cmd == ATA_READ_DMA ? BM_CMD_READ : 0));
+
+	dma_env = e->env_id;
+	e->env_status = ENV_NOT_RUNNABLE;
+	return 0;
+}
+
+// Handle IRQ 14 or 15: stop the transfer of the channel and wake the
+// env waiting for it, if any.
+void
+ide_intr(int irq)
+{
+	uint16_t bm = bmbase + (irq == IRQ_IDE ? 0 : 8);
+	uint8_t bmstat, stat;
+	struct Env *e;
+
+	if (!bmbase)
+		return;
+
+	// an interrupt left over from PIO may arrive during a transfer
+	bmstat = inb(bm + BM_STATUS);
+	if (irq == IRQ_IDE && dma_env && !(bmstat & BM_STATUS_IRQ))
+		return;
+
+	// reading the status acknowledges the interrupt of the drive
+	stat = inb((irq == IRQ_IDE ? ATA_PRIMARY : ATA_SECONDARY) + ATA_STATUS);
+	outb(bm + BM_STATUS, BM_STATUS_IRQ | BM_STATUS_ERR);
+	if (irq != IRQ_IDE || !dma_env)
+		return;
+
+	outb(bm + BM_CMD, 0);
+	prd_release();
+
+	if (envid2env(dma_env, &e, 0) >= 0 && e->env_status == ENV_NOT_RUNNABLE) {
+		e->env_tf.tf_regs.reg_eax =
+			((bmstat & BM_STATUS_ERR) || (stat & (ATA_DF | ATA_ERR))) ?
+			-E_IO : 0;
+		env_ready(e);
+	}
+	dma_env = 0;
+}
+
+// True if an env sleeps until a transfer completes
+bool
+ide_waiting(void)
+{
+	return dma_env != 0;
+}
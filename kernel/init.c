@@ -14,6 +14,8 @@
 #include <kernel/time.h>
 #include <kernel/init.h>
 #include <kernel/ksymbol.h>
+#include <kernel/fpu.h>
+#include <kernel/perf.h>
 
 static void boot_aps(void);
 
@@ -30,6 +32,9 @@ init(void)
 	mem_init();
 	env_init();
 	trap_init();
+	fpu_init_percpu();
+	perf_init();
+	perf_init_percpu();
 
 	/* multiprocessor initialization functions */
 	/* config lapicaddr */
@@ -50,6 +55,9 @@ init(void)
 	// Starting non-boot CPUs
 	boot_aps();
 
+	// Every CPU has its %gs now; stop writing the console synchronously
+	cons_start_async();
+
 	// Start fs env
 	ENV_CREATE(fs_fs, ENV_TYPE_FS);
 
@@ -86,7 +94,7 @@ boot_aps(void)
 
 	// Boot each AP one at a time
 	for (c = cpus; c < cpus + ncpu; c++) {
-		if (c == cpus + cpunum())  // We've started already.
+		if (c == thiscpu)  // We've started already.
 			continue;
 
 		// Tell mpentry.S what stack to use.
@@ -107,11 +115,14 @@ mp_main(void)
 {
 	// We are in high EIP now, safe to switch to kern_pgdir
 	lcr3(PADDR(kern_pgdir));
+	mem_init_percpu();
 	cprintf("SMP: CPU %d starting\n", cpunum());
 
-	lapic_init();
 	env_init_percpu();
+	lapic_init();
 	trap_init_percpu();
+	fpu_init_percpu();
+	perf_init_percpu();
 	xchg(&thiscpu->cpu_status, CPU_STARTED); // tell boot_aps() we're up
 
 	// Now that we have finished some basic setup, call sched_yield()
@@ -103,6 +103,17 @@ stab_binsearch(const struct Stab *stabs, int *region_left, int *region_right,
 //
 int
 debuginfo_eip(uintptr_t addr, struct Eipdebuginfo *info)
+{
+	return debuginfo_env_eip(curenv, addr, info);
+}
+
+// debuginfo_env_eip(e, addr, info)
+//
+//	Like debuginfo_eip, but looks up user addresses in the stabs of
+//	env 'e', whose address space must be the one loaded.
+//
+int
+debuginfo_env_eip(struct Env *e, uintptr_t addr, struct Eipdebuginfo *info)
 {
 	const struct Stab *stabs, *stab_end;
 	const char *stabstr, *stabstr_end;
@@ -122,6 +133,8 @@ debuginfo_eip(uintptr_t addr, struct Eipdebuginfo *info)
 		stab_end = __STAB_END__;
 		stabstr = __STABSTR_BEGIN__;
 		stabstr_end = __STABSTR_END__;
+	} else if (!e) {
+		return -1;
 	} else {
 		// The user-application linker script, user/user.ld,
 		// puts information about the application's stabs (equivalent
@@ -132,7 +145,7 @@ debuginfo_eip(uintptr_t addr, struct Eipdebuginfo *info)
 
 		// Make sure this memory is valid.
 		// Return -1 if it is not.  Hint: Call user_mem_check.
-		if (user_mem_check(curenv, usd, sizeof(struct user_stab_data), 0) < 0)
+		if (user_mem_check(e, usd, sizeof(struct user_stab_data), 0) < 0)
 			return -1;
 
 		stabs = usd->stabs;
@@ -141,10 +154,10 @@ debuginfo_eip(uintptr_t addr, struct Eipdebuginfo *info)
 		stabstr_end = usd->stabstr_end;
 
 		// Make sure the STABS and string table memory is valid.
-		if (user_mem_check(curenv, stabs, stab_end - stabs, 0) < 0)
+		if (user_mem_check(e, stabs, stab_end - stabs, 0) < 0)
 			return -1;
 
-		if (user_mem_check(curenv, stabstr, stabstr_end - stabstr, 0) < 0)
+		if (user_mem_check(e, stabstr, stabstr_end - stabstr, 0) < 0)
 			return -1;
 	}
 
@@ -11,6 +11,7 @@
 #include <kernel/trap.h>
 #include <kernel/env.h>
 #include <kernel/ksymbol.h>
+#include <kernel/prof.h>
 
 #define CMDBUF_SIZE	80	// enough for one VGA text line
 
@@ -30,6 +31,7 @@ static struct Command commands[] = {
 	{ "dump", "Dump the contents of a range of memory given either a virtual or physical address range", mon_dump },
 	{ "continue", "Continue the program from the break point", mon_continue },
 	{ "si", "Run instructions by single-step", mon_si },
+	{ "prof", "Start or stop the sampling profiler, or print its flat profile", mon_prof },
 };
 
 /***** Implementations of basic kernel monitor commands *****/
@@ -348,6 +350,38 @@ mon_si(int argc, char **argv, struct Trapframe *tf)
 	return 0;
 }
 
+/*
+ *	prof start [N]	sample every N timer ticks (default 1)
+ *	prof stop	stop sampling
+ *	prof		print and clear the samples counted so far
+ */
+int
+mon_prof(int argc, char **argv, struct Trapframe *tf)
+{
+	uint32_t period = 1;
+
+	if (argc == 1) {
+		prof_print();
+		return 0;
+	}
+
+	if (!strcmp(argv[1], "start") && argc <= 3) {
+		if (argc == 3)
+			period = strtol(argv[2], NULL, 0);
+		if (prof_start(period) < 0)
+			cprintf("Usage: prof start [N], N > 0\n");
+		return 0;
+	}
+
+	if (!strcmp(argv[1], "stop") && argc == 2) {
+		prof_stop();
+		return 0;
+	}
+
+	cprintf("Usage: prof [start [N] | stop]\n");
+	return 0;
+}
+
 /***** Kernel monitor command interpreter *****/
 
 #define WHITESPACE "\t\r\n "
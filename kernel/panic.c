@@ -2,6 +2,7 @@
 #include <assert.h>
 #include <kernel/cpu.h>
 #include <kernel/monitor.h>
+#include <kernel/console.h>
 
 /*
  * Variable panicstr contains argument to first call to panic; used as flag
@@ -25,6 +26,9 @@ _panic(const char *file, int line, const char *fmt, ...)
 	// Be extra sure that the machine is in as reasonable state
 	asm volatile("cli; cld");
 
+	// Get queued output out before ours, and write ours synchronously
+	cons_panic_flush();
+
 	va_start(ap, fmt);
 	cprintf("kernel panic on CPU %d at %s:%d: ", cpunum(), file, line);
 	vcprintf(fmt, ap);
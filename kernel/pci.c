@@ -4,6 +4,7 @@
 #include <kernel/pci.h>
 #include <kernel/pcireg.h>
 #include <kernel/e1000.h>
+#include <kernel/ide.h>
 
 // Flag to do "lspci" at bootup
 static int pci_show_devs = 1;
@@ -25,6 +26,7 @@ struct pci_driver {
 // pci_attach_class matches the class and subclass of a PCI device
 struct pci_driver pci_attach_class[] = {
 	{ PCI_CLASS_BRIDGE, PCI_SUBCLASS_BRIDGE_PCI, &pci_bridge_attach },
+	{ PCI_CLASS_MASS_STORAGE, PCI_SUBCLASS_MASS_STORAGE_IDE, &pci_ide_attach },
 	{ 0, 0, NULL },
 };
 
@@ -0,0 +1,188 @@
+// Per-environment performance counters.
+//
+// Architectural performance monitoring (CPUID leaf 0xA) gives each CPU
+// a few general purpose counters, each driven by an IA32_PERFEVTSELx
+// MSR.  They belong to whichever env runs on the CPU: perf_switch_in()
+// starts the env's events from zero and perf_switch_out() stops them
+// and adds what they counted to the env's EnvPerf.  Counters of a CPU
+// running an env that counts nothing stay disabled.
+
+#include <x86.h>
+#include <mmu.h>
+#include <error.h>
+#include <string.h>
+#include <stdio.h>
+#include <kernel/cpu.h>
+#include <kernel/env.h>
+#include <kernel/perf.h>
+
+#define MSR_PMC0		0xc1
+#define MSR_PERFEVTSEL0		0x186
+
+#define PERFEVTSEL_USR		(1 << 16)	// count in ring 3
+#define PERFEVTSEL_EN		(1 << 22)
+
+// General purpose counters in use, 0 without architectural perfmon
+static int perf_ncounters;
+
+void
+perf_init(void)
+{
+	uint32_t max, eax;
+
+	cpuid(0, &max, NULL, NULL, NULL);
+	if (max < 0xa)
+		return;
+
+	// version in bits 0-7, number of counters in bits 8-15
+	cpuid(0xa, &eax, NULL, NULL, NULL);
+	if (!(eax & 0xff))
+		return;
+
+	perf_ncounters = MIN((eax >> 8) & 0xff, PERF_NCOUNTERS);
+	cprintf("perf: %d counters\n", perf_ncounters);
+}
+
+void
+perf_init_percpu(void)
+{
+	int i;
+
+	for (i = 0; i < perf_ncounters; i++)
+		wrmsr(MSR_PERFEVTSEL0 + i, 0);
+	lcr4(rcr4() & ~CR4_PCE);
+}
+
+static inline struct EnvPerf *
+env_perf(struct Env *e)
+{
+	return &env_info(e)->env_perf;
+}
+
+void
+perf_env_init(struct Env *e)
+{
+	memset(env_perf(e), 0, sizeof(struct EnvPerf));
+}
+
+// A parent counting with PERF_INHERIT hands its events to the child
+void
+perf_env_fork(struct Env *child, struct Env *parent)
+{
+	struct EnvPerf *pp = env_perf(parent);
+	struct EnvPerf *cp = env_perf(child);
+
+	if (!(pp->ep_flags & PERF_INHERIT))
+		return;
+
+	cp->ep_flags = pp->ep_flags;
+	memcpy(cp->ep_event, pp->ep_event, sizeof(cp->ep_event));
+}
+
+// e is exiting: stop its counters and, for an inherited config, add
+// everything it and its children counted to its parent.
+void
+perf_env_free(struct Env *e)
+{
+	struct EnvPerf *ep, *pp;
+	struct Env *parent;
+	int i;
+
+	if (!perf_ncounters)
+		return;
+
+	if (e == curenv)
+		perf_switch_out(e);
+
+	ep = env_perf(e);
+	if (!(ep->ep_flags & PERF_INHERIT) || !e->env_parent_id ||
+	    envid2env(e->env_parent_id, &parent, 0) < 0)
+		return;
+
+	pp = env_perf(parent);
+	for (i = 0; i < PERF_NCOUNTERS; i++)
+		if (ep->ep_event[i] && ep->ep_event[i] == pp->ep_event[i])
+			pp->ep_child[i] += ep->ep_count[i] + ep->ep_child[i];
+}
+
+// Replace e's events and clear its counts.  e must not be running on
+// another CPU, whose counters would still hold the old events.
+// Returns the number of counters the CPU has.
+int
+perf_config(struct Env *e, const struct PerfConfig *pc)
+{
+	struct EnvPerf *ep = env_perf(e);
+	int i;
+
+	if (!perf_ncounters)
+		return -E_NOT_SUPP;
+	if (pc->pc_flags & ~(PERF_INHERIT | PERF_RDPMC))
+		return -E_INVAL;
+	for (i = 0; i < PERF_NCOUNTERS; i++) {
+		if (pc->pc_event[i] & ~0xffff)
+			return -E_INVAL;
+		if (pc->pc_event[i] && i >= perf_ncounters)
+			return -E_NOT_SUPP;
+	}
+	if (e->env_status == ENV_RUNNING && e != curenv)
+		return -E_BUSY;
+
+	if (e == curenv)
+		perf_switch_out(e);
+
+	ep->ep_flags = pc->pc_flags;
+	memcpy(ep->ep_event, pc->pc_event, sizeof(ep->ep_event));
+	memset(ep->ep_count, 0, sizeof(ep->ep_count));
+	memset(ep->ep_child, 0, sizeof(ep->ep_child));
+	ep->ep_seq++;
+
+	if (e == curenv)
+		perf_switch_in(e);
+
+	return perf_ncounters;
+}
+
+void
+perf_switch_in(struct Env *e)
+{
+	struct EnvPerf *ep;
+	int i;
+
+	if (!perf_ncounters)
+		return;
+
+	ep = env_perf(e);
+	for (i = 0; i < perf_ncounters; i++) {
+		if (!ep->ep_event[i])
+			continue;
+		wrmsr(MSR_PMC0 + i, 0);
+		wrmsr(MSR_PERFEVTSEL0 + i,
+		      ep->ep_event[i] | PERFEVTSEL_USR | PERFEVTSEL_EN);
+	}
+
+	if (ep->ep_flags & PERF_RDPMC)
+		lcr4(rcr4() | CR4_PCE);
+}
+
+void
+perf_switch_out(struct Env *e)
+{
+	struct EnvPerf *ep;
+	int i;
+
+	if (!perf_ncounters || !e)
+		return;
+
+	ep = env_perf(e);
+	for (i = 0; i < perf_ncounters; i++) {
+		if (!ep->ep_event[i])
+			continue;
+		wrmsr(MSR_PERFEVTSEL0 + i, 0);
+		ep->ep_count[i] += rdmsr(MSR_PMC0 + i);
+	}
+	// tell perf_read() in user space that the counters restarted
+	ep->ep_seq++;
+
+	if (ep->ep_flags & PERF_RDPMC)
+		lcr4(rcr4() & ~CR4_PCE);
+}
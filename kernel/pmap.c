@@ -10,6 +10,7 @@
 #include <kernel/env.h>
 #include <kernel/cpu.h>
 #include <kernel/ksymbol.h>
+#include <kernel/fpu.h>
 
 #define OS_MAX_MEMORY (256 * 1024)	/* KB */
 
@@ -160,6 +161,16 @@ mem_init(void)
 	// Make 'envs' point to an array of size 'NENV' of 'struct Env'.
 	envs = (struct Env *)boot_alloc(sizeof(struct Env) * NENV);
 
+	// And their metadata, kept apart so that scans of envs[] stay small.
+	// Both arrays share the UENVS window.
+	static_assert(sizeof(struct Env) * NENV <= UENVINFO - UENVS);
+	static_assert(sizeof(struct EnvInfo) * NENV <= UENVS + PTSIZE - UENVINFO);
+	envinfos = (struct EnvInfo *)boot_alloc(sizeof(struct EnvInfo) * NENV);
+	memset(envinfos, 0, sizeof(struct EnvInfo) * NENV);
+
+	// And their FPU register images, for kernel use only.
+	env_fpus = (struct FpuState *)boot_alloc(sizeof(struct FpuState) * NENV);
+
 	//////////////////////////////////////////////////////////////////////
 	// Now that we've allocated the initial kernel data structures, we set
 	// up the list of free physical pages. Once we've done so, all further
@@ -183,7 +194,7 @@ mem_init(void)
 	//    - pages itself -- kernel RW, user NONE
 	boot_map_region(kern_pgdir, UPAGES,
 				(sizeof(struct PageInfo) * npages),
-				PADDR(pages), PTE_U);
+				PADDR(pages), PTE_U | PTE_G);
 	cprintf("UPAGES 0x%x paddr 0x%x\n", UPAGES, PADDR(pages));
 
 	//////////////////////////////////////////////////////////////////////
@@ -194,9 +205,15 @@ mem_init(void)
 	//    - envs itself -- kernel RW, user NONE
 	boot_map_region(kern_pgdir, UENVS,
 				(sizeof(struct Env) * NENV),
-				PADDR(envs), PTE_U);
+				PADDR(envs), PTE_U | PTE_G);
 	cprintf("UENVS 0x%x paddr 0x%x\n", UENVS, PADDR(envs));
 
+	// Map 'envinfos' read-only by the user at UENVINFO, next to envs
+	boot_map_region(kern_pgdir, UENVINFO,
+				(sizeof(struct EnvInfo) * NENV),
+				PADDR(envinfos), PTE_U | PTE_G);
+	cprintf("UENVINFO 0x%x paddr 0x%x\n", UENVINFO, PADDR(envinfos));
+
 	//////////////////////////////////////////////////////////////////////
 	// Map all of physical memory at KERNBASE.
 	// Ie.  the VA range [KERNBASE, 2^32) should map to
@@ -204,14 +221,18 @@ mem_init(void)
 	// We might not have 2^32 - KERNBASE bytes of physical memory, but
 	// we just set up the mapping anyway.
 	// Permissions: kernel RW, user NONE
+	//
+	// Everything above UTOP is the same in every address space, so it
+	// is mapped PTE_G and survives the TLB flush of an address space
+	// switch (see mem_init_percpu).
 	if (1) {
 		/* could be optimized by PTE_PS */
 		boot_map_region(kern_pgdir, KERNBASE,
-						(0 - KERNBASE), 0, PTE_W);
+						(0 - KERNBASE), 0, PTE_W | PTE_G);
 	} else {
 		/* for reducing PTE overhead */
 		boot_map_region_by_hugepage(kern_pgdir, KERNBASE,
-						(0 - KERNBASE), 0, PTE_W);
+						(0 - KERNBASE), 0, PTE_W | PTE_G);
 	}
 
 	// Initialize the SMP-related parts of the memory map
@@ -228,6 +249,7 @@ mem_init(void)
 	// If the machine reboots at this point, you've probably set up your
 	// kern_pgdir wrong.
 	lcr3(PADDR(kern_pgdir));
+	mem_init_percpu();
 
 	check_page_free_list(0);
 
@@ -242,6 +264,14 @@ mem_init(void)
 	check_page_installed_pgdir();
 }
 
+// Per-CPU paging setup, run by every CPU once it is on kern_pgdir.
+// Enabling PGE keeps the PTE_G kernel mappings in the TLB across lcr3.
+void
+mem_init_percpu(void)
+{
+	lcr4(rcr4() | CR4_PGE);
+}
+
 // Modify mappings in kern_pgdir to support SMP
 //   - Map the per-CPU stacks in the region [KSTACKTOP-PTSIZE, KSTACKTOP)
 //
@@ -269,7 +299,7 @@ mem_init_mp(void)
 
 		kstacktop = KSTACKTOP - i * (KSTKSIZE + KSTKGAP);
 		boot_map_region(kern_pgdir, kstacktop - KSTKSIZE,
-			KSTKSIZE, PADDR(percpu_kstacks[i]), PTE_W);
+			KSTKSIZE, PADDR(percpu_kstacks[i]), PTE_W | PTE_G);
 
 		cprintf("KSTACKTOP_%d 0x%x - 0x%x paddr 0x%x\n",
 			i, kstacktop - KSTKSIZE, kstacktop,
@@ -536,6 +566,8 @@ out:
 	/* link page to page table entry */
 	*pt_entry = (page2pa(pp) | PTE_P | perm);
 	pgdir[PDX(va)] |= perm | PTE_P;
+	/* a remap clears PTE_A/PTE_D, which a stale TLB entry would not set again */
+	tlb_invalidate(pgdir, va);
 
 	return 0;
 }
@@ -646,7 +678,8 @@ mmio_map_region(physaddr_t pa, size_t size)
 	if (base >= MMIOLIM)
 		panic("overflow MMIOLIM");
 
-	boot_map_region(kern_pgdir, va, size, pa, PTE_PCD | PTE_PWT | PTE_W);
+	boot_map_region(kern_pgdir, va, size, pa,
+			PTE_PCD | PTE_PWT | PTE_W | PTE_G);
 	return (void *)va;
 }
 
@@ -924,6 +957,11 @@ check_kern_pgdir(void)
 	for (i = 0; i < n; i += PGSIZE)
 		assert(check_va2pa(pgdir, UENVS + i) == PADDR(envs) + i);
 
+	// check envinfos array
+	n = ROUNDUP(NENV*sizeof(struct EnvInfo), PGSIZE);
+	for (i = 0; i < n; i += PGSIZE)
+		assert(check_va2pa(pgdir, UENVINFO + i) == PADDR(envinfos) + i);
+
 	// check phys mem
 	for (i = 0; i < npages * PGSIZE; i += PGSIZE)
 		assert(check_va2pa(pgdir, KERNBASE + i) == i);
@@ -1,14 +1,15 @@
 // Simple implementation of cprintf console output for the kernel,
-// based on printfmt() and the kernel console's cputchar().
+// based on printfmt() and the kernel console's cons_putc().
 
 #include <types.h>
 #include <stdio.h>
 #include <stdarg.h>
+#include <kernel/console.h>
 
 static void
 putch(int ch, int *cnt)
 {
-	cputchar(ch);
+	cons_putc(ch);
 	++(*cnt);
 }
 
@@ -18,6 +19,8 @@ vcprintf(const char *fmt, va_list ap)
 	int cnt = 0;
 
 	vprintfmt((void *)putch, &cnt, fmt, ap);
+	// queue the whole call's output at once
+	cons_flush();
 	return cnt;
 }
 
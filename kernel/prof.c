@@ -0,0 +1,237 @@
+// Sampling profiler.
+//
+// Each CPU counts its own samples in an open-addressed table keyed by
+// (env, eip), so taking a sample touches only that CPU's cache lines
+// and never allocates.  Sampling runs in the timer interrupt and
+// draining runs in a system call or the monitor, both under the big
+// kernel lock, so the tables need no lock of their own.
+//
+// Drained eips are resolved to their function with the stabs of the
+// kernel or of the env that was sampled, so a drain only ever hands
+// out one entry per function.
+
+#include <x86.h>
+#include <error.h>
+#include <string.h>
+#include <stdio.h>
+#include <kernel/cpu.h>
+#include <kernel/env.h>
+#include <kernel/pmap.h>
+#include <kernel/kdebug.h>
+#include <kernel/prof.h>
+
+#define PROF_SLOTS	1024		// samples counted per CPU, power of 2
+#define PROF_SLOTS_MASK	(PROF_SLOTS - 1)
+#define PROF_PROBE	16		// slots tried before a sample is lost
+
+struct ProfSlot {
+	envid_t ps_env;
+	uintptr_t ps_eip;
+	uint32_t ps_count;		// 0 if the slot is free
+};
+
+struct ProfTable {
+	uint32_t pt_tick;		// ticks since the last sample
+	uint32_t pt_lost;		// samples lost to a full table
+	uint32_t pt_next;		// first slot the next drain looks at
+	struct ProfSlot pt_slots[PROF_SLOTS];
+} __aligned(CACHELINE);
+
+uint32_t prof_period;
+static struct ProfTable prof_tables[NCPU];
+
+int
+prof_start(uint32_t period)
+{
+	int i;
+
+	if (!period)
+		return -E_INVAL;
+
+	for (i = 0; i < ncpu; i++)
+		prof_tables[i].pt_tick = 0;
+	prof_period = period;
+	return 0;
+}
+
+void
+prof_stop(void)
+{
+	prof_period = 0;
+}
+
+static inline uint32_t
+prof_hash(envid_t env, uintptr_t eip)
+{
+	return ((eip >> 2) ^ ((uint32_t)env * 2654435761u)) & PROF_SLOTS_MASK;
+}
+
+// Called from every timer interrupt while prof_period is set.
+// Timer interrupts only arrive in user mode or in the idle loop, so
+// a kernel eip is always charged to env 0.
+void
+prof_tick(struct Trapframe *tf)
+{
+	struct ProfTable *pt = &prof_tables[thiscpu->cpu_id];
+	struct ProfSlot *ps;
+	envid_t env;
+	uint32_t h, i;
+
+	if (++pt->pt_tick < prof_period)
+		return;
+	pt->pt_tick = 0;
+
+	env = ((tf->tf_cs & 3) && curenv) ? curenv->env_id : 0;
+	h = prof_hash(env, tf->tf_eip);
+
+	// A drain frees slots in the middle of probe chains, so the same
+	// (env, eip) may end up counted in two slots; drains merge them.
+	for (i = 0; i < PROF_PROBE; i++) {
+		ps = &pt->pt_slots[(h + i) & PROF_SLOTS_MASK];
+		if (!ps->ps_count) {
+			ps->ps_env = env;
+			ps->ps_eip = tf->tf_eip;
+			ps->ps_count = 1;
+			return;
+		}
+		if (ps->ps_env == env && ps->ps_eip == tf->tf_eip) {
+			ps->ps_count++;
+			return;
+		}
+	}
+
+	pt->pt_lost++;
+}
+
+// Resolve 'eip' sampled in 'env' to the function containing it.
+// User eips need the env's own stabs, so its address space is loaded
+// for the lookup and the caller's is back before returning.
+static void
+prof_symbol(envid_t env, uintptr_t eip, struct ProfEntry *pe)
+{
+	struct Eipdebuginfo info;
+	struct Env *e = NULL;
+	uint32_t cr3 = rcr3();
+	int len;
+
+	pe->pe_env = env;
+	pe->pe_fn = eip;
+	pe->pe_count = 0;
+	pe->pe_name[0] = '\0';
+
+	if (eip < ULIM) {
+		// the env may have exited or exec'd since it was sampled
+		if (!env || envid2env(env, &e, 0) < 0 || !e->env_pgdir)
+			return;
+		lcr3(PADDR(e->env_pgdir));
+	}
+
+	if (debuginfo_env_eip(e, eip, &info) < 0 &&
+	    !strcmp(info.eip_fn_name, "<unknown>"))
+		goto out;
+
+	// the name lives in the env's stabs, so copy it before switching back
+	len = MIN(info.eip_fn_namelen, PROF_NAMELEN - 1);
+	memcpy(pe->pe_name, info.eip_fn_name, len);
+	pe->pe_name[len] = '\0';
+	pe->pe_fn = info.eip_fn_addr;
+
+out:
+	if (e)
+		lcr3(cr3);
+}
+
+// Add 'count' samples of 'eip' to the page, merging them with an entry
+// of the same function.  Returns false if the page is full.
+static bool
+prof_add(struct ProfPage *pp, envid_t env, uintptr_t eip, uint32_t count)
+{
+	struct ProfEntry pe;
+	uint32_t i;
+
+	prof_symbol(env, eip, &pe);
+
+	for (i = 0; i < pp->pp_count; i++) {
+		if (pp->pp_entries[i].pe_env == pe.pe_env &&
+		    pp->pp_entries[i].pe_fn == pe.pe_fn) {
+			pp->pp_entries[i].pe_count += count;
+			return true;
+		}
+	}
+
+	if (pp->pp_count == PROF_PAGE_ENTRIES)
+		return false;
+
+	pe.pe_count = count;
+	pp->pp_entries[pp->pp_count++] = pe;
+	return true;
+}
+
+static uint8_t prof_buf[PGSIZE] __aligned(PGSIZE);
+
+// Move counted samples of every CPU into the kernel page 'pp' until it
+// is full.  Returns the number of entries filled.
+static int
+prof_drain_page(struct ProfPage *pp)
+{
+	struct ProfTable *pt;
+	struct ProfSlot *ps;
+	int i;
+
+	pp->pp_count = 0;
+	pp->pp_lost = 0;
+	for (i = 0; i < ncpu; i++) {
+		pt = &prof_tables[i];
+		pp->pp_lost += pt->pt_lost;
+		pt->pt_lost = 0;
+	}
+
+	for (i = 0; i < ncpu; i++) {
+		pt = &prof_tables[i];
+		for (; pt->pt_next < PROF_SLOTS; pt->pt_next++) {
+			ps = &pt->pt_slots[pt->pt_next];
+			if (!ps->ps_count)
+				continue;
+			if (!prof_add(pp, ps->ps_env, ps->ps_eip, ps->ps_count))
+				return pp->pp_count;
+			ps->ps_count = 0;
+		}
+		pt->pt_next = 0;
+	}
+
+	return pp->pp_count;
+}
+
+// Move counted samples of every CPU into the page 'upp' of the current
+// env until it is full.  The symbol lookups switch address spaces, so
+// the samples are gathered in a kernel page and copied out at the end.
+// Returns the number of entries filled.
+int
+prof_drain(struct ProfPage *upp)
+{
+	int ret;
+
+	ret = prof_drain_page((struct ProfPage *)prof_buf);
+	memcpy(upp, prof_buf, PGSIZE);
+	return ret;
+}
+
+// Drain everything counted so far and print it, one line per function
+void
+prof_print(void)
+{
+	struct ProfPage *pp = (struct ProfPage *)prof_buf;
+	struct ProfEntry *pe;
+	uint32_t i;
+
+	cprintf("%8s %8s %8s function\n", "env", "samples", "address");
+	while (prof_drain_page(pp) > 0) {
+		if (pp->pp_lost)
+			cprintf("(%u samples lost)\n", pp->pp_lost);
+		for (i = 0; i < pp->pp_count; i++) {
+			pe = &pp->pp_entries[i];
+			cprintf("%08x %8u %08x %s\n", pe->pe_env, pe->pe_count,
+				pe->pe_fn, pe->pe_name[0] ? pe->pe_name : "?");
+		}
+	}
+}
@@ -1,4 +1,5 @@
 #include <x86.h>
+#include <error.h>
 #include <mmu.h>
 #include <kernel/env.h>
 #include <kernel/monitor.h>
@@ -6,16 +7,174 @@
 #include <kernel/cpu.h>
 #include <kernel/spinlock.h>
 #include <kernel/sched.h>
+#include <kernel/fpu.h>
+#include <kernel/trace.h>
+#include <kernel/perf.h>
+#include <kernel/console.h>
+#include <kernel/ide.h>
 
 #define LRT_STRAT 1
 
 static __noreturn void sched_halt(void);
 
+// Whether 'a' should run before 'b'
+static inline bool
+vruns_before(const struct Env *a, const struct Env *b)
+{
+	int32_t diff = a->env_vruns - b->env_vruns;
+
+	return diff < 0 || (diff == 0 && a->env_prio > b->env_prio);
+}
+
+// Schedule on a CPU dedicated to one env.  Returns, releasing the CPU,
+// if that env is gone.
+static void
+sched_dedicated(void)
+{
+	struct Env *e = &envs[ENVX(thiscpu->cpu_dedicated)];
+
+	if (e->env_id != thiscpu->cpu_dedicated || e->env_status == ENV_FREE) {
+		thiscpu->cpu_dedicated = 0;
+		return;
+	}
+
+	if (e->env_status == ENV_RUNNABLE ||
+	    (e == curenv && e->env_status == ENV_RUNNING))
+		env_run(e);
+
+	sched_halt();
+}
+
+// True if CPU 'i' is held by an env that still exists
+static bool
+cpu_held(int i)
+{
+	envid_t id = cpus[i].cpu_dedicated;
+
+	return id && envs[ENVX(id)].env_id == id &&
+	       envs[ENVX(id)].env_status != ENV_FREE;
+}
+
+// Mask of the CPUs dedicated to envs other than 'e'
+uint32_t
+sched_held_cpus(struct Env *e)
+{
+	uint32_t mask = 0;
+	int i;
+
+	for (i = 1; i < ncpu; i++)
+		if (cpu_held(i) && cpus[i].cpu_dedicated != e->env_id)
+			mask |= 1 << i;
+
+	return mask;
+}
+
+// True if an env other than 'e' may run on CPU 'cpu' only
+static bool
+cpu_needed(struct Env *e, int cpu)
+{
+	int i;
+
+	for (i = 0; i < NENV; i++) {
+		if (&envs[i] != e && envs[i].env_status != ENV_FREE &&
+		    (envs[i].env_affinity & ((1 << ncpu) - 1)) == 1 << cpu)
+			return true;
+	}
+
+	return false;
+}
+
+// Dedicate CPU 'cpu' to 'e' (it then runs only there and is never
+// preempted), or release e's CPU if 'cpu' is < 0, giving it back the
+// affinity it had before.  CPU 0 keeps the clock, so it can't be
+// dedicated, and at most half of the CPUs are dedicated at a time so
+// the others are left for everyone else.  Neither can a CPU some other
+// env is restricted to.
+int
+sched_dedicate_cpu(struct Env *e, int cpu)
+{
+	uint32_t held;
+	bool had = false;
+	int i, nheld = 0;
+
+	if (cpu >= ncpu || cpu == 0)
+		return -E_INVAL;
+
+	held = sched_held_cpus(e);
+	for (i = 1; i < ncpu; i++)
+		if (held & (1 << i))
+			nheld++;
+	if (cpu > 0 && ((held & (1 << cpu)) || nheld >= ncpu / 2 ||
+			cpu_needed(e, cpu)))
+		return -E_BUSY;
+
+	for (i = 1; i < ncpu; i++) {
+		if (cpus[i].cpu_dedicated == e->env_id) {
+			cpus[i].cpu_dedicated = 0;
+			had = true;
+		}
+	}
+
+	if (cpu > 0) {
+		if (!had)
+			e->env_base_affinity = e->env_affinity;
+		cpus[cpu].cpu_dedicated = e->env_id;
+		e->env_affinity = 1 << cpu;
+	} else if (had) {
+		e->env_affinity = e->env_base_affinity;
+	}
+
+	return 0;
+}
+
+// Set the priority class of 'e', dropping any inherited one.
+void
+sched_set_priority(struct Env *e, int prio)
+{
+	e->env_base_prio = prio;
+	e->env_prio = prio;
+	e->env_boost_from = 0;
+}
+
+// IPC priority inheritance: 'server' has received a request from
+// 'client', so it runs at the client's class, and on its credit, until
+// it replies to that client (sched_ipc_unboost).
+void
+sched_ipc_boost(struct Env *server, struct Env *client)
+{
+	if (client->env_prio <= server->env_prio)
+		return;
+
+	server->env_prio = client->env_prio;
+	server->env_boost_from = client->env_id;
+	if ((int32_t)(server->env_vruns - client->env_vruns) > 0)
+		server->env_vruns = client->env_vruns;
+}
+
+// 'server' is sending to 'dst'.  Its reply to the client it inherited
+// its class from gives that class back, as does any send once that
+// client is gone.
+void
+sched_ipc_unboost(struct Env *server, struct Env *dst)
+{
+	struct Env *client;
+
+	if (!server->env_boost_from)
+		return;
+	if (server->env_boost_from != dst->env_id &&
+	    envid2env(server->env_boost_from, &client, 0) == 0)
+		return;
+
+	server->env_prio = server->env_base_prio;
+	server->env_boost_from = 0;
+}
+
 // Choose a user environment to run and run it.
 void
 sched_yield(void)
 {
 	struct Env *idle, *min_env = NULL;
+	uint8_t mask;
 	int i, j;
 
 	// Implement simple round-robin scheduling.
@@ -33,15 +192,24 @@ sched_yield(void)
 	// no runnable environments, simply drop through to the code
 	// below to halt the cpu.
 	idle = curenv;
+	trace(TRACE_SCHED, idle ? idle->env_id : 0, 0, 0, 0);
+
 	i = idle ? (ENVX(idle->env_id) + 1) % NENV : 0;
+	mask = 1 << thiscpu->cpu_id;
+
+	// A dedicated CPU runs its env or nothing
+	if (thiscpu->cpu_dedicated)
+		sched_dedicated();
 
 #ifdef LRT_STRAT
-	/* Least-Run-Time Schedule */
+	/*
+	 * Least-Run-Time Schedule, weighted by priority class (see
+	 * ENV_PRIO_STRIDE); the higher class wins a tie.
+	 */
 	for (j = 0; j < NENV; j++, i = (i + 1) % NENV) {
-		if (envs[i].env_status == ENV_RUNNABLE) {
-			if (min_env)
-				min_env = envs[i].env_runs < min_env->env_runs ? (envs + i) : min_env;
-			else
+		if (envs[i].env_status == ENV_RUNNABLE &&
+		    (envs[i].env_affinity & mask)) {
+			if (!min_env || vruns_before(&envs[i], min_env))
 				min_env = envs + i;
 		}
 	}
@@ -50,13 +218,14 @@ sched_yield(void)
 #else
 	/* Round Robin Schedule */
 	for (j = 0; j < NENV; j++, i = (i + 1) % NENV) {
-		if (envs[i].env_status == ENV_RUNNABLE)
+		if (envs[i].env_status == ENV_RUNNABLE &&
+		    (envs[i].env_affinity & mask))
 			env_run(envs + i);
 	}
 #endif
 
 	/* If there is no other runnable task, run current task. */
-	if (idle && idle->env_status == ENV_RUNNING)
+	if (idle && idle->env_status == ENV_RUNNING && (idle->env_affinity & mask))
 		env_run(idle);
 
 	// sched_halt never returns
@@ -78,14 +247,19 @@ sched_halt(void)
 			envs[i].env_status == ENV_DYING)
 			break;
 	}
-	if (i == NENV) {
+	// An env waiting for console input or a disk transfer is woken
+	// by an interrupt
+	if (i == NENV && !cons_waiting() && !ide_waiting()) {
 		cprintf("No runnable environments in the system!\n");
 		while (1)
 			monitor(NULL);
 	}
 
 	// Mark that no environment is running on this CPU
-	curenv = NULL;
+	env_account_halt();
+	fpu_switch_out(curenv);
+	perf_switch_out(curenv);
+	thiscpu->cpu_env = NULL;
 	lcr3(PADDR(kern_pgdir));
 
 	// Mark that this CPU is in the HALT state, so that when
@@ -2,19 +2,25 @@
 #include <memlayout.h>
 #include <assert.h>
 #include <string.h>
+#include <stdio.h>
+#include <error.h>
 #include <kernel/spinlock.h>
 #include <kernel/cpu.h>
 #include <kernel/kdebug.h>
 
 // The big kernel lock
 struct spinlock kernel_lock = {
-	.locked = 0,
-#ifdef DEBUG_SPINLOCK
+	.next = 0,
+	.owner = 0,
 	.name = "kernel_lock",
+#ifdef DEBUG_SPINLOCK
 	.cpu = NULL,
 #endif
 };
 
+static struct spinlock *spinlocks[NSPINLOCK] = { &kernel_lock };
+static int nspinlock = 1;
+
 #ifdef DEBUG_SPINLOCK
 // Record the current call stack in pcs[] by following the %ebp chain.
 static void
@@ -39,39 +45,61 @@ get_caller_pcs(uint32_t pcs[])
 static int
 holding(struct spinlock *lock)
 {
-	return lock->locked && lock->cpu == thiscpu;
+	return lock->next != lock->owner && lock->cpu == thiscpu;
 }
 #endif
 
 void
 __spin_initlock(struct spinlock *lk, char *name)
 {
-	lk->locked = 0;
-
-#ifdef DEBUG_SPINLOCK
+	memset(lk, 0, sizeof(*lk));
 	lk->name = name;
-	lk->cpu = NULL;
-#endif
+
+	if (nspinlock < NSPINLOCK)
+		spinlocks[nspinlock++] = lk;
 }
 
 // Acquire the lock.
-// Loops (spins) until the lock is acquired.
+// Takes a ticket and loops (spins) until the holder hands the lock to it.
 // Holding a lock for a long time may cause
 // other CPUs to waste time spinning to acquire it.
 void
 spin_lock(struct spinlock *lk)
 {
+	uint32_t ticket;
+#ifdef SPINLOCK_STATS
+	uint64_t start = 0;
+#endif
+
 #ifdef DEBUG_SPINLOCK
 	if (holding(lk))
 		panic("CPU %d cannot acquire %s: already holding",
-				cpunum(), lk->name);
+				thiscpu->cpu_id, lk->name);
 #endif
 
-	// The xchg is atomic.
+	// The xadd is atomic.
 	// It also serializes, so that reads after acquire are not
-	// reordered before it.
-	while (xchg(&lk->locked, 1) != 0)
-		asm volatile("pause");
+	// reordered before it.  Every waiter spins reading 'owner' in its
+	// own cache and only the next in line leaves the loop on a release.
+	ticket = xadd(&lk->next, 1);
+	if (lk->owner != ticket) {
+#ifdef SPINLOCK_STATS
+		start = read_tsc();
+#endif
+		while (lk->owner != ticket)
+			asm volatile("pause");
+	}
+	// x86 doesn't reorder loads, so only the compiler needs telling
+	asm volatile("" : : : "memory");
+
+#ifdef SPINLOCK_STATS
+	lk->hold_start = read_tsc();
+	lk->acquired++;
+	if (start) {
+		lk->contended++;
+		lk->spin_cycles += lk->hold_start - start;
+	}
+#endif
 
 #ifdef DEBUG_SPINLOCK
 	// Record info about lock acquisition for debugging.
@@ -84,6 +112,10 @@ spin_lock(struct spinlock *lk)
 void
 spin_unlock(struct spinlock *lk)
 {
+#ifdef SPINLOCK_STATS
+	uint64_t hold;
+#endif
+
 #ifdef DEBUG_SPINLOCK
 	if (!holding(lk)) {
 		int i;
@@ -92,12 +124,12 @@ spin_unlock(struct spinlock *lk)
 		// Nab the acquiring EIP chain before it gets released
 		memmove(pcs, lk->pcs, sizeof(pcs));
 
-		if (!lk->locked)
+		if (lk->next == lk->owner)
 			cprintf("The lock isn't holding!\n");
 		else
 			cprintf("CPU %d cannot release %s: held by CPU %d\n"
 					"Acquired at:\n",
-					cpunum(), lk->name, lk->cpu->cpu_id);
+					thiscpu->cpu_id, lk->name, lk->cpu->cpu_id);
 
 		for (i = 0; i < DEBUG_PCS && pcs[i]; i++) {
 			struct Eipdebuginfo info;
@@ -117,10 +149,43 @@ spin_unlock(struct spinlock *lk)
 	lk->cpu = NULL;
 #endif
 
-	// The xchg instruction is atomic (i.e. uses the "lock" prefix) with
-	// respect to any other instruction which references the same memory.
-	// x86 CPUs will not reorder loads/stores across locked instructions
-	// (vol 3, 8.2.2). Because xchg() is implemented using asm volatile,
-	// gcc will not reorder C statements across the xchg.
-	xchg(&lk->locked, 0);
+#ifdef SPINLOCK_STATS
+	hold = read_tsc() - lk->hold_start;
+	if (hold > lk->max_hold)
+		lk->max_hold = hold;
+#endif
+
+	// Only the holder writes 'owner', so a plain store hands the lock
+	// to the next ticket.  x86 CPUs don't reorder stores with earlier
+	// loads or stores (vol 3, 8.2.2); the barrier keeps gcc from
+	// moving the critical section past the store either.
+	asm volatile("" : : : "memory");
+	lk->owner = lk->owner + 1;
+}
+
+// Print the statistics of every registered lock into 'buf'.
+// Returns the length of the text, or -E_NOT_SUPP without SPINLOCK_STATS.
+int
+spin_debug_info(char *buf, size_t size)
+{
+#ifdef SPINLOCK_STATS
+	struct spinlock *lk;
+	int i, ret;
+
+	ret = snprintf(buf, size, "%-16s %12s %12s %12s %12s\n", "lock",
+		       "acquired", "contended", "spin/wait", "max hold");
+
+	for (i = 0; i < nspinlock && ret < size; i++) {
+		lk = spinlocks[i];
+		ret += snprintf(buf + ret, size - ret,
+				"%-16s %12llu %12llu %12llu %12llu\n",
+				lk->name, lk->acquired, lk->contended,
+				lk->contended ? lk->spin_cycles / lk->contended : 0,
+				lk->max_hold);
+	}
+
+	return MIN(ret, size);
+#else
+	return -E_NOT_SUPP;
+#endif
 }
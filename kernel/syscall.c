@@ -12,10 +12,23 @@
 #include <kernel/pmap.h>
 #include <kernel/console.h>
 #include <kernel/sched.h>
+#include <kernel/trace.h>
+#include <kernel/prof.h>
+#include <kernel/perf.h>
 #include <kernel/env.h>
 #include <kernel/time.h>
 #include <kernel/e1000.h>
+#include <kernel/ide.h>
 #include <kernel/syscall.h>
+#include <kernel/fpu.h>
+#include <kernel/spinlock.h>
+
+// The fs and ns servers may change the scheduling of other envs.
+static bool
+env_privileged(struct Env *e)
+{
+	return e->env_type == ENV_TYPE_FS || e->env_type == ENV_TYPE_NS;
+}
 
 // Print a string to the system console.
 // The string is exactly 'len' characters long.
@@ -41,6 +54,42 @@ sys_cgetc(void)
 	return cons_getc();
 }
 
+// Read console input into 'buf', blocking until there is some.
+// Returns the number of bytes read, 0 at end of file.  Errors are:
+//	-E_NO_MEM if too many environments are waiting for input already.
+static int
+sys_cons_read(char *buf, size_t n)
+{
+	int ret;
+
+	if (!n)
+		return 0;
+
+	user_mem_assert(curenv, buf, n, PTE_U | PTE_W);
+
+	ret = cons_read(buf, n);
+	if (ret != -E_BUSY)
+		return ret;
+
+	ret = cons_wait(curenv);
+	if (ret < 0)
+		return ret;
+
+	// Once input wakes us up, run the 'int $T_SYSCALL' again
+	curenv->env_tf.tf_eip -= 2;
+
+	/* not return */
+	sched_yield();
+}
+
+// Set the console line discipline to 'mode' (CONS_* flags).
+// Returns the old mode, or -E_INVAL if mode is invalid.
+static int
+sys_cons_mode(int mode)
+{
+	return cons_set_mode(mode);
+}
+
 // Returns the current environment's envid.
 static envid_t
 sys_getenvid(void)
@@ -98,8 +147,13 @@ sys_exofork(void)
 	env->env_tf = curenv->env_tf;
 	env->env_status = ENV_NOT_RUNNABLE;
 	env->env_tf.tf_regs.reg_eax = 0;	/* return 0 back to child */
-	strcpy(env->currentpath, curenv->currentpath);
-	env->binaryname[0] = '\0';
+	fpu_env_copy(env, curenv);
+	perf_env_fork(env, curenv);
+	/* the child starts out with its parent's class and run time */
+	sched_set_priority(env, curenv->env_base_prio);
+	env->env_vruns = curenv->env_vruns;
+	strcpy(env_info(env)->currentpath, env_info(curenv)->currentpath);
+	env_info(env)->binaryname[0] = '\0';
 
 	return env->env_id;
 }
@@ -126,7 +180,10 @@ sys_env_set_status(envid_t envid, int status)
 	if (envid2env(envid, &env, 1) < 0)
 		return -E_BAD_ENV;
 
-	env->env_status = status;
+	if (status == ENV_RUNNABLE)
+		env_ready(env);
+	else
+		env->env_status = status;
 	return 0;
 }
 
@@ -391,7 +448,18 @@ sys_ipc_try_send(envid_t envid, int value,
 	env->env_ipc_from = curenv->env_id;
 	env->env_ipc_recving = false;
 
-	env->env_status = ENV_RUNNABLE;
+	env_ready(env);
+	trace(TRACE_IPC_SEND, env->env_id, value, srcva, env->env_ipc_perm);
+	env_stat(curenv)->es_ipc_sent++;
+	env_stat(env)->es_ipc_recv++;
+
+	// A server now works on a request of curenv
+	if (env_privileged(env))
+		sched_ipc_boost(env, curenv);
+
+	// A send is how a server replies: give back the class inherited
+	// from this client
+	sched_ipc_unboost(curenv, env);
 
 	return 0;
 }
@@ -413,6 +481,7 @@ sys_ipc_recv(void *dstva)
 	if (((uint32_t)dstva % PGSIZE) || ((uint32_t)dstva >= UTOP))
 		return -E_INVAL;
 
+	trace(TRACE_IPC_RECV, dstva, 0, 0, 0);
 	curenv->env_ipc_recving = true;
 	curenv->env_ipc_dstva = dstva;
 
@@ -442,6 +511,8 @@ sys_debug_info(int option, char *buf, size_t size)
 	int i, ret = 0;
 	struct PageInfo *p = page_free_list;
 	char temp[64];
+	uint64_t usage;
+	struct DebugEnvStat *rec;
 
 	switch (option) {
 	case CPU_INFO:
@@ -451,7 +522,8 @@ sys_debug_info(int option, char *buf, size_t size)
 			snprintf(temp, sizeof(temp), "%3d %8s %8x %s\n",
 					cpus[i].cpu_id, cpu_status[cpus[i].cpu_status],
 					cpus[i].cpu_env ? cpus[i].cpu_env->env_id : 0,
-					cpus[i].cpu_env ? cpus[i].cpu_env->binaryname : "NULL");
+					cpus[i].cpu_env ?
+						env_info(cpus[i].cpu_env)->binaryname : "NULL");
 			strcat(buf, temp);
 		}
 
@@ -461,12 +533,39 @@ sys_debug_info(int option, char *buf, size_t size)
 		for (i = 0; p != NULL; i++)
 			p = p->pp_link;
 
+		// in millionths of a percent; the kernel doesn't touch the FPU
+		usage = (uint64_t)(npages - i) * 100 * 1000000 / npages;
 		ret = snprintf(buf, size,
 					"Total pages: %d\n"
 					" Free pages: %d\n"
 					" Used pages: %d\n"
-					"      Usage: %f%%\n",
-					npages, i, npages - i, (float)(npages - i) * 100 / npages);
+					"      Usage: %u.%06u%%\n",
+					npages, i, npages - i,
+					(uint32_t)(usage / 1000000),
+					(uint32_t)(usage % 1000000));
+		break;
+
+	case ENV_STAT:
+		user_mem_assert(curenv, buf, size, PTE_U | PTE_W);
+
+		rec = (struct DebugEnvStat *)buf;
+		for (i = 0; i < NENV; i++) {
+			if (envs[i].env_status == ENV_FREE)
+				continue;
+			if (ret + sizeof(*rec) > size)
+				break;
+
+			rec->ds_env = envs[i].env_id;
+			rec->ds_runs = envs[i].env_runs;
+			rec->ds_stat = envinfos[i].env_stat;
+			rec++;
+			ret += sizeof(*rec);
+		}
+		break;
+
+	case LOCK_INFO:
+		user_mem_assert(curenv, buf, size, PTE_U | PTE_W);
+		ret = spin_debug_info(buf, size);
 		break;
 
 	default:
@@ -517,11 +616,35 @@ sys_rx_pkt(uint8_t *content, uint32_t length)
 	return e1000_get_rx_desc(content, length);
 }
 
+// Run the ATA DMA command 'cmd' on the 'len' bytes at 'va', the task
+// file of the primary IDE channel being set up for it, blocking until
+// the transfer is done.  Only the file system server drives the disk.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if the caller is not the file system server.
+//	-E_IO if the transfer failed.
+//	the errors of ide_dma, before the transfer starts.
+static int
+sys_ide_dma(int cmd, const void *va, size_t len)
+{
+	int ret;
+
+	if (curenv->env_type != ENV_TYPE_FS)
+		return -E_BAD_ENV;
+
+	ret = ide_dma(curenv, cmd, va, len);
+	if (ret < 0)
+		return ret;
+
+	/* not return: the interrupt sets the result */
+	sched_yield();
+}
+
 static int
 sys_chdir(const char *path)
 {
 	user_mem_assert(curenv, path, strlen(path) + 1, PTE_U);
-	strcpy(curenv->currentpath, path);
+	strcpy(env_info(curenv)->currentpath, path);
 	return 0;
 }
 
@@ -543,6 +666,7 @@ sys_copy_vma(envid_t src_env, envid_t dst_env)
 {
 	int i, ret;
 	struct Env *src_e, *dst_e;
+	struct EnvInfo *src, *dst;
 
 	ret = envid2env(src_env, &src_e, 1);
 	if (ret)
@@ -552,9 +676,11 @@ sys_copy_vma(envid_t src_env, envid_t dst_env)
 	if (ret)
 		return ret;
 
-	for (i = 0; i < src_e->vma_valid; i++)
-		dst_e->vma[i] = src_e->vma[i];
-	dst_e->vma_valid = src_e->vma_valid;
+	src = env_info(src_e);
+	dst = env_info(dst_e);
+	for (i = 0; i < src->vma_valid; i++)
+		dst->vma[i] = src->vma[i];
+	dst->vma_valid = src->vma_valid;
 
 	return 0;
 }
@@ -570,15 +696,185 @@ sys_env_name(envid_t envid, const char *name)
 		return ret;
 
 	user_mem_assert(curenv, name, strlen(name) + 1, PTE_U);
-	strcpy(env->binaryname, name);
+	strcpy(env_info(env)->binaryname, name);
+	return 0;
+}
+
+// Set the scheduling priority class of envid (one of ENV_PRIO_*).
+// Any env may lower the class of itself or its children; only the fs
+// and ns servers may raise it.
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid.
+//	-E_INVAL if prio is not a valid priority class.
+static int
+sys_env_set_priority(envid_t envid, int prio)
+{
+	int ret;
+	struct Env *env;
+
+	if (prio < 0 || prio >= NENVPRIO)
+		return -E_INVAL;
+
+	ret = envid2env(envid, &env, 1);
+	if (ret)
+		return ret;
+
+	if (prio > env->env_base_prio && !env_privileged(curenv))
+		return -E_BAD_ENV;
+
+	sched_set_priority(env, prio);
+	return 0;
+}
+
+// Restrict envid to the CPUs in cpumask (bit i for CPU i), leaving out
+// those dedicated to other envs.  This also gives up any CPU dedicated
+// to envid.
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid.
+//	-E_INVAL if cpumask contains no existing CPU that isn't dedicated
+//		to another env.
+static int
+sys_env_set_affinity(envid_t envid, uint32_t cpumask)
+{
+	int ret;
+	struct Env *env;
+
+	static_assert(NCPU <= 8 * sizeof(env->env_affinity));
+
+	ret = envid2env(envid, &env, 1);
+	if (ret)
+		return ret;
+
+	cpumask &= ((1 << ncpu) - 1) & ~sched_held_cpus(env);
+	if (!cpumask)
+		return -E_INVAL;
+
+	sched_dedicate_cpu(env, -1);
+	env->env_affinity = cpumask;
 	return 0;
 }
 
+// Give CPU 'cpu' to envid alone: envid only runs there, nothing else
+// does, and the timer never preempts it.  A negative 'cpu' releases
+// the CPU envid holds (the env may then run where it could before).
+// Only the fs and ns servers may dedicate CPUs.
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid.
+//	-E_INVAL if cpu doesn't exist or is CPU 0, which runs the clock.
+//	-E_BUSY if cpu is already dedicated to another env, another env
+//		may run on cpu only, or half of the CPUs already are.
+static int
+sys_env_dedicate_cpu(envid_t envid, int cpu)
+{
+	int ret;
+	struct Env *env;
+
+	ret = envid2env(envid, &env, 1);
+	if (ret)
+		return ret;
+	if (cpu >= 0 && !env_privileged(curenv))
+		return -E_BAD_ENV;
+
+	return sched_dedicate_cpu(env, cpu < 0 ? -1 : cpu);
+}
+
+// Control kernel event tracing (see include/trace.h):
+//	TRACE_MASK: enable the events in mask 'arg', returning the old mask.
+//	TRACE_DRAIN: move pending events into the page at 'arg', laid out
+//		as struct TracePage, returning how many were moved.
+// Errors are:
+//	-E_INVAL if op is unknown, or arg isn't a page-aligned address
+//		below UTOP for TRACE_DRAIN.
+static int
+sys_trace(int op, uint32_t arg)
+{
+	uint32_t old;
+
+	switch (op) {
+	case TRACE_MASK:
+		old = trace_mask;
+		trace_mask = arg & TRACE_ALL;
+		return old;
+
+	case TRACE_DRAIN:
+		if ((arg % PGSIZE) || arg >= UTOP)
+			return -E_INVAL;
+		user_mem_assert(curenv, (void *)arg, PGSIZE, PTE_U | PTE_W);
+		return trace_drain((struct TracePage *)arg);
+
+	default:
+		return -E_INVAL;
+	}
+}
+
+// Control the sampling profiler (see include/prof.h):
+//	PROF_START: sample every 'arg' timer ticks on every CPU.
+//	PROF_STOP: stop sampling; counted samples stay until drained.
+//	PROF_DRAIN: move counted samples, resolved to functions, into the
+//		page at 'arg', laid out as struct ProfPage, returning how
+//		many entries were filled.
+// Errors are:
+//	-E_INVAL if op is unknown, 'arg' is 0 for PROF_START, or arg isn't
+//		a page-aligned address below UTOP for PROF_DRAIN.
+static int
+sys_prof(int op, uint32_t arg)
+{
+	switch (op) {
+	case PROF_START:
+		return prof_start(arg);
+
+	case PROF_STOP:
+		prof_stop();
+		return 0;
+
+	case PROF_DRAIN:
+		if ((arg % PGSIZE) || arg >= UTOP)
+			return -E_INVAL;
+		user_mem_assert(curenv, (void *)arg, PGSIZE, PTE_U | PTE_W);
+		return prof_drain((struct ProfPage *)arg);
+
+	default:
+		return -E_INVAL;
+	}
+}
+
+// Set the performance counter events of env 'envid' from 'upc', or
+// stop its counting if 'upc' is NULL, and clear its counts.
+// Returns the number of counters the CPU has.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid.
+//	-E_INVAL if a flag or event is invalid.
+//	-E_NOT_SUPP if the CPU has no counters, or fewer than configured.
+//	-E_BUSY if envid is running on another CPU.
+static int
+sys_env_set_perf(envid_t envid, const struct PerfConfig *upc)
+{
+	struct PerfConfig pc = { 0 };
+	struct Env *env;
+	int ret;
+
+	ret = envid2env(envid, &env, 1);
+	if (ret < 0)
+		return ret;
+
+	if (upc) {
+		user_mem_assert(curenv, upc, sizeof(*upc), PTE_U);
+		pc = *upc;
+	}
+
+	return perf_config(env, &pc);
+}
+
 // Dispatches to the correct kernel function, passing the arguments.
 int
 syscall(uint32_t syscallno, uint32_t a1, uint32_t a2,
 		uint32_t a3, uint32_t a4, uint32_t a5)
 {
+	trace(TRACE_SYSCALL, syscallno, a1, a2, a3);
+
 	// Call the function corresponding to the 'syscallno' parameter.
 	// Return any appropriate return value.
 	switch (syscallno) {
@@ -649,6 +945,33 @@ syscall(uint32_t syscallno, uint32_t a1, uint32_t a2,
 	case SYS_env_name:
 		return sys_env_name(a1, (const char *)a2);
 
+	case SYS_env_set_priority:
+		return sys_env_set_priority(a1, a2);
+
+	case SYS_env_set_affinity:
+		return sys_env_set_affinity(a1, a2);
+
+	case SYS_env_dedicate_cpu:
+		return sys_env_dedicate_cpu(a1, a2);
+
+	case SYS_trace:
+		return sys_trace(a1, a2);
+
+	case SYS_prof:
+		return sys_prof(a1, a2);
+
+	case SYS_env_set_perf:
+		return sys_env_set_perf(a1, (const struct PerfConfig *)a2);
+
+	case SYS_cons_read:
+		return sys_cons_read((char *)a1, a2);
+
+	case SYS_cons_mode:
+		return sys_cons_mode(a1);
+
+	case SYS_ide_dma:
+		return sys_ide_dma(a1, (const void *)a2, a3);
+
 	default:
 		return -E_INVAL;
 	}
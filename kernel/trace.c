@@ -0,0 +1,96 @@
+// Per-CPU event trace rings.
+//
+// Every ring has a single producer, the CPU it belongs to, and a single
+// consumer, trace_drain().  The producer only moves tr_head and the
+// consumer only moves tr_tail, each after touching the entries, so no
+// lock is needed.  A full ring drops new events rather than overwrite
+// ones the consumer may be copying.
+
+#include <x86.h>
+#include <error.h>
+#include <kernel/cpu.h>
+#include <kernel/env.h>
+#include <kernel/trace.h>
+
+#define TRACE_RING_SIZE	512		// events per CPU, power of 2
+#define TRACE_RING_MASK	(TRACE_RING_SIZE - 1)
+
+struct TraceRing {
+	volatile uint32_t tr_head;	// next entry the CPU fills
+	volatile uint32_t tr_tail;	// next entry to drain
+	volatile uint32_t tr_dropped;	// events lost to a full ring
+	uint32_t tr_dropped_seen;	// tr_dropped at the last drain
+	struct TraceEvent tr_events[TRACE_RING_SIZE];
+} __aligned(CACHELINE);
+
+uint32_t trace_mask;
+static struct TraceRing trace_rings[NCPU];
+
+#define trace_barrier()	asm volatile("" : : : "memory")
+
+void
+trace_log(int event, uint32_t a0, uint32_t a1, uint32_t a2, uint32_t a3)
+{
+	struct TraceRing *r = &trace_rings[thiscpu->cpu_id];
+	uint32_t head = r->tr_head;
+	struct TraceEvent *te;
+
+	if (head - r->tr_tail >= TRACE_RING_SIZE) {
+		r->tr_dropped++;
+		return;
+	}
+
+	te = &r->tr_events[head & TRACE_RING_MASK];
+	te->te_tsc = read_tsc();
+	te->te_event = event;
+	te->te_cpu = thiscpu->cpu_id;
+	te->te_env = curenv ? curenv->env_id : 0;
+	te->te_arg[0] = a0;
+	te->te_arg[1] = a1;
+	te->te_arg[2] = a2;
+	te->te_arg[3] = a3;
+
+	// publish the entry only once it is complete
+	trace_barrier();
+	r->tr_head = head + 1;
+}
+
+// Move up to a page worth of pending events, taken from every CPU in
+// turn, into 'tp'.  Returns the number of events moved.
+int
+trace_drain(struct TracePage *tp)
+{
+	struct TraceRing *r;
+	uint32_t head, tail, dropped;
+	int i, n = 0;
+	bool more = true;
+
+	tp->tp_dropped = 0;
+	for (i = 0; i < ncpu; i++) {
+		r = &trace_rings[i];
+		dropped = r->tr_dropped;
+		tp->tp_dropped += dropped - r->tr_dropped_seen;
+		r->tr_dropped_seen = dropped;
+	}
+
+	while (more && n < TRACE_PAGE_EVENTS) {
+		more = false;
+		for (i = 0; i < ncpu && n < TRACE_PAGE_EVENTS; i++) {
+			r = &trace_rings[i];
+			head = r->tr_head;
+			tail = r->tr_tail;
+			if (tail == head)
+				continue;
+
+			// read the entry only after seeing it published
+			trace_barrier();
+			tp->tp_events[n++] = r->tr_events[tail & TRACE_RING_MASK];
+			trace_barrier();
+			r->tr_tail = tail + 1;
+			more = true;
+		}
+	}
+
+	tp->tp_count = n;
+	return n;
+}
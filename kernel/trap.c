@@ -13,6 +13,10 @@
 #include <kernel/console.h>
 #include <kernel/time.h>
 #include <kernel/trap.h>
+#include <kernel/fpu.h>
+#include <kernel/trace.h>
+#include <kernel/prof.h>
+#include <kernel/ide.h>
 
 static int debug;
 
@@ -100,6 +104,7 @@ trap_init(void)
 	SETGATE(idt[IRQ_OFFSET + IRQ_SERIAL], 0, GD_KT, irqhandler_4, 3);
 	SETGATE(idt[IRQ_OFFSET + IRQ_SPURIOUS], 0, GD_KT, irqhandler_7, 3);
 	SETGATE(idt[IRQ_OFFSET + IRQ_IDE], 0, GD_KT, irqhandler_14, 3);
+	SETGATE(idt[IRQ_OFFSET + IRQ_IDE2], 0, GD_KT, irqhandler_15, 3);
 	SETGATE(idt[IRQ_OFFSET + IRQ_ERROR], 0, GD_KT, irqhandler_19, 3);
 
 	// Per-CPU setup
@@ -158,7 +163,7 @@ static const char *trapname(int trapno)
 void
 print_trapframe(struct Trapframe *tf)
 {
-	cprintf("TRAP frame at %p from CPU %d\n", tf, cpunum());
+	cprintf("TRAP frame at %p from CPU %d\n", tf, thiscpu->cpu_id);
 	print_regs(&tf->tf_regs);
 	cprintf("  es   0x----%04x\n", tf->tf_es);
 	cprintf("  ds   0x----%04x\n", tf->tf_ds);
@@ -214,6 +219,8 @@ page_fault_handler(struct Trapframe *tf)
 
 	// We've already handled kernel-mode exceptions, so if we get here,
 	// the page fault happened in user mode.
+	env_stat(curenv)->es_pgfaults++;
+	trace(TRACE_PGFAULT, fault_va, tf->tf_eip, tf->tf_err, 0);
 	//
 	// Call the environment's page fault upcall, if one exists.  Set up a
 	// page fault stack frame on the user exception stack (below
@@ -313,6 +320,10 @@ trap_dispatch(struct Trapframe *tf)
 		monitor(tf);
 		break;
 
+	case T_DEVICE:
+		fpu_trap(tf);
+		break;
+
 	case T_SYSCALL:
 		ret = syscall(
 				tf->tf_regs.reg_eax,
@@ -334,6 +345,14 @@ trap_dispatch(struct Trapframe *tf)
 		// Handle clock interrupts. Don't forget to acknowledge the
 		// interrupt using lapic_eoi() before calling the scheduler.
 		lapic_eoi();
+
+		if (prof_period)
+			prof_tick(tf);
+
+		// A dedicated CPU never preempts its env
+		if (curenv && curenv->env_id == thiscpu->cpu_dedicated)
+			break;
+
 		sched_yield();
 		break;
 
@@ -354,6 +373,13 @@ trap_dispatch(struct Trapframe *tf)
 		serial_intr();
 		break;
 
+	// Bus-master DMA completion; the slave 8259A needs an EOI
+	case IRQ_OFFSET + IRQ_IDE:
+	case IRQ_OFFSET + IRQ_IDE2:
+		ide_intr(tf->tf_trapno - IRQ_OFFSET);
+		irq_eoi();
+		break;
+
 	default:
 		// Unexpected trap: The user process or the kernel has a bug.
 		print_trapframe(tf);
@@ -371,6 +397,25 @@ trap_dispatch(struct Trapframe *tf)
 	}
 }
 
+/*
+ * Save the state of a system call.  'int $T_SYSCALL' can only come from
+ * user code on the user stack, whose selectors env_tf already holds
+ * (env_alloc sets them and sys_env_set_trapframe never changes them),
+ * so only what user space can change is copied.
+ */
+static void
+trap_save_syscall(struct Trapframe *etf, const struct Trapframe *tf)
+{
+	etf->tf_regs = tf->tf_regs;
+	etf->tf_es = tf->tf_es;
+	etf->tf_ds = tf->tf_ds;
+	etf->tf_trapno = T_SYSCALL;
+	etf->tf_err = 0;
+	etf->tf_eip = tf->tf_eip;
+	etf->tf_eflags = tf->tf_eflags;
+	etf->tf_esp = tf->tf_esp;
+}
+
 void
 trap(struct Trapframe *tf)
 {
@@ -390,10 +435,12 @@ trap(struct Trapframe *tf)
 
 	if ((tf->tf_cs & 3) == 3) {
 		// Trapped from user mode.
+		assert(curenv);
+		env_account_trap();
+
 		// Acquire the big kernel lock before doing any
 		// serious kernel work.
 		lock_kernel();
-		assert(curenv);
 
 		/*
 		 * Garbage collect when next time-interrupt comes
@@ -401,7 +448,7 @@ trap(struct Trapframe *tf)
 		 */
 		if (curenv->env_status == ENV_DYING) {
 			env_free(curenv);
-			curenv = NULL;
+			thiscpu->cpu_env = NULL;
 			sched_yield();
 		}
 
@@ -409,7 +456,10 @@ trap(struct Trapframe *tf)
 		// into 'curenv->env_tf', so that running the environment
 		// will restart at the trap point.
 		/* save trap_frame into curenv */
-		curenv->env_tf = *tf;
+		if (tf->tf_trapno == T_SYSCALL)
+			trap_save_syscall(&curenv->env_tf, tf);
+		else
+			curenv->env_tf = *tf;
 
 		// The trapframe on the stack should be ignored from here on.
 		tf = &curenv->env_tf;
@@ -65,25 +65,8 @@ opencons(void)
 static ssize_t
 devcons_read(struct Fd *fd, void *vbuf, size_t n)
 {
-	int c;
-
-	if (n == 0)
-		return 0;
-
-	while (1) {
-		c = sys_cgetc();
-		if (c)
-			break;
-		sys_yield();
-	}
-
-	if (c < 0)
-		return c;
-	if (c == 0x04)	// ctl-d is eof
-		return 0;
-
-	*(char *)vbuf = c;
-	return 1;
+	// sleeps until there is input; ctl-d reads as eof
+	return sys_cons_read(vbuf, n);
 }
 
 static ssize_t
@@ -144,6 +144,28 @@ devfile_trunc(struct Fd *fd, off_t newsize)
 	return fsipc(FSREQ_SET_SIZE, NULL);
 }
 
+// Allocate disk space for bytes [offset, offset + len) of an open file,
+// extending it if necessary, so writing them cannot run out of space.
+int
+fallocate(int fdnum, off_t offset, off_t len)
+{
+	int ret;
+	struct Fd *fd;
+
+	ret = fd_lookup(fdnum, &fd);
+	if (ret < 0)
+		return ret;
+
+	if (fd->fd_dev_id != devfile.dev_id)
+		return -E_NOT_SUPP;
+
+	fsipcbuf.fallocate.req_fileid = fd->fd_file.id;
+	fsipcbuf.fallocate.req_offset = offset;
+	fsipcbuf.fallocate.req_len = len;
+
+	return fsipc(FSREQ_FALLOCATE, NULL);
+}
+
 // Open a file (or directory).
 //
 // Returns:
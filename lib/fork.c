@@ -144,7 +144,7 @@ fork(void)
 	if (ret < 0)
 		panic("%s: %e", __func__, ret);
 
-	ret = sys_env_name(envid, (const char *)thisenv->binaryname);
+	ret = sys_env_name(envid, (const char *)thisenvinfo->binaryname);
 	if (ret < 0)
 		panic("%s: %e", __func__, ret);
 
@@ -216,7 +216,7 @@ sfork(void)
 	if (ret < 0)
 		panic("fork: %e", ret);
 
-	ret = sys_env_name(envid, (const char *)thisenv->binaryname);
+	ret = sys_env_name(envid, (const char *)thisenvinfo->binaryname);
 	if (ret < 0)
 		panic("fork: %e", ret);
 
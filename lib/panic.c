@@ -16,7 +16,7 @@ _panic(const char *file, int line, const char *fmt, ...)
 
 	// Print the panic message
 	cprintf("[%08x] user panic in %s at %s:%d: ",
-			sys_getenvid(), thisenv->binaryname, file, line);
+			sys_getenvid(), thisenvinfo->binaryname, file, line);
 	vcprintf(fmt, ap);
 	cprintf("\n");
 
@@ -34,7 +34,7 @@ _warn(const char *file, int line, const char *fmt, ...)
 	va_start(ap, fmt);
 
 	cprintf("[%08x] user warning in %s at %s:%d: ",
-		sys_getenvid(), thisenv->binaryname, file, line);
+		sys_getenvid(), thisenvinfo->binaryname, file, line);
 
 	vcprintf(fmt, ap);
 	cprintf("\n");
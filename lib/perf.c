@@ -0,0 +1,25 @@
+#include <lib.h>
+#include <x86.h>
+
+// Count of 'counter' of this env so far.  The kernel folds the hardware
+// counter into ep_count and bumps ep_seq whenever the env leaves its
+// CPU, so a read is retried if that happened in the middle of it.
+// Without PERF_RDPMC the result only moves when the env is switched out.
+uint64_t
+perf_read(int counter)
+{
+	const volatile struct EnvPerf *ep = &thisenvinfo->env_perf;
+	uint64_t val;
+	uint32_t seq;
+
+	do {
+		seq = ep->ep_seq;
+		asm volatile("" : : : "memory");
+		val = ep->ep_count[counter];
+		if (ep->ep_flags & PERF_RDPMC)
+			val += rdpmc(counter);
+		asm volatile("" : : : "memory");
+	} while (seq != ep->ep_seq);
+
+	return val;
+}
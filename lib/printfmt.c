@@ -38,6 +38,7 @@ static const char * const error_string[MAXERROR] = {
 	[E_NOT_SUPP]     = "operation not supported",
 	[E_BUSY]         = "device busy",
 	[E_BAD_REQ]      = "bad HTTP request",
+	[E_IO]           = "device I/O error",
 };
 
 /*
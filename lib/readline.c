@@ -1,25 +1,53 @@
 #include <stdio.h>
 #include <error.h>
 #include <assert.h>
+#ifndef TOYNIX_KERNEL
+#include <lib.h>
+#endif
 
 #define BUFLEN 1024
 static char buf[BUFLEN];
 
+static char *readline_edit(int echoing);
+
+#ifdef TOYNIX_KERNEL
 char *
 readline(const char *prompt)
 {
-	int i, c, echoing;
-
-#ifdef TOYNIX_KERNEL
 	if (prompt)
 		cprintf("%s", prompt);
+
+	return readline_edit(iscons(0));
+}
 #else
+// The console's line discipline edits and echoes a line as it is typed,
+// even before anyone reads it; only the finished line is read here.
+char *
+readline(const char *prompt)
+{
+	int mode;
+	char *line;
+
 	if (prompt)
 		fprintf(1, "%s", prompt);
+
+	if (!iscons(0))
+		return readline_edit(0);
+
+	mode = sys_cons_mode(CONS_CANON | CONS_ECHO);
+	line = readline_edit(0);
+	sys_cons_mode(mode);
+
+	return line;
+}
 #endif
 
+static char *
+readline_edit(int echoing)
+{
+	int i, c;
+
 	i = 0;
-	echoing = iscons(0);
 	while (1) {
 		c = getchar();
 		if (c < 0) {
@@ -0,0 +1,495 @@
+// Submission/completion rings shared with the fs and ns servers.
+// See include/ring.h for the layout and protocol.
+
+#include <lib.h>
+#include <math.h>
+
+#define debug 0
+
+#define RING_BUF_ALL	((uint32_t)~0)
+
+static uint32_t
+ring_req(enum EnvType type, int fsreq, int nsreq)
+{
+	return type == ENV_TYPE_FS ? fsreq : nsreq;
+}
+
+// Ring setup request: send 'pg' and wait for the server to map it.
+static int
+ring_setup_page(struct Ring *r, uint32_t req, void *pg)
+{
+	int ret;
+
+	ret = sys_page_alloc(0, pg, PTE_P | PTE_U | PTE_W);
+	if (ret < 0)
+		return ret;
+
+	ipc_send(r->r_env, req, pg, PTE_W);
+	return ipc_recv(NULL, NULL, NULL);
+}
+
+// Set up a ring with the server of the given type.  Any previous ring
+// of this environment with that server is replaced.
+int
+ring_init(struct Ring *r, enum EnvType type)
+{
+	int i, ret;
+
+	static_assert(sizeof(struct ring_ctrl) <= PGSIZE);
+	static_assert(RING_ENTRIES == 32);	/* r_buf_free is one word */
+
+	if (type != ENV_TYPE_FS && type != ENV_TYPE_NS)
+		return -E_INVAL;
+
+	r->r_env = ipc_find_env(type);
+	if (!r->r_env)
+		return -E_BAD_ENV;
+
+	r->r_owner = 0;
+	r->r_type = type;
+	r->r_ctrl = (struct ring_ctrl *)(RINGTABLE + type * RING_SIZE);
+	r->r_buf = (char *)r->r_ctrl + PGSIZE;
+	r->r_nbuf = RING_ENTRIES;
+	r->r_buf_free = RING_BUF_ALL;
+	r->r_tail = 0;
+
+	ret = ring_setup_page(r, ring_req(type, FSREQ_RING_SETUP,
+				NSREQ_RING_SETUP), r->r_ctrl);
+	if (ret < 0)
+		return ret;
+
+	for (i = 0; i < RING_ENTRIES; i++) {
+		ret = ring_setup_page(r, ring_req(type, FSREQ_RING_BUF,
+					NSREQ_RING_BUF), ring_buf(r, i));
+		if (ret < 0)
+			return ret;
+	}
+
+	r->r_owner = sys_getenvid();
+	if (debug)
+		cprintf("[%08x] %s: ring with %08x\n",
+			r->r_owner, __func__, r->r_env);
+
+	return 0;
+}
+
+// Reserve the next submission slot for request 'op'.
+// Returns the buffer page to fill with the request, laid out as
+// union Fsipc or union Nsipc, or NULL if every entry is in flight.
+// The entry reaches the server on the next ring_submit.
+void *
+ring_get(struct Ring *r, uint32_t op, uint32_t data)
+{
+	struct ring_sqe *sqe;
+	uint32_t idx;
+
+	// A forked child shares no ring with the server.
+	if (r->r_owner != sys_getenvid() || !r->r_buf_free)
+		return NULL;
+
+	idx = log_of_2(r->r_buf_free & -r->r_buf_free);
+	r->r_buf_free &= ~(1 << idx);
+
+	sqe = &r->r_ctrl->sqes[r->r_tail++ & RING_MASK];
+	sqe->sqe_op = op;
+	sqe->sqe_buf = idx;
+	sqe->sqe_data = data;
+
+	return ring_buf(r, idx);
+}
+
+// Publish every entry filled since the last call and notify the
+// server once for the whole batch.  Returns the number of entries
+// submitted.
+int
+ring_submit(struct Ring *r)
+{
+	struct ring_ctrl *ctrl = r->r_ctrl;
+	int n;
+
+	if (r->r_owner != sys_getenvid())
+		return -E_INVAL;
+
+	n = r->r_tail - ctrl->sq_tail;
+	if (!n)
+		return 0;
+
+	ring_barrier();
+	ctrl->sq_tail = r->r_tail;
+
+	ipc_send(r->r_env, ring_req(r->r_type, FSREQ_RING_ENTER,
+			NSREQ_RING_ENTER), ctrl, PTE_W);
+	return n;
+}
+
+// Return the oldest completion, or NULL if none is ready yet.
+struct ring_cqe *
+ring_peek(struct Ring *r)
+{
+	struct ring_ctrl *ctrl = r->r_ctrl;
+
+	if (ctrl->cq_head == ctrl->cq_tail)
+		return NULL;
+
+	ring_barrier();
+	return &ctrl->cqes[ctrl->cq_head & RING_MASK];
+}
+
+// Wait for the oldest completion, submitting the entries filled since
+// the last ring_submit.  Returns NULL if nothing is in flight.
+struct ring_cqe *
+ring_wait(struct Ring *r)
+{
+	struct ring_cqe *cqe;
+	envid_t from;
+
+	while (!(cqe = ring_peek(r))) {
+		if (r->r_owner != sys_getenvid() ||
+		    r->r_buf_free == RING_BUF_ALL)
+			return NULL;
+
+		// block until the server has posted a completion; it wakes
+		// us exactly once per wait request
+		ring_barrier();
+		r->r_ctrl->sq_tail = r->r_tail;
+		ipc_send(r->r_env, ring_req(r->r_type, FSREQ_RING_WAIT,
+				NSREQ_RING_WAIT), r->r_ctrl, PTE_W);
+		do {
+			ipc_recv(&from, NULL, NULL);
+		} while (from != r->r_env);
+	}
+
+	return cqe;
+}
+
+// Retire a completion returned by ring_peek or ring_wait, which also
+// releases its buffer page.
+void
+ring_seen(struct Ring *r, struct ring_cqe *cqe)
+{
+	r->r_buf_free |= 1 << (cqe->cqe_buf & RING_MASK);
+	ring_barrier();
+	r->r_ctrl->cq_head++;
+}
+
+// Translate a file or socket descriptor into the id the server uses.
+int
+ring_fdid(int fdnum)
+{
+	struct Fd *fd;
+	int ret;
+
+	ret = fd_lookup(fdnum, &fd);
+	if (ret < 0)
+		return ret;
+
+	if (fd->fd_dev_id == devfile.dev_id)
+		return fd->fd_file.id;
+	if (fd->fd_dev_id == devsock.dev_id)
+		return fd->fd_sock.sockid;
+
+	return -E_NOT_SUPP;
+}
+
+// Queue an open.  The completion carries the file id, usable with the
+// other file requests; release it with ring_prep_close.
+int
+ring_prep_open(struct Ring *r, const char *path, int mode, uint32_t data)
+{
+	union Fsipc *req;
+
+	if (strlen(path) >= MAXPATHLEN)
+		return -E_BAD_PATH;
+
+	req = ring_get(r, FSREQ_OPEN, data);
+	if (!req)
+		return -E_BUSY;
+
+	strcpy(req->open.req_path, path);
+	req->open.req_omode = mode;
+	return 0;
+}
+
+// Queue a read of at most 'n' bytes at the file's seek position.
+// The data is returned in the completion's buffer page.
+int
+ring_prep_read(struct Ring *r, int fileid, size_t n, uint32_t data)
+{
+	union Fsipc *req;
+
+	req = ring_get(r, FSREQ_READ, data);
+	if (!req)
+		return -E_BUSY;
+
+	req->read.req_fileid = fileid;
+	req->read.req_n = MIN(n, (size_t)PGSIZE);
+	return 0;
+}
+
+// Queue a write.  Returns the number of bytes queued, which may be
+// fewer than 'n', or < 0 on error.
+int
+ring_prep_write(struct Ring *r, int fileid, const void *buf, size_t n,
+		uint32_t data)
+{
+	union Fsipc *req;
+
+	req = ring_get(r, FSREQ_WRITE, data);
+	if (!req)
+		return -E_BUSY;
+
+	req->write.req_fileid = fileid;
+	req->write.req_n = MIN(n, sizeof(req->write.req_buf));
+	memmove(req->write.req_buf, buf, req->write.req_n);
+	return req->write.req_n;
+}
+
+// Queue a stat; the completion's buffer page holds a struct Fsret_stat.
+int
+ring_prep_stat(struct Ring *r, int fileid, uint32_t data)
+{
+	union Fsipc *req;
+
+	req = ring_get(r, FSREQ_STAT, data);
+	if (!req)
+		return -E_BUSY;
+
+	req->stat.req_fileid = fileid;
+	return 0;
+}
+
+// Queue a flush, which also releases a file opened through the ring.
+int
+ring_prep_close(struct Ring *r, int fileid, uint32_t data)
+{
+	union Fsipc *req;
+
+	req = ring_get(r, FSREQ_FLUSH, data);
+	if (!req)
+		return -E_BUSY;
+
+	req->flush.req_fileid = fileid;
+	return 0;
+}
+
+// Queue a send.  Returns the number of bytes queued or < 0 on error.
+int
+ring_prep_send(struct Ring *r, int sockid, const void *buf, int n,
+	       unsigned int flags, uint32_t data)
+{
+	union Nsipc *req;
+
+	req = ring_get(r, NSREQ_SEND, data);
+	if (!req)
+		return -E_BUSY;
+
+	req->send.req_s = sockid;
+	req->send.req_size = MIN(n, (int)(PGSIZE - sizeof(struct Nsreq_send)));
+	req->send.req_flags = flags;
+	memmove(req->send.req_buf, buf, req->send.req_size);
+	return req->send.req_size;
+}
+
+// Queue a receive; the data is returned in the completion's buffer page.
+int
+ring_prep_recv(struct Ring *r, int sockid, int n, unsigned int flags,
+	       uint32_t data)
+{
+	union Nsipc *req;
+
+	req = ring_get(r, NSREQ_RECV, data);
+	if (!req)
+		return -E_BUSY;
+
+	req->recv.req_s = sockid;
+	req->recv.req_len = MIN(n, PGSIZE);
+	req->recv.req_flags = flags;
+	return 0;
+}
+
+// Server side: whether the client 'envid' still exists.
+bool
+ring_alive(envid_t envid)
+{
+	const volatile struct Env *e = &envs[ENVX(envid)];
+
+	return e->env_id == envid && e->env_status != ENV_FREE;
+}
+
+// Server side: assign each ring slot its fixed address range.
+void
+ring_srv_init(struct Ring *tab, int n)
+{
+	int i;
+	uintptr_t va = RINGSRVTABLE;
+
+	for (i = 0; i < n; i++) {
+		tab[i].r_env = 0;
+		tab[i].r_ctrl = (struct ring_ctrl *)va;
+		tab[i].r_buf = (char *)va + PGSIZE;
+		tab[i].r_nbuf = 0;
+		tab[i].r_waiting = false;
+		va += RING_SIZE;
+	}
+}
+
+struct Ring *
+ring_lookup(struct Ring *tab, int n, envid_t whom)
+{
+	int i;
+
+	for (i = 0; i < n; i++) {
+		if (tab[i].r_env == whom)
+			return &tab[i];
+	}
+
+	return NULL;
+}
+
+static void
+ring_release(struct Ring *r)
+{
+	int i;
+
+	sys_page_unmap(0, r->r_ctrl);
+	for (i = 0; i < r->r_nbuf; i++)
+		sys_page_unmap(0, ring_buf(r, i));
+
+	r->r_env = 0;
+	r->r_nbuf = 0;
+	r->r_waiting = false;
+}
+
+// Attach the control page 'pg' received from 'whom', replacing any
+// ring it had before and recycling rings of environments that died.
+int
+ring_attach(struct Ring *tab, int n, envid_t whom, void *pg)
+{
+	struct Ring *r;
+	int i, ret;
+
+	r = ring_lookup(tab, n, whom);
+	if (r)
+		ring_release(r);
+
+	for (i = 0; i < n && !r; i++) {
+		if (tab[i].r_env && !ring_alive(tab[i].r_env))
+			ring_release(&tab[i]);
+		if (!tab[i].r_env)
+			r = &tab[i];
+	}
+
+	if (!r)
+		return -E_MAX_OPEN;
+
+	ret = sys_page_map(0, pg, 0, r->r_ctrl, PTE_P | PTE_U | PTE_W);
+	if (ret < 0)
+		return ret;
+
+	r->r_env = whom;
+	return 0;
+}
+
+// Attach the next buffer page of the ring owned by 'whom'.
+int
+ring_attach_buf(struct Ring *tab, int n, envid_t whom, void *pg)
+{
+	struct Ring *r;
+	int ret;
+
+	r = ring_lookup(tab, n, whom);
+	if (!r || r->r_nbuf >= RING_ENTRIES)
+		return -E_INVAL;
+
+	ret = sys_page_map(0, pg, 0, ring_buf(r, r->r_nbuf),
+			   PTE_P | PTE_U | PTE_W);
+	if (ret < 0)
+		return ret;
+
+	r->r_nbuf++;
+	return 0;
+}
+
+// Pop the next submission into '*sqe' and return its buffer page,
+// or NULL once the queue is drained.
+void *
+ring_next(struct Ring *r, struct ring_sqe *sqe)
+{
+	struct ring_ctrl *ctrl = r->r_ctrl;
+
+	if (r->r_nbuf != RING_ENTRIES || ctrl->sq_head == ctrl->sq_tail)
+		return NULL;
+
+	// The client can never have more than RING_ENTRIES outstanding;
+	// drop a queue that claims otherwise instead of looping on it.
+	if (ctrl->sq_tail - ctrl->sq_head > RING_ENTRIES) {
+		ctrl->sq_head = ctrl->sq_tail;
+		return NULL;
+	}
+
+	ring_barrier();
+	*sqe = ctrl->sqes[ctrl->sq_head & RING_MASK];
+	ring_barrier();
+	ctrl->sq_head++;
+
+	return ring_buf(r, sqe->sqe_buf);
+}
+
+// Wake the client blocked in ring_wait once a completion is ready.
+// Returns true if it has not reached ipc_recv yet, so the wake-up is
+// still owed; ring_srv_notify retries it.
+static bool
+ring_notify(struct Ring *r)
+{
+	struct ring_ctrl *ctrl = r->r_ctrl;
+
+	if (!r->r_waiting || ctrl->cq_head == ctrl->cq_tail)
+		return false;
+
+	if (sys_ipc_try_send(r->r_env, 0, NULL, 0) == -E_IPC_NOT_RECV)
+		return true;
+
+	// woken, or gone
+	r->r_waiting = false;
+	return false;
+}
+
+// Post the result of 'sqe' to the completion queue.
+void
+ring_complete(struct Ring *r, struct ring_sqe *sqe, int res)
+{
+	struct ring_ctrl *ctrl = r->r_ctrl;
+	struct ring_cqe *cqe = &ctrl->cqes[ctrl->cq_tail & RING_MASK];
+
+	cqe->cqe_data = sqe->sqe_data;
+	cqe->cqe_buf = sqe->sqe_buf & RING_MASK;
+	cqe->cqe_res = res;
+	ring_barrier();
+	ctrl->cq_tail++;
+
+	ring_notify(r);
+}
+
+// The client of 'r' waits for a completion: reply now if one is ready,
+// or from the ring_complete that posts the next one.
+void
+ring_srv_wait(struct Ring *r)
+{
+	r->r_waiting = true;
+	ring_notify(r);
+}
+
+// Server side: retry the wake-ups of clients that were not receiving
+// yet.  Returns the number still owed.
+int
+ring_srv_notify(struct Ring *tab, int n)
+{
+	int i, owed = 0;
+
+	for (i = 0; i < n; i++) {
+		if (tab[i].r_env && ring_notify(&tab[i]))
+			owed++;
+	}
+
+	return owed;
+}
@@ -1,6 +1,7 @@
 // Basic string routines.  Not hardware optimized, but not shabby.
 
 #include <string.h>
+#include <x86.h>
 
 // Using assembly for memset/memmove
 // makes some difference on real hardware,
@@ -8,14 +9,126 @@
 // Primespipe runs 3x faster this way.
 #define ASM 1
 
+// Word-sized accesses into byte buffers
+typedef uint32_t __attribute__((__may_alias__)) word_t;
+
+// Nonzero iff some byte of 'x' is zero
+#define haszero(x)	(((x) - 0x01010101) & ~(x) & 0x80808080)
+
+#if ASM
+// Size classes of the copy and fill routines.  Below STRING_SMALL
+// nothing beats a plain rep movsb/stosb.  Fast-string (ERMS) CPUs move
+// anything from STRING_ERMS up to about the cache size fastest with
+// rep movsb/stosb.  User space also has SSE2: 16-byte stores from
+// STRING_SSE on, and non-temporal ones bypassing the cache from
+// STRING_NT on.  The kernel never touches the FPU, so it is limited to
+// the integer variants.
+#define STRING_SMALL	16
+#define STRING_SSE	64
+#define STRING_ERMS	512
+#define STRING_NT	(256 * 1024)
+
+#define CPUID_1_EDX_SSE2	(1 << 26)
+#define CPUID_7_EBX_ERMS	(1 << 9)
+
+enum {
+	STRING_HAS_SSE2 = 1 << 0,
+	STRING_HAS_ERMS = 1 << 1,
+};
+
+static int string_features = -1;
+
+static int
+string_cpu_features(void)
+{
+	uint32_t max, ebx, edx;
+	int f = 0;
+
+	if (string_features >= 0)
+		return string_features;
+
+	cpuid(0, &max, NULL, NULL, NULL);
+	cpuid(1, NULL, NULL, NULL, &edx);
+	if (edx & CPUID_1_EDX_SSE2)
+		f |= STRING_HAS_SSE2;
+
+	if (max >= 7) {
+		cpuid_count(7, 0, NULL, &ebx, NULL, NULL);
+		if (ebx & CPUID_7_EBX_ERMS)
+			f |= STRING_HAS_ERMS;
+	}
+
+	string_features = f;
+	return f;
+}
+
+#ifdef TOYNIX_USER
+// The SSE2 helpers use %xmm0-%xmm3.  They are clobbered explicitly when
+// the compiler uses SSE itself; without it, it knows no such registers
+// and rejects them in clobber lists.
+#ifdef __SSE__
+#define XMM_CLOBBERS	"xmm0", "xmm1", "xmm2", "xmm3",
+#else
+#define XMM_CLOBBERS
+#endif
+
+// Bitmask of the bytes of 16-byte aligned 'p' that are zero
+static inline uint32_t
+zero_mask16(const char *p)
+{
+	uint32_t mask;
+
+	asm volatile("pxor %%xmm0, %%xmm0\n\t"
+		     "pcmpeqb (%1), %%xmm0\n\t"
+		     "pmovmskb %%xmm0, %0"
+		     : "=r" (mask) : "r" (p) : XMM_CLOBBERS "memory");
+	return mask;
+}
+
+static int
+strlen_sse2(const char *s)
+{
+	// Aligned loads never cross into the next page.
+	const char *p = (const char *)((uintptr_t)s & ~15);
+	uint32_t mask = zero_mask16(p) >> (s - p);
+
+	if (mask)
+		return __builtin_ctz(mask);
+
+	do {
+		p += 16;
+	} while (!(mask = zero_mask16(p)));
+
+	return p - s + __builtin_ctz(mask);
+}
+#endif
+#endif
+
 int
 strlen(const char *s)
 {
-	int n;
+	const char *p = s;
+	uint32_t w;
 
-	for (n = 0; *s != '\0'; s++)
-		n++;
-	return n;
+#if ASM && defined(TOYNIX_USER)
+	if (string_cpu_features() & STRING_HAS_SSE2)
+		return strlen_sse2(s);
+#endif
+
+	for (; (uintptr_t)p % 4; p++)
+		if (*p == '\0')
+			return p - s;
+
+	// Aligned loads never cross into the next page.
+	for (;; p += 4) {
+		w = *(const word_t *)p;
+		if (haszero(w))
+			break;
+	}
+
+	while (*p)
+		p++;
+	return p - s;
 }
 
 int
@@ -103,24 +216,200 @@ strfind(const char *s, char c)
 }
 
 #if ASM
+#ifdef TOYNIX_USER
+// Fill 'blocks' 64-byte blocks at 16-byte aligned 'p' with the 32-bit
+// pattern 'w'.  %xmm0 is loaded in the same asm statement as the stores,
+// since nothing keeps it live between two of them.
+static void
+fill_sse2(char *p, size_t blocks, uint32_t w, bool nt)
+{
+	if (nt)
+		asm volatile("movd %2, %%xmm0\n\t"
+			     "pshufd $0, %%xmm0, %%xmm0\n"
+			     "1:\n\t"
+			     "movntdq %%xmm0, (%0)\n\t"
+			     "movntdq %%xmm0, 16(%0)\n\t"
+			     "movntdq %%xmm0, 32(%0)\n\t"
+			     "movntdq %%xmm0, 48(%0)\n\t"
+			     "addl $64, %0\n\t"
+			     "decl %1\n\t"
+			     "jnz 1b\n\t"
+			     "sfence"
+			     : "+r" (p), "+r" (blocks) : "r" (w)
+			     : XMM_CLOBBERS "cc", "memory");
+	else
+		asm volatile("movd %2, %%xmm0\n\t"
+			     "pshufd $0, %%xmm0, %%xmm0\n"
+			     "1:\n\t"
+			     "movdqa %%xmm0, (%0)\n\t"
+			     "movdqa %%xmm0, 16(%0)\n\t"
+			     "movdqa %%xmm0, 32(%0)\n\t"
+			     "movdqa %%xmm0, 48(%0)\n\t"
+			     "addl $64, %0\n\t"
+			     "decl %1\n\t"
+			     "jnz 1b"
+			     : "+r" (p), "+r" (blocks) : "r" (w)
+			     : XMM_CLOBBERS "cc", "memory");
+}
+
+// Copy 'blocks' 64-byte blocks from 's' to 16-byte aligned 'd'.
+static void
+copy_sse2(char *d, const char *s, size_t blocks, bool nt)
+{
+	if (nt)
+		asm volatile("1:\n\t"
+			     "movdqu (%1), %%xmm0\n\t"
+			     "movdqu 16(%1), %%xmm1\n\t"
+			     "movdqu 32(%1), %%xmm2\n\t"
+			     "movdqu 48(%1), %%xmm3\n\t"
+			     "movntdq %%xmm0, (%0)\n\t"
+			     "movntdq %%xmm1, 16(%0)\n\t"
+			     "movntdq %%xmm2, 32(%0)\n\t"
+			     "movntdq %%xmm3, 48(%0)\n\t"
+			     "addl $64, %1\n\t"
+			     "addl $64, %0\n\t"
+			     "decl %2\n\t"
+			     "jnz 1b\n\t"
+			     "sfence"
+			     : "+r" (d), "+r" (s), "+r" (blocks)
+			     : : XMM_CLOBBERS "cc", "memory");
+	else
+		asm volatile("1:\n\t"
+			     "movdqu (%1), %%xmm0\n\t"
+			     "movdqu 16(%1), %%xmm1\n\t"
+			     "movdqu 32(%1), %%xmm2\n\t"
+			     "movdqu 48(%1), %%xmm3\n\t"
+			     "movdqa %%xmm0, (%0)\n\t"
+			     "movdqa %%xmm1, 16(%0)\n\t"
+			     "movdqa %%xmm2, 32(%0)\n\t"
+			     "movdqa %%xmm3, 48(%0)\n\t"
+			     "addl $64, %1\n\t"
+			     "addl $64, %0\n\t"
+			     "decl %2\n\t"
+			     "jnz 1b"
+			     : "+r" (d), "+r" (s), "+r" (blocks)
+			     : : XMM_CLOBBERS "cc", "memory");
+}
+#endif
+
 void *
 memset(void *v, int c, size_t n)
 {
-	if (n == 0)
+	char *p = v;
+	size_t head, words;
+	int f;
+
+	c &= 0xFF;
+	if (n < STRING_SMALL) {
+		asm volatile("cld; rep stosb\n"
+			: "+D" (p), "+c" (n) : "a" (c)
+			: "cc", "memory");
 		return v;
-	if ((int)v%4 == 0 && n%4 == 0) {
-		c &= 0xFF;
-		c = (c<<24)|(c<<16)|(c<<8)|c;
-		asm volatile("cld; rep stosl\n"
-			:: "D" (v), "a" (c), "c" (n/4)
+	}
+
+	f = string_cpu_features();
+#ifdef TOYNIX_USER
+	if ((f & STRING_HAS_SSE2) && n >= STRING_SSE &&
+		(n >= STRING_NT || !(f & STRING_HAS_ERMS) || n < STRING_ERMS)) {
+		head = -(uintptr_t)p % 16;
+		n -= head;
+		asm volatile("cld; rep stosb\n"
+			: "+D" (p), "+c" (head) : "a" (c)
 			: "cc", "memory");
-	} else
+
+		if (n / 64)
+			fill_sse2(p, n / 64, c * 0x01010101, n >= STRING_NT);
+		p += n & ~63;
+		n &= 63;
+
+		asm volatile("rep stosb\n"
+			: "+D" (p), "+c" (n) : "a" (c)
+			: "cc", "memory");
+		return v;
+	}
+#endif
+
+	if (n >= STRING_ERMS && (f & STRING_HAS_ERMS)) {
 		asm volatile("cld; rep stosb\n"
-			:: "D" (v), "a" (c), "c" (n)
+			: "+D" (p), "+c" (n) : "a" (c)
 			: "cc", "memory");
+		return v;
+	}
+
+	// Align the destination, then store words
+	head = -(uintptr_t)p % 4;
+	n -= head;
+	words = n / 4;
+	n %= 4;
+	asm volatile("cld; rep stosb\n\t"
+		"movl %3, %%ecx\n\t"
+		"rep stosl\n\t"
+		"movl %4, %%ecx\n\t"
+		"rep stosb\n"
+		: "+D" (p), "+c" (head)
+		: "a" (c * 0x01010101), "r" (words), "r" (n)
+		: "cc", "memory");
 	return v;
 }
 
+// Copy n bytes upwards; also used by memmove when that is safe.
+static void
+copy_forward(char *d, const char *s, size_t n)
+{
+	size_t head, words;
+	int f;
+
+	if (n < STRING_SMALL) {
+		asm volatile("cld; rep movsb\n"
+			: "+D" (d), "+S" (s), "+c" (n) : : "cc", "memory");
+		return;
+	}
+
+	f = string_cpu_features();
+#ifdef TOYNIX_USER
+	if ((f & STRING_HAS_SSE2) && n >= STRING_SSE &&
+		(n >= STRING_NT || !(f & STRING_HAS_ERMS) || n < STRING_ERMS)) {
+		head = -(uintptr_t)d % 16;
+		n -= head;
+		asm volatile("cld; rep movsb\n"
+			: "+D" (d), "+S" (s), "+c" (head) : : "cc", "memory");
+
+		// Streaming stores may be reordered against each other,
+		// so overlapping copies keep to the cached ones.
+		if (n / 64)
+			copy_sse2(d, s, n / 64, n >= STRING_NT &&
+				  (s + n <= d || d + n <= s));
+		d += n & ~63;
+		s += n & ~63;
+		n &= 63;
+
+		asm volatile("rep movsb\n"
+			: "+D" (d), "+S" (s), "+c" (n) : : "cc", "memory");
+		return;
+	}
+#endif
+
+	if (n >= STRING_ERMS && (f & STRING_HAS_ERMS)) {
+		asm volatile("cld; rep movsb\n"
+			: "+D" (d), "+S" (s), "+c" (n) : : "cc", "memory");
+		return;
+	}
+
+	// Align the destination, then move words
+	head = -(uintptr_t)d % 4;
+	n -= head;
+	words = n / 4;
+	n %= 4;
+	asm volatile("cld; rep movsb\n\t"
+		"movl %3, %%ecx\n\t"
+		"rep movsl\n\t"
+		"movl %4, %%ecx\n\t"
+		"rep movsb\n"
+		: "+D" (d), "+S" (s), "+c" (head)
+		: "r" (words), "r" (n)
+		: "cc", "memory");
+}
+
 void *
 memmove(void *dst, const void *src, size_t n)
 {
@@ -140,14 +429,16 @@ memmove(void *dst, const void *src, size_t n)
 				:: "D" (d-1), "S" (s-1), "c" (n) : "cc", "memory");
 		// Some versions of GCC rely on DF being clear
 		asm volatile("cld" ::: "cc");
-	} else {
-		if ((int)s%4 == 0 && (int)d%4 == 0 && n%4 == 0)
-			asm volatile("cld; rep movsl\n"
-				:: "D" (d), "S" (s), "c" (n/4) : "cc", "memory");
-		else
-			asm volatile("cld; rep movsb\n"
-				:: "D" (d), "S" (s), "c" (n) : "cc", "memory");
-	}
+	} else
+		copy_forward(d, s, n);
+
+	return dst;
+}
+
+void *
+memcpy(void *dst, const void *src, size_t n)
+{
+	copy_forward(dst, src, n);
 	return dst;
 }
 
@@ -186,19 +477,57 @@ memmove(void *dst, const void *src, size_t n)
 
 	return dst;
 }
-#endif
 
 void *
 memcpy(void *dst, const void *src, size_t n)
 {
 	return memmove(dst, src, n);
 }
+#endif
+
+#if ASM && defined(TOYNIX_USER)
+// Length of the prefix of s1 and s2 made of equal 16-byte blocks,
+// looking at the first n bytes only.
+static size_t
+memcmp_sse2(const uint8_t *s1, const uint8_t *s2, size_t n)
+{
+	size_t i;
+	uint32_t mask;
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		asm volatile("movdqu (%1), %%xmm0\n\t"
+			     "movdqu (%2), %%xmm1\n\t"
+			     "pcmpeqb %%xmm1, %%xmm0\n\t"
+			     "pmovmskb %%xmm0, %0"
+			     : "=r" (mask) : "r" (s1 + i), "r" (s2 + i)
+			     : "memory");
+		if (mask != 0xffff)
+			break;
+	}
+
+	return i;
+}
+#endif
 
 int
 memcmp(const void *v1, const void *v2, size_t n)
 {
 	const uint8_t *s1 = (const uint8_t *) v1;
 	const uint8_t *s2 = (const uint8_t *) v2;
+	size_t skip;
+
+#if ASM && defined(TOYNIX_USER)
+	if (n >= 16 && (string_cpu_features() & STRING_HAS_SSE2)) {
+		skip = memcmp_sse2(s1, s2, n);
+		s1 += skip, s2 += skip, n -= skip;
+	}
+#endif
+
+	// Skip equal words, then find the differing byte
+	for (skip = 0; skip + 4 <= n; skip += 4)
+		if (*(const word_t *)(s1 + skip) != *(const word_t *)(s2 + skip))
+			break;
+	s1 += skip, s2 += skip, n -= skip;
 
 	while (n-- > 0) {
 		if (*s1 != *s2)
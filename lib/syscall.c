@@ -167,3 +167,57 @@ sys_env_name(envid_t envid, const char *name)
 {
 	return syscall(SYS_env_name, 0, envid, (uint32_t)name, 0, 0, 0);
 }
+
+int
+sys_env_set_priority(envid_t envid, int prio)
+{
+	return syscall(SYS_env_set_priority, 1, envid, prio, 0, 0, 0);
+}
+
+int
+sys_env_set_affinity(envid_t envid, uint32_t cpumask)
+{
+	return syscall(SYS_env_set_affinity, 1, envid, cpumask, 0, 0, 0);
+}
+
+int
+sys_env_dedicate_cpu(envid_t envid, int cpu)
+{
+	return syscall(SYS_env_dedicate_cpu, 1, envid, cpu, 0, 0, 0);
+}
+
+int
+sys_trace(int op, uint32_t arg)
+{
+	return syscall(SYS_trace, 0, op, arg, 0, 0, 0);
+}
+
+int
+sys_prof(int op, uint32_t arg)
+{
+	return syscall(SYS_prof, 0, op, arg, 0, 0, 0);
+}
+
+int
+sys_env_set_perf(envid_t envid, const struct PerfConfig *pc)
+{
+	return syscall(SYS_env_set_perf, 0, envid, (uint32_t)pc, 0, 0, 0);
+}
+
+int
+sys_cons_read(void *buf, size_t n)
+{
+	return syscall(SYS_cons_read, 0, (uint32_t)buf, n, 0, 0, 0);
+}
+
+int
+sys_cons_mode(int mode)
+{
+	return syscall(SYS_cons_mode, 0, mode, 0, 0, 0, 0);
+}
+
+int
+sys_ide_dma(int cmd, const void *va, size_t len)
+{
+	return syscall(SYS_ide_dma, 0, cmd, (uint32_t)va, len, 0, 0);
+}
@@ -28,6 +28,9 @@ struct st_args {
 	int reqno;
 	uint32_t whom;
 	union Nsipc *req;
+	// set for requests taken from a ring instead of an IPC page
+	struct Ring *ring;
+	struct ring_sqe sqe;
 };
 
 struct netif nif;
@@ -42,6 +45,9 @@ static envid_t output_envid;
 
 static bool buse[QUEUE_SIZE];
 
+// Submission/completion rings of the clients
+static struct Ring rings[NRINGSRV];
+
 static void
 tcpip_init_done(void *arg)
 {
@@ -248,6 +254,14 @@ serve_thread(uint32_t a)
 		perror(buf);
 	}
 
+	if (args->ring) {
+		// the ring may have been recycled while the request blocked
+		if (args->ring->r_env == args->whom)
+			ring_complete(args->ring, &args->sqe, r);
+		free(args);
+		return;
+	}
+
 	if (args->reqno != NSREQ_INPUT)
 		ipc_send(args->whom, r, NULL, 0);
 
@@ -256,6 +270,48 @@ serve_thread(uint32_t a)
 	free(args);
 }
 
+// Start one thread per queued request of envid's ring, so a blocking
+// receive does not hold up the rest of the batch.  Each thread posts
+// its own completion; the client gets no IPC reply unless it 'wait's
+// for a completion.
+static void
+serve_ring(envid_t envid, bool wait)
+{
+	struct Ring *r;
+	struct ring_sqe sqe;
+	struct st_args *args;
+	union Nsipc *req;
+
+	r = ring_lookup(rings, NRINGSRV, envid);
+	if (!r) {
+		cprintf("NS: ring request from %08x without ring\n", envid);
+		return;
+	}
+
+	while ((req = ring_next(r, &sqe))) {
+		// only the socket requests may be queued
+		if (sqe.sqe_op >= NSREQ_RING_SETUP) {
+			ring_complete(r, &sqe, -E_INVAL);
+			continue;
+		}
+
+		args = malloc(sizeof(struct st_args));
+		if (!args)
+			panic("could not allocate thread args structure");
+
+		args->reqno = sqe.sqe_op;
+		args->whom = envid;
+		args->req = req;
+		args->ring = r;
+		args->sqe = sqe;
+
+		thread_create(NULL, "serve_ring", serve_thread, (uint32_t)args);
+	}
+
+	if (wait)
+		ring_srv_wait(r);
+}
+
 static void
 serve(void)
 {
@@ -270,6 +326,10 @@ serve(void)
 		for (i = 0; thread_wakeups_pending() && i < 32; i++)
 			thread_yield();
 
+		// likewise for ring clients not receiving their wake-up yet
+		for (i = 0; ring_srv_notify(rings, NRINGSRV) && i < 32; i++)
+			sys_yield();
+
 		perm = 0;
 		va = get_buffer();	/* get request address space */
 		req_no = ipc_recv(&whom, (void *)va, &perm);
@@ -290,6 +350,23 @@ serve(void)
 			continue; // just leave it hanging...
 		}
 
+		// Ring requests don't block, serve them here
+		if (req_no >= NSREQ_RING_SETUP && req_no <= NSREQ_RING_WAIT) {
+			if (req_no == NSREQ_RING_SETUP)
+				ipc_send(whom, ring_attach(rings, NRINGSRV, whom, va),
+					 NULL, 0);
+			else if (req_no == NSREQ_RING_BUF)
+				ipc_send(whom, ring_attach_buf(rings, NRINGSRV, whom, va),
+					 NULL, 0);
+			else
+				serve_ring(whom, req_no == NSREQ_RING_WAIT);
+
+			put_buffer(va);
+			sys_page_unmap(0, va);
+			thread_yield(); // let the ring threads run
+			continue;
+		}
+
 		// Since some lwIP socket calls will block, create a thread and
 		// process the rest of the request in the thread.
 		struct st_args *args = malloc(sizeof(struct st_args));
@@ -300,6 +377,7 @@ serve(void)
 		args->reqno = req_no;
 		args->whom = whom;
 		args->req = va;
+		args->ring = NULL;
 
 		thread_create(NULL, "serve_thread", serve_thread, (uint32_t)args);
 		thread_yield(); // let the thread created run
@@ -309,6 +387,7 @@ serve(void)
 static void
 tmain(uint32_t arg)
 {
+	ring_srv_init(rings, NRINGSRV);
 	serve_init(inet_addr(IP), inet_addr(MASK), inet_addr(DEFAULT));
 	serve();
 }
@@ -338,6 +417,15 @@ umain(int argc, char **argv)
 		input(ns_envid);
 		return;
 	}
+#ifdef NS_INPUT_CPU
+	// Let the input poller spin on a core of its own
+	// (build with NET_CFLAGS=-DNS_INPUT_CPU=<cpu>)
+	int ret = sys_env_dedicate_cpu(input_envid, NS_INPUT_CPU);
+
+	if (ret < 0)
+		cprintf("NS: cannot dedicate CPU %d to input: %e\n",
+			NS_INPUT_CPU, ret);
+#endif
 
 	// fork off the output thread that will send the packets to the NIC driver
 	output_envid = fork();
@@ -0,0 +1,113 @@
+#include <lib.h>
+#include <x86.h>
+
+#define MAXSIZE		(1024 * 1024)
+#define CALIBRATE_MS	200
+
+// Bytes moved per measurement; argv[1] overrides it (in MB)
+static uint64_t total = 16 * 1024 * 1024;
+static uint64_t tsc_per_ms;
+
+static char src[MAXSIZE + 64], dst[MAXSIZE + 64];
+
+static const size_t sizes[] = {
+	16, 64, 256, 1024, 4096, 16384, 65536, 262144, MAXSIZE,
+};
+
+enum { B_MEMCPY, B_MEMSET, B_MEMCMP, B_STRLEN, NBENCH };
+
+static const char * const names[NBENCH] = {
+	[B_MEMCPY] = "memcpy",
+	[B_MEMSET] = "memset",
+	[B_MEMCMP] = "memcmp",
+	[B_STRLEN] = "strlen",
+};
+
+// TSC ticks per millisecond, measured against sys_time_msec
+static void
+calibrate(void)
+{
+	uint32_t start, now;
+	uint64_t tsc;
+
+	start = sys_time_msec();
+	while ((now = sys_time_msec()) == start)
+		;
+
+	tsc = read_tsc();
+	while (sys_time_msec() < now + CALIBRATE_MS)
+		;
+
+	tsc_per_ms = (read_tsc() - tsc) / CALIBRATE_MS;
+}
+
+static uint64_t
+run(int bench, size_t size, uint32_t iters)
+{
+	volatile int sink = 0;
+	uint64_t tsc;
+	uint32_t i;
+
+	tsc = read_tsc();
+	for (i = 0; i < iters; i++) {
+		switch (bench) {
+		case B_MEMCPY:
+			memcpy(dst, src, size);
+			break;
+		case B_MEMSET:
+			memset(dst, i, size);
+			break;
+		case B_MEMCMP:
+			sink += memcmp(dst, src, size);
+			break;
+		case B_STRLEN:
+			sink += strlen(src);
+			break;
+		}
+	}
+
+	return read_tsc() - tsc;
+}
+
+// Throughput of 'bench' on buffers of 'size' bytes, in GB/s
+static double
+measure(int bench, size_t size)
+{
+	uint32_t iters = MAX((uint32_t)(total / size), 1u);
+	uint64_t tsc;
+
+	// strlen walks the whole source buffer, memcmp compares equal ones
+	memset(src, 'x', size);
+	src[size] = '\0';
+	memcpy(dst, src, size);
+
+	run(bench, size, 1);
+	tsc = run(bench, size, iters);
+
+	return (double)size * iters * tsc_per_ms / tsc / 1e6;
+}
+
+void
+umain(int argc, char **argv)
+{
+	int b, i;
+
+	if (argc > 1)
+		total = (uint64_t)strtol(argv[1], NULL, 0) * 1024 * 1024;
+
+	calibrate();
+	printf("TSC: %d kHz, %d MB per measurement\n",
+	       (uint32_t)tsc_per_ms, (uint32_t)(total >> 20));
+
+	printf("%8s", "size");
+	for (b = 0; b < NBENCH; b++)
+		printf(" %10s", names[b]);
+	printf("   (GB/s)\n");
+
+	for (i = 0; i < ARRAY_SIZE(sizes); i++) {
+		printf("%8d", sizes[i]);
+		for (b = 0; b < NBENCH; b++)
+			printf(" %6.3f", measure(b, sizes[i]));
+		printf("\n");
+	}
+}
@@ -0,0 +1,53 @@
+// Context switch cost: sys_yield back into the same environment, then
+// a ping-pong between two environments yielding to each other.
+// Run on one CPU (make CPUS=1) with the other environments idle for
+// stable numbers.
+
+#include <lib.h>
+#include <x86.h>
+
+#define NYIELD	100000
+
+static uint64_t
+yield_loop(int n)
+{
+	uint64_t tsc;
+	int i;
+
+	tsc = read_tsc();
+	for (i = 0; i < n; i++)
+		sys_yield();
+
+	return read_tsc() - tsc;
+}
+
+void
+umain(int argc, char **argv)
+{
+	int n = NYIELD;
+	uint64_t tsc;
+	envid_t child;
+
+	if (argc > 1)
+		n = strtol(argv[1], NULL, 0);
+	if (n <= 0)
+		n = NYIELD;
+
+	// warm up
+	yield_loop(n / 10);
+
+	tsc = yield_loop(n);
+	printf("self yield:     %u cycles per sys_yield\n", (uint32_t)(tsc / n));
+
+	child = fork();
+	if (child < 0)
+		panic("fork: %e", child);
+	if (child == 0) {
+		yield_loop(n);
+		return;
+	}
+
+	tsc = yield_loop(n);
+	printf("ping-pong:      %u cycles per switch\n", (uint32_t)(tsc / (2 * n)));
+	wait(child);
+}
@@ -19,6 +19,8 @@ static void vma_usage(void)
 	exit();
 }
 
+static struct DebugEnvStat stats[NENV];
+
 static const char * const env_status[] = {
 	"free",
 	"dying",
@@ -31,9 +33,11 @@ void
 umain(int argc, char **argv)
 {
 	int i, fd, ret, envid;
-	char buf[256] = {0};
+	char buf[1024] = {0};
 	uint32_t *tmp = UTEMP;
 	struct vm_area_struct *vma;
+	const struct EnvStat *st;
+	struct Fsreq_info *info;
 
 	if (argc == 1)
 		usage();
@@ -47,6 +51,7 @@ umain(int argc, char **argv)
 	switch (i) {
 	case CPU_INFO:
 	case MEM_INFO:
+	case LOCK_INFO:
 		fd = opendebug();
 		if (fd < 0)
 			return;
@@ -66,29 +71,57 @@ umain(int argc, char **argv)
 		if (ret < 0)
 			return;
 
+		info = (struct Fsreq_info *)tmp;
 		printf("Total blocks: %d\n"
 				" Used blocks: %d\n"
 				"       Usage: %f%%\n",
-				tmp[0], tmp[1], (float)tmp[1] * 100 / tmp[0]);
+				info->blk_num, info->blk_ocp,
+				(float)info->blk_ocp * 100 / info->blk_num);
+		printf("    Disk I/O: %u DMA, %u PIO commands\n",
+				info->ide_dma, info->ide_pio);
+		printf(" Cache blocks: %d / %d\n"
+				"   Cache hits: %u\n"
+				" Cache misses: %u\n"
+				"    Evictions: %u (%u written back)\n",
+				info->bc_blocks, info->bc_limit,
+				info->bc_hit, info->bc_miss,
+				info->bc_evict, info->bc_writeback);
+		printf(" Dirty blocks: %u\n"
+				"  Write-backs: %u\n",
+				info->bc_dirty, info->bc_sync);
+		printf("   Read-ahead: %u commands, %u blocks, %u used, %u evicted unused\n",
+				info->ra_read, info->ra_blocks, info->ra_hit,
+				info->ra_waste);
+		printf("      Journal: %u commits, %u blocks logged, %u installed\n",
+				info->j_commit, info->j_logged, info->j_install);
+		printf("      Delayed: %u pending, %u allocated, %u contiguous\n"
+				"    Fallocate: %u blocks\n",
+				info->da_pending, info->da_resolved, info->da_contig,
+				info->da_falloc);
+		printf(" Extent cache: %u hits, %u misses\n",
+				info->ex_hit, info->ex_miss);
+		printf(" Lookup cache: %u hits, %u negative hits, %u misses\n",
+				info->dc_hit, info->dc_neg, info->dc_miss);
 
 		sys_page_unmap(0, tmp);
 		break;
 
 	case ENV_INFO:
-		printf("%8s %16s %8s %s %10s %8s %16s\n",
-				"Env", "Name", "Status", "CPU", "Run times",
+		printf("%8s %16s %8s %s %4s %10s %8s %16s\n",
+				"Env", "Name", "Status", "CPU", "Prio", "Run times",
 				"Father", "Father name");
 
 		for (i = 0; i < NENV; i++) {
 			if (envs[i].env_status != ENV_FREE) {
-				printf("%8x %16s %8s %2d %10d %8x",
-					envs[i].env_id, envs[i].binaryname,
+				printf("%8x %16s %8s %2d %2d/%d %10d %8x",
+					envs[i].env_id, envinfos[i].binaryname,
 					env_status[envs[i].env_status],
-					envs[i].env_cpunum, envs[i].env_runs,
+					envs[i].env_cpunum, envs[i].env_prio,
+					envs[i].env_base_prio, envs[i].env_runs,
 					envs[i].env_parent_id);
 				if (envs[i].env_parent_id)
 					printf(" %16s",
-						envs[ENVX(envs[i].env_parent_id)].binaryname);
+						envinfos[ENVX(envs[i].env_parent_id)].binaryname);
 				printf("\n");
 			}
 		}
@@ -106,14 +139,40 @@ umain(int argc, char **argv)
 		printf("Env %x:\n", envid);
 		printf("VMA \t Begin \t\t Size \t\t Perm\n");
 
-		for (i = 0; i < envs[ENVX(envid)].vma_valid; i++) {
-			vma = (void *)&(envs[ENVX(envid)].vma[i]);
+		for (i = 0; i < envinfos[ENVX(envid)].vma_valid; i++) {
+			vma = (void *)&(envinfos[ENVX(envid)].vma[i]);
 
 			printf("%d \t 0x%08lx \t 0x%08x \t %d\n",
 					i, vma->vm_start, vma->size, vma->vm_page_prot);
 		}
 		break;
 
+	case ENV_STAT:
+		printf("Cumulative TSC cycles (x 2^20); see top for rates\n");
+		printf("%8s %16s %8s %8s %8s %8s %8s %8s\n", "Env", "Name",
+				"user", "kernel", "wait", "sent", "recv", "faults");
+
+		fd = opendebug();
+		if (fd < 0)
+			return;
+
+		write(fd, argv[1], strlen(argv[1]));
+		ret = read(fd, stats, sizeof(stats));
+		close(fd);
+
+		for (i = 0; ret > 0 && i < ret / sizeof(stats[0]); i++) {
+			st = &stats[i].ds_stat;
+			printf("%8x %16s %8u %8u %8u %8u %8u %8u\n",
+					stats[i].ds_env,
+					envinfos[ENVX(stats[i].ds_env)].binaryname,
+					(uint32_t)(st->es_user >> 20),
+					(uint32_t)(st->es_kern >> 20),
+					(uint32_t)(st->es_wait >> 20),
+					st->es_ipc_sent, st->es_ipc_recv,
+					st->es_pgfaults);
+		}
+		break;
+
 	default:
 		return;
 	}
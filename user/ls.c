@@ -98,7 +98,7 @@ umain(int argc, char **argv)
 	}
 
 	if (argc == 1)
-		ls((const char *)thisenv->currentpath, "");
+		ls((const char *)thisenvinfo->currentpath, "");
 	else {
 		for (i = 1; i < argc; i++)
 			ls(argv[i], argv[i]);
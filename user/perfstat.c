@@ -0,0 +1,106 @@
+// Run a command with performance counters on, and print what it and
+// everything it spawned counted in user mode.
+//
+// usage: perfstat [-e event]... command [arg...]
+// Counts cycles, instructions, LLC misses and DTLB misses by default.
+
+#include <lib.h>
+
+static const struct {
+	const char *name;
+	uint32_t event;
+} events[] = {
+	{ "cycles",		PERF_CYCLES },
+	{ "instructions",	PERF_INSTRUCTIONS },
+	{ "llc-refs",		PERF_LLC_REFS },
+	{ "llc-misses",		PERF_LLC_MISSES },
+	{ "branches",		PERF_BRANCHES },
+	{ "branch-misses",	PERF_BRANCH_MISSES },
+	{ "dtlb-misses",	PERF_DTLB_MISSES },
+};
+
+static const char *default_events[] = {
+	"cycles", "instructions", "llc-misses", "dtlb-misses",
+};
+
+static void
+usage(void)
+{
+	int i;
+
+	printf("usage: perfstat [-e event]... command [arg...]\nevents:");
+	for (i = 0; i < ARRAY_SIZE(events); i++)
+		printf(" %s", events[i].name);
+	printf("\n");
+	exit();
+}
+
+static int
+find_event(const char *name)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(events); i++)
+		if (!strcmp(name, events[i].name))
+			return i;
+
+	printf("perfstat: unknown event %s\n", name);
+	usage();
+	return -1;
+}
+
+void
+umain(int argc, char **argv)
+{
+	struct PerfConfig pc = { .pc_flags = PERF_INHERIT };
+	const volatile struct EnvPerf *ep;
+	int sel[PERF_NCOUNTERS];
+	int i, j, n = 0, ret;
+	uint32_t t0, t1;
+	envid_t child;
+
+	for (i = 1; i + 1 < argc && !strcmp(argv[i], "-e"); i += 2) {
+		if (n == PERF_NCOUNTERS) {
+			printf("perfstat: at most %d events\n", PERF_NCOUNTERS);
+			exit();
+		}
+		sel[n++] = find_event(argv[i + 1]);
+	}
+	if (i >= argc)
+		usage();
+	if (!n)
+		for (; n < ARRAY_SIZE(default_events); n++)
+			sel[n] = find_event(default_events[n]);
+
+	// the CPU may have fewer counters than asked for
+	for (; n > 0; n--) {
+		memset(pc.pc_event, 0, sizeof(pc.pc_event));
+		for (j = 0; j < n; j++)
+			pc.pc_event[j] = events[sel[j]].event;
+
+		ret = sys_env_set_perf(0, &pc);
+		if (ret != -E_NOT_SUPP)
+			break;
+	}
+	if (ret < 0)
+		panic("no performance counters: %e", ret);
+
+	t0 = sys_time_msec();
+	child = spawn(argv[i], (const char **)argv + i);
+	if (child < 0)
+		panic("spawn %s: %e", argv[i], child);
+	wait(child);
+	t1 = sys_time_msec();
+
+	// the child's counts were folded into ep_child when it was freed
+	ep = &thisenvinfo->env_perf;
+	printf("\nperfstat %s: %u ms\n", argv[i], t1 - t0);
+	for (j = 0; j < n; j++)
+		printf("%16llu %s\n", ep->ep_child[j], events[sel[j]].name);
+
+	if (ep->ep_event[0] == PERF_CYCLES &&
+	    ep->ep_event[1] == PERF_INSTRUCTIONS && ep->ep_child[0])
+		printf("%12llu.%02llu instructions per cycle\n",
+		       ep->ep_child[1] / ep->ep_child[0],
+		       ep->ep_child[1] * 100 / ep->ep_child[0] % 100);
+}
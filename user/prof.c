@@ -0,0 +1,185 @@
+// Sample where every CPU spends its time, then print a flat profile of
+// the functions sampled, grouped by env.
+//
+// usage: prof [msec] [period]
+// Samples every timer tick for one second by default.
+
+#include <lib.h>
+
+#define MAXFUNCS	1024
+#define TOPFUNCS	20	// functions printed per env
+
+static struct ProfPage *pp = (struct ProfPage *)UTEMP;
+static struct ProfEntry funcs[MAXFUNCS];
+static int nfuncs;
+static uint32_t lost;
+
+// Merge a drained page into funcs[]
+static int
+drain(void)
+{
+	struct ProfEntry *pe;
+	uint32_t i;
+	int j, n;
+
+	n = sys_prof(PROF_DRAIN, (uint32_t)pp);
+	if (n < 0)
+		panic("sys_prof: %e", n);
+	lost += pp->pp_lost;
+
+	for (i = 0; i < n; i++) {
+		pe = &pp->pp_entries[i];
+		for (j = 0; j < nfuncs; j++)
+			if (funcs[j].pe_env == pe->pe_env &&
+			    funcs[j].pe_fn == pe->pe_fn)
+				break;
+
+		if (j < nfuncs)
+			funcs[j].pe_count += pe->pe_count;
+		else if (nfuncs < MAXFUNCS)
+			funcs[nfuncs++] = *pe;
+		else
+			lost += pe->pe_count;
+	}
+
+	return n;
+}
+
+static uint32_t
+env_samples(envid_t env)
+{
+	uint32_t total = 0;
+	int i;
+
+	for (i = 0; i < nfuncs; i++)
+		if (funcs[i].pe_env == env)
+			total += funcs[i].pe_count;
+	return total;
+}
+
+// Env with the most samples first, its busiest function first
+static bool
+before(struct ProfEntry *a, uint32_t atotal, struct ProfEntry *b,
+       uint32_t btotal)
+{
+	if (a->pe_env != b->pe_env)
+		return atotal > btotal ||
+		       (atotal == btotal && a->pe_env < b->pe_env);
+	return a->pe_count > b->pe_count;
+}
+
+static void
+sort_funcs(void)
+{
+	static uint32_t totals[MAXFUNCS];
+	struct ProfEntry tmp;
+	uint32_t ttmp;
+	int i, j;
+
+	for (i = 0; i < nfuncs; i++)
+		totals[i] = env_samples(funcs[i].pe_env);
+
+	for (i = 1; i < nfuncs; i++) {
+		tmp = funcs[i];
+		ttmp = totals[i];
+		for (j = i; j > 0 && before(&tmp, ttmp, &funcs[j - 1],
+					   totals[j - 1]); j--) {
+			funcs[j] = funcs[j - 1];
+			totals[j] = totals[j - 1];
+		}
+		funcs[j] = tmp;
+		totals[j] = ttmp;
+	}
+}
+
+static const char *
+env_name(envid_t env)
+{
+	if (!env)
+		return "<kernel>";
+	if (envs[ENVX(env)].env_id != env)
+		return "<exited>";
+	return (const char *)envinfos[ENVX(env)].binaryname;
+}
+
+static void
+print_profile(void)
+{
+	uint32_t total = 0, envtotal = 0;
+	int i, shown = 0;
+
+	for (i = 0; i < nfuncs; i++)
+		total += funcs[i].pe_count;
+	if (!total) {
+		printf("no samples\n");
+		return;
+	}
+
+	printf("%u samples", total);
+	if (lost)
+		printf(", %u lost", lost);
+	printf("\n");
+
+	for (i = 0; i < nfuncs; i++) {
+		if (!i || funcs[i].pe_env != funcs[i - 1].pe_env) {
+			envtotal = env_samples(funcs[i].pe_env);
+			shown = 0;
+			printf("\nenv %08x %s: %u samples, %u%%\n",
+			       funcs[i].pe_env, env_name(funcs[i].pe_env),
+			       envtotal, envtotal * 100 / total);
+			printf("%6s %8s %8s function\n",
+			       "%env", "samples", "address");
+		}
+
+		if (shown++ >= TOPFUNCS)
+			continue;
+		printf("%5u%% %8u %08x %s\n",
+		       funcs[i].pe_count * 100 / envtotal,
+		       funcs[i].pe_count, funcs[i].pe_fn,
+		       funcs[i].pe_name[0] ? funcs[i].pe_name : "?");
+	}
+}
+
+void
+umain(int argc, char **argv)
+{
+	unsigned int msec = 1000, period = 1;
+	uint32_t end;
+	int ret;
+
+	if (argc > 3) {
+		printf("usage: prof [msec] [period]\n");
+		exit();
+	}
+	if (argc > 1)
+		msec = strtol(argv[1], NULL, 0);
+	if (argc > 2)
+		period = strtol(argv[2], NULL, 0);
+
+	ret = sys_page_alloc(0, pp, PTE_W);
+	if (ret < 0)
+		panic("sys_page_alloc: %e", ret);
+
+	// throw away whatever an earlier run left behind
+	while (drain() > 0)
+		;
+	nfuncs = 0;
+	lost = 0;
+
+	ret = sys_prof(PROF_START, period);
+	if (ret < 0)
+		panic("sys_prof: %e", ret);
+
+	end = sys_time_msec() + msec;
+	while (sys_time_msec() < end)
+		sys_yield();
+	sys_prof(PROF_STOP, 0);
+
+	while (drain() > 0)
+		;
+
+	sort_funcs();
+	print_profile();
+
+	sys_page_unmap(0, pp);
+}
@@ -13,5 +13,5 @@ umain(int argc, char **argv)
 	if (argc != 1)
 		usage();
 
-	printf("%s\n", thisenv->currentpath);
+	printf("%s\n", thisenvinfo->currentpath);
 }
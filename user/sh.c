@@ -355,7 +355,7 @@ umain(int argc, char **argv)
 		char *buf;
 		char temp[MAXNAMELEN];
 
-		snprintf(temp, sizeof(temp), "%s$ ", thisenv->currentpath);
+		snprintf(temp, sizeof(temp), "%s$ ", thisenvinfo->currentpath);
 		/* read input until '\n' */
 		buf = readline(inter_active ? temp : NULL);
 		if (buf == NULL) {
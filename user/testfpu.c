@@ -0,0 +1,56 @@
+#include <lib.h>
+
+#define NCHILD	8
+
+// Load xmm0 with four copies of 'v', yield, and check it survived.
+// The compiler is not allowed to use SSE here, so xmm0 is ours.
+static void
+xmm_roundtrip(uint32_t v)
+{
+	uint32_t in[4] = { v, v, v, v };
+	uint32_t out[4];
+
+	asm volatile("movdqu %0, %%xmm0" : : "m" (in));
+	sys_yield();
+	asm volatile("movdqu %%xmm0, %0" : "=m" (out));
+
+	if (out[0] != v || out[1] != v || out[2] != v || out[3] != v)
+		panic("xmm0 is %08x wanted %08x", out[0], v);
+}
+
+void
+umain(int argc, char **argv)
+{
+	int i, j;
+	volatile double x;
+	envid_t parent = sys_getenvid();
+
+	// Fork several environments
+	for (i = 0; i < NCHILD; i++)
+		if (fork() == 0)
+			break;
+
+	if (i == NCHILD) {
+		sys_yield();
+		return;
+	}
+
+	// Wait for the parent to finish forking
+	while (envs[ENVX(parent)].env_status != ENV_FREE)
+		asm volatile("pause");
+
+	// Each environment keeps its own x87 and SSE registers
+	// across context switches.
+	for (j = 0, x = i; j < 100; j++) {
+		xmm_roundtrip(thisenv->env_id + j);
+		x = x * 2 + 1;
+		sys_yield();
+		x = (x - 1) / 2;
+	}
+
+	if (x != i)
+		panic("x87 state corrupted: %f wanted %d", x, i);
+
+	cprintf("[%08x] testfpu OK on CPU %d\n",
+			thisenv->env_id, thisenv->env_cpunum);
+}
@@ -0,0 +1,95 @@
+#include <lib.h>
+
+#define NFILE	8
+
+static struct Ring ring;
+
+static const char *files[NFILE] = {
+	"/motd", "/newmotd", "/lorem", "/script",
+	"/motd", "/newmotd", "/lorem", "/script",
+};
+
+static struct ring_cqe *
+xwait(void)
+{
+	struct ring_cqe *cqe;
+
+	cqe = ring_wait(&ring);
+	if (!cqe)
+		panic("ring_wait: nothing in flight");
+	if (cqe->cqe_res < 0)
+		panic("ring request %d: %e", cqe->cqe_data, cqe->cqe_res);
+
+	return cqe;
+}
+
+void
+umain(int argc, char **argv)
+{
+	int ret, i, fd, n;
+	int ids[NFILE];
+	char buf[512];
+	struct ring_cqe *cqe;
+	struct Fsret_stat *st;
+
+	ret = ring_init(&ring, ENV_TYPE_FS);
+	if (ret < 0)
+		panic("ring_init: %e", ret);
+
+	/* one batch of opens */
+	for (i = 0; i < NFILE; i++) {
+		ret = ring_prep_open(&ring, files[i], O_RDONLY, i);
+		if (ret < 0)
+			panic("ring_prep_open %s: %e", files[i], ret);
+	}
+	if ((ret = ring_submit(&ring)) != NFILE)
+		panic("ring_submit returned %d wanted %d", ret, NFILE);
+
+	for (i = 0; i < NFILE; i++) {
+		cqe = xwait();
+		ids[cqe->cqe_data] = cqe->cqe_res;
+		ring_seen(&ring, cqe);
+	}
+	cprintf("ring open is good\n");
+
+	/* one batch of stats and reads, checked against read(2) */
+	for (i = 0; i < NFILE; i++) {
+		ring_prep_stat(&ring, ids[i], i);
+		ring_prep_read(&ring, ids[i], sizeof(buf), NFILE + i);
+	}
+	ring_submit(&ring);
+
+	for (i = 0; i < 2 * NFILE; i++) {
+		cqe = xwait();
+		if (cqe->cqe_data < NFILE) {
+			st = ring_buf(&ring, cqe->cqe_buf);
+			if (strcmp(st->ret_name, files[cqe->cqe_data] + 1) != 0)
+				panic("ring stat returned name %s wanted %s",
+				      st->ret_name, files[cqe->cqe_data] + 1);
+		} else {
+			fd = open(files[cqe->cqe_data - NFILE], O_RDONLY);
+			if (fd < 0)
+				panic("open %s: %e", files[cqe->cqe_data - NFILE], fd);
+			n = readn(fd, buf, sizeof(buf));
+			close(fd);
+
+			if (n != cqe->cqe_res ||
+			    memcmp(buf, ring_buf(&ring, cqe->cqe_buf), n) != 0)
+				panic("ring read of %s returned wrong data",
+				      files[cqe->cqe_data - NFILE]);
+		}
+		ring_seen(&ring, cqe);
+	}
+	cprintf("ring stat and read are good\n");
+
+	for (i = 0; i < NFILE; i++)
+		ring_prep_close(&ring, ids[i], i);
+	ring_submit(&ring);
+
+	for (i = 0; i < NFILE; i++)
+		ring_seen(&ring, xwait());
+
+	if (ring_wait(&ring))
+		panic("ring_wait returned a completion with nothing in flight");
+	cprintf("ring close is good\n");
+}
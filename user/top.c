@@ -0,0 +1,141 @@
+// Show per-environment CPU usage, run-queue wait, IPC and page fault
+// rates, refreshed every second.
+//
+// usage: top [iterations]
+
+#include <lib.h>
+#include <x86.h>
+
+#define MAXROWS		20
+
+static struct DebugEnvStat cur[NENV], prev[NENV];
+static int ncur, nprev;
+
+struct Row {
+	envid_t env;
+	uint64_t user, kern, wait;
+	uint32_t sent, recv, faults;
+};
+
+static struct Row rows[NENV];
+
+static int
+snapshot(int fd, struct DebugEnvStat *stats)
+{
+	int n;
+
+	if (write(fd, "stat", 4) < 0)
+		return 0;
+
+	n = read(fd, stats, NENV * sizeof(*stats));
+	return n < 0 ? 0 : n / sizeof(*stats);
+}
+
+static const struct DebugEnvStat *
+find_prev(envid_t env)
+{
+	int i;
+
+	for (i = 0; i < nprev; i++)
+		if (prev[i].ds_env == env)
+			return &prev[i];
+
+	return NULL;
+}
+
+// Percentage of 'span' TSC cycles, with one decimal
+static void
+print_pct(uint64_t cycles, uint64_t span)
+{
+	uint32_t permille = span ? (uint32_t)(cycles * 1000 / span) : 0;
+
+	printf(" %4u.%u", permille / 10, permille % 10);
+}
+
+static void
+show(uint64_t span, uint32_t msec)
+{
+	const struct DebugEnvStat *p;
+	struct EnvStat zero = {0};
+	const struct EnvStat *a, *b;
+	struct Row tmp;
+	int i, j, n = 0;
+
+	for (i = 0; i < ncur; i++) {
+		p = find_prev(cur[i].ds_env);
+		a = p ? &p->ds_stat : &zero;
+		b = &cur[i].ds_stat;
+
+		rows[n].env = cur[i].ds_env;
+		rows[n].user = b->es_user - a->es_user;
+		rows[n].kern = b->es_kern - a->es_kern;
+		rows[n].wait = b->es_wait - a->es_wait;
+		rows[n].sent = b->es_ipc_sent - a->es_ipc_sent;
+		rows[n].recv = b->es_ipc_recv - a->es_ipc_recv;
+		rows[n].faults = b->es_pgfaults - a->es_pgfaults;
+		n++;
+	}
+
+	// busiest first
+	for (i = 0; i < n && i < MAXROWS; i++)
+		for (j = i + 1; j < n; j++)
+			if (rows[j].user + rows[j].kern >
+			    rows[i].user + rows[i].kern) {
+				tmp = rows[i];
+				rows[i] = rows[j];
+				rows[j] = tmp;
+			}
+
+	printf("\n%d envs, %u ms\n", ncur, msec);
+	printf("%8s %16s %6s %6s %6s %8s %8s %8s\n", "Env", "Name",
+	       "%usr", "%sys", "%wait", "send/s", "recv/s", "fault/s");
+
+	for (i = 0; i < n && i < MAXROWS; i++) {
+		printf("%8x %16s", rows[i].env,
+		       envinfos[ENVX(rows[i].env)].binaryname);
+		print_pct(rows[i].user, span);
+		print_pct(rows[i].kern, span);
+		print_pct(rows[i].wait, span);
+		printf(" %8u %8u %8u\n",
+		       rows[i].sent * 1000 / msec,
+		       rows[i].recv * 1000 / msec,
+		       rows[i].faults * 1000 / msec);
+	}
+}
+
+void
+umain(int argc, char **argv)
+{
+	int fd, iter, n = -1;
+	uint32_t t0, t1, end;
+	uint64_t tsc0, tsc1;
+
+	if (argc > 1)
+		n = strtol(argv[1], NULL, 0);
+
+	fd = opendebug();
+	if (fd < 0)
+		panic("opendebug: %e", fd);
+
+	nprev = snapshot(fd, prev);
+	tsc0 = read_tsc();
+	t0 = sys_time_msec();
+
+	for (iter = 0; n < 0 || iter < n; iter++) {
+		end = t0 + 1000;
+		while ((t1 = sys_time_msec()) < end)
+			sys_yield();
+
+		ncur = snapshot(fd, cur);
+		tsc1 = read_tsc();
+
+		show(tsc1 - tsc0, t1 - t0);
+
+		memcpy(prev, cur, ncur * sizeof(cur[0]));
+		nprev = ncur;
+		tsc0 = tsc1;
+		t0 = t1;
+	}
+
+	close(fd);
+}
@@ -0,0 +1,124 @@
+// Enable kernel tracepoints, then drain and print the events they log.
+//
+// usage: trace [msec] [event ...]
+// Traces all events for one second by default.
+
+#include <lib.h>
+
+#define DRAIN_MSEC	10
+
+static struct TracePage *tp = (struct TracePage *)UTEMP;
+
+static void
+usage(void)
+{
+	int i;
+
+	printf("usage: trace [msec] [event ...]\nevents:");
+	for (i = 0; i < NTRACE; i++)
+		printf(" %s", trace_names[i]);
+	printf("\n");
+	exit();
+}
+
+static uint32_t
+parse_event(const char *name)
+{
+	int i;
+
+	for (i = 0; i < NTRACE; i++)
+		if (!strcmp(name, trace_names[i]))
+			return 1 << i;
+
+	printf("trace: unknown event %s\n", name);
+	usage();
+	return 0;
+}
+
+// Events of one page are ordered per CPU; merge them by time stamp
+static void
+sort_events(struct TraceEvent *ev, int n)
+{
+	struct TraceEvent tmp;
+	int i, j;
+
+	for (i = 1; i < n; i++) {
+		tmp = ev[i];
+		for (j = i; j > 0 && ev[j - 1].te_tsc > tmp.te_tsc; j--)
+			ev[j] = ev[j - 1];
+		ev[j] = tmp;
+	}
+}
+
+static int
+drain(uint64_t *first)
+{
+	struct TraceEvent *te;
+	int i, n;
+
+	n = sys_trace(TRACE_DRAIN, (uint32_t)tp);
+	if (n < 0)
+		panic("sys_trace: %e", n);
+
+	if (tp->tp_dropped)
+		printf("(%u events dropped)\n", tp->tp_dropped);
+
+	sort_events(tp->tp_events, n);
+	for (i = 0; i < n; i++) {
+		te = &tp->tp_events[i];
+		if (!*first)
+			*first = te->te_tsc;
+
+		printf("%12u %d %08x %-9s %08x %08x %08x %08x\n",
+		       (uint32_t)(te->te_tsc - *first), te->te_cpu,
+		       te->te_env, trace_names[te->te_event],
+		       te->te_arg[0], te->te_arg[1],
+		       te->te_arg[2], te->te_arg[3]);
+	}
+
+	return n;
+}
+
+void
+umain(int argc, char **argv)
+{
+	uint32_t mask = 0, end, next;
+	unsigned int msec = 1000;
+	uint64_t first = 0;
+	int i, ret;
+
+	i = 1;
+	if (argc > 1 && argv[1][0] >= '0' && argv[1][0] <= '9')
+		msec = strtol(argv[i++], NULL, 0);
+
+	for (; i < argc; i++)
+		mask |= parse_event(argv[i]);
+	if (!mask)
+		mask = TRACE_ALL;
+
+	ret = sys_page_alloc(0, tp, PTE_W);
+	if (ret < 0)
+		panic("sys_page_alloc: %e", ret);
+
+	// throw away whatever an earlier run left behind
+	while (sys_trace(TRACE_DRAIN, (uint32_t)tp) > 0)
+		;
+
+	printf("%12s %s %8s %-9s %s\n", "cycles", "C", "env", "event", "args");
+
+	sys_trace(TRACE_MASK, mask);
+	end = sys_time_msec() + msec;
+	do {
+		next = sys_time_msec() + DRAIN_MSEC;
+		while (sys_time_msec() < next)
+			sys_yield();
+		while (drain(&first) == TRACE_PAGE_EVENTS)
+			;
+	} while (sys_time_msec() < end);
+	sys_trace(TRACE_MASK, 0);
+
+	while (drain(&first) > 0)
+		;
+
+	sys_page_unmap(0, tp);
+}